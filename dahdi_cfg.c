@@ -37,10 +37,14 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
 #include <semaphore.h>
 #include <errno.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <dahdi/user.h>
 #include "tonezone.h"
@@ -48,6 +52,7 @@
 
 #define CONFIG_FILENAME "/etc/dahdi/system.conf"
 #define MASTER_DEVICE   "/dev/dahdi/ctl"
+#define STATE_FILENAME  "/var/run/dahdi_cfg.state"
 
 #define NUM_SPANS DAHDI_MAX_SPANS
 
@@ -65,8 +70,6 @@
 
 static int lineno=0;
 
-static FILE *cf;
-
 static char *filename=CONFIG_FILENAME;
 
 int rxtones[NUM_TONES + 1],rxtags[NUM_TONES + 1],txtones[NUM_TONES + 1];
@@ -88,41 +91,88 @@ static int deftonezone = -1;
 
 static struct dahdi_lineconfig lc[DAHDI_MAX_SPANS];
 
-static struct dahdi_chanconfig cc[DAHDI_MAX_CHANNELS];
+/*
+ * What the configuration says about a channel. There is one only for the
+ * channels it mentions, found through chanconfs[], sorted by channel
+ * number: going over the channels costs what is configured rather than
+ * DAHDI_MAX_CHANNELS, and an entry stays where it is once made.
+ */
+struct chan_conf {
+	int chan;
+	struct dahdi_chanconfig cc;
+	struct dahdi_attach_echocan ae;
+	const char *sig;		/* Signalling */
+	int slineno;			/* Line number where signalling specified */
+	int fiftysixkhdlc;
+	/* The configuration last applied, from STATE_FILENAME (for -i) */
+	struct dahdi_chanconfig old_cc;
+	struct dahdi_attach_echocan old_ae;
+	int old_fiftysixkhdlc;
+	int recheck;			/* compare with the kernel, as without -i */
+	int configured;			/* by this run */
+	int job;			/* span job, -1 for the main thread (-j) */
+};
+
+static struct chan_conf **chanconfs;
+static int numchanconfs;
+static int chanconfs_size;
+
+/* Channel numbers from a list such as "1-15,17-31": sorted, each once */
+struct chan_list {
+	int *chans;
+	int count;
+	int size;
+};
 
 static int only_span = 0;
 static int restrict_channels = 0;
-static int selected_channels[DAHDI_MAX_CHANNELS];
+static struct chan_list selected_channels;
 static int declared_spans[DAHDI_MAX_SPANS];
 
-static struct dahdi_attach_echocan ae[DAHDI_MAX_CHANNELS];
-
-static struct dahdi_dynamic_span zds[NUM_DYNAMIC];
-
-static const char *sig[DAHDI_MAX_CHANNELS];		/* Signalling */
-
-static int slineno[DAHDI_MAX_CHANNELS];	/* Line number where signalling specified */
-
-static int fiftysixkhdlc[DAHDI_MAX_CHANNELS];
+static struct dahdi_dynamic_span *zds;
+static int zds_size;
 
 static int spans=0;
 
 static int dry_run = 0;
 
+static char *plan_file = NULL;	/* -p */
+
 static int verbose = 0;
 
 static int force = 0;
 
 static int stopmode = 0;
 
+static int jobs = 1;
+
 static int numdynamic = 0;
 
 static char zonestoload[DAHDI_TONE_ZONE_MAX][10];
 
 static int numzones = 0;
+static int zones_failed = 0;	/* a zone did not load: not saved in the state */
 
 static int fd = -1;
 
+/* The configuration last applied, from STATE_FILENAME (for -i) */
+static int incremental = 0;
+static int have_state = 0;
+static struct dahdi_lineconfig old_lc[DAHDI_MAX_SPANS];
+static int old_spans;
+static struct dahdi_dynamic_span *old_zds;
+static int old_numdynamic;
+static char old_zonestoload[DAHDI_TONE_ZONE_MAX][10];
+static int old_numzones;
+static int old_deftonezone;
+
+/* Compare all channels with the kernel, as without -i */
+static int recheck_all = 0;
+
+/* What was done, for the report of -i */
+static int spans_changed, chans_changed, echocans_changed, chans_total;
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static const char *lbostr[] = {
 "0 db (CSU)/0-133 feet (DSX-1)",
 "133-266 feet (DSX-1)",
@@ -329,10 +379,289 @@ static char *trim(char *buf)
 	return buf;
 }
 
+/*
+ * Every ioctl goes through cfg_ioctl(). For -p it is timed and recorded,
+ * and in test mode only those that just read something are issued: the
+ * others are recorded as they would have been.
+ */
+struct ioctl_record {
+	const char *name;	/* DAHDI_xxx */
+	const char *what;	/* what target is: "span", "channel"... */
+	int target;
+	const char *label_key;	/* and some name to go with it */
+	const char *label;
+	double start;		/* since dahdi_cfg started, in seconds */
+	double latency;
+	int res;
+	int err;
+	int issued;
+};
+
+static struct ioctl_record *ioctl_log;
+static int ioctl_log_len, ioctl_log_size;
+static pthread_mutex_t ioctl_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static double start_time;
+
+/* Where the time went, for -p */
+#define MAX_PHASES	16
+static struct {
+	const char *name;
+	double start;
+} phases[MAX_PHASES];
+static int numphases;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void begin_phase(const char *name)
+{
+	if (!plan_file || numphases >= MAX_PHASES)
+		return;
+	phases[numphases].name = name;
+	phases[numphases++].start = now();
+}
+
+/* Ioctls that change nothing, which test mode still issues */
+static int ioctl_reads(unsigned long req)
+{
+	switch (req) {
+	case DAHDI_GET_PARAMS:
+	case DAHDI_GETVERSION:
+	case DAHDI_RADIO_GETPARAM:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void describe_ioctl(unsigned long req, void *arg, struct ioctl_record *r)
+{
+	r->target = -1;
+	switch (req) {
+	case DAHDI_SPANCONFIG:
+		r->what = "span";
+		r->target = ((struct dahdi_lineconfig *)arg)->span;
+		break;
+	case DAHDI_STARTUP:
+	case DAHDI_SHUTDOWN:
+		r->what = "span";
+		r->target = *(int *)arg;
+		break;
+	case DAHDI_CHANCONFIG:
+		r->what = "channel";
+		r->target = ((struct dahdi_chanconfig *)arg)->chan;
+		break;
+	case DAHDI_ATTACH_ECHOCAN:
+		r->what = "channel";
+		r->target = ((struct dahdi_attach_echocan *)arg)->chan;
+		r->label_key = "echocan";
+		r->label = ((struct dahdi_attach_echocan *)arg)->echocan;
+		break;
+	case DAHDI_GET_PARAMS:
+		r->what = "channel";
+		r->target = ((struct dahdi_params *)arg)->channo &
+			~DAHDI_GET_PARAMS_RETURN_MASTER;
+		break;
+	case DAHDI_SPECIFY:
+		r->what = "channel";
+		r->target = *(int *)arg;
+		break;
+	case DAHDI_DYNAMIC_CREATE:
+	case DAHDI_DYNAMIC_DESTROY:
+		r->label_key = "address";
+		r->label = ((struct dahdi_dynamic_span *)arg)->addr;
+		break;
+	case DAHDI_DEFAULTZONE:
+		r->what = "zone";
+		r->target = *(int *)arg;
+		break;
+	case DAHDI_RADIO_GETPARAM:
+	case DAHDI_RADIO_SETPARAM:
+		r->what = "radpar";
+		r->target = ((struct dahdi_radio_param *)arg)->radpar;
+		break;
+	}
+}
+
+/* Keep r, which started at t; the strings it points to must last */
+static void record_ioctl(struct ioctl_record *r, double t)
+{
+	struct ioctl_record *tmp;
+
+	r->latency = now() - t;
+	r->start = t - start_time;
+	pthread_mutex_lock(&ioctl_log_lock);
+	if (ioctl_log_len == ioctl_log_size) {
+		tmp = realloc(ioctl_log, (ioctl_log_size + 256) * sizeof(*tmp));
+		if (tmp) {
+			ioctl_log = tmp;
+			ioctl_log_size += 256;
+		}
+	}
+	if (ioctl_log_len < ioctl_log_size)
+		ioctl_log[ioctl_log_len++] = *r;
+	pthread_mutex_unlock(&ioctl_log_lock);
+}
+
+#define cfg_ioctl(fd, req, arg)	logged_ioctl(fd, req, #req, arg)
+
+static int logged_ioctl(int fd, unsigned long req, const char *name, void *arg)
+{
+	struct ioctl_record r;
+	double t;
+
+	if (!plan_file)
+		return (!dry_run || ioctl_reads(req)) ? ioctl(fd, req, arg) : 0;
+
+	memset(&r, 0, sizeof(r));
+	r.name = name;
+	describe_ioctl(req, arg, &r);
+	r.issued = !dry_run || ioctl_reads(req);
+	t = now();
+	if (r.issued) {
+		r.res = ioctl(fd, req, arg);
+		r.err = r.res ? errno : 0;
+	}
+	record_ioctl(&r, t);
+	errno = r.err;
+	return r.res;
+}
+
+/* tone_zone_register(), which issues DAHDI_LOADZONE */
+static int load_zone(int ctlfd, char *zone)
+{
+	struct ioctl_record r;
+	double t;
+
+	if (!plan_file)
+		return dry_run ? 0 : tone_zone_register(ctlfd, zone);
+
+	memset(&r, 0, sizeof(r));
+	r.name = "DAHDI_LOADZONE";
+	r.target = -1;
+	r.label_key = "zone";
+	r.label = zone;
+	r.issued = !dry_run;
+	t = now();
+	if (r.issued) {
+		r.res = tone_zone_register(ctlfd, zone);
+		r.err = r.res ? errno : 0;
+	}
+	record_ioctl(&r, t);
+	errno = r.err;
+	return r.res;
+}
+
+static void out_of_memory(void)
+{
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+}
+
+/* Where channel x is, or would go, in chanconfs[] */
+static int chan_index(int x)
+{
+	int lo = 0, hi = numchanconfs, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (chanconfs[mid]->chan < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The configuration of channel x, NULL if none mentions it */
+static struct chan_conf *find_chan(int x)
+{
+	int i = chan_index(x);
+
+	if (i < numchanconfs && chanconfs[i]->chan == x)
+		return chanconfs[i];
+	return NULL;
+}
+
+/* The same, made if need be */
+static struct chan_conf *get_chan(int x)
+{
+	struct chan_conf **tmp;
+	struct chan_conf *c;
+	int i = chan_index(x);
+
+	if (i < numchanconfs && chanconfs[i]->chan == x)
+		return chanconfs[i];
+	if (numchanconfs == chanconfs_size) {
+		tmp = realloc(chanconfs, (chanconfs_size ? chanconfs_size * 2 : 64) * sizeof(*tmp));
+		if (!tmp)
+			out_of_memory();
+		chanconfs = tmp;
+		chanconfs_size = chanconfs_size ? chanconfs_size * 2 : 64;
+	}
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		out_of_memory();
+	c->chan = x;
+	/* Channels mostly come in order: then nothing moves */
+	memmove(&chanconfs[i + 1], &chanconfs[i], (numchanconfs - i) * sizeof(*chanconfs));
+	chanconfs[i] = c;
+	numchanconfs++;
+	return c;
+}
+
+static void add_chan(struct chan_list *list, int x)
+{
+	int *tmp;
+
+	if (list->count == list->size) {
+		tmp = realloc(list->chans, (list->size ? list->size * 2 : 64) * sizeof(*tmp));
+		if (!tmp)
+			out_of_memory();
+		list->chans = tmp;
+		list->size = list->size ? list->size * 2 : 64;
+	}
+	list->chans[list->count++] = x;
+}
+
+static int cmp_chan(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void sort_chan_list(struct chan_list *list)
+{
+	int x, n;
+
+	for (x = 1; x < list->count; x++) {
+		if (list->chans[x] <= list->chans[x - 1])
+			break;
+	}
+	if (x >= list->count)
+		return;
+	qsort(list->chans, list->count, sizeof(list->chans[0]), cmp_chan);
+	for (x = 1, n = 1; x < list->count; x++) {
+		if (list->chans[x] != list->chans[n - 1])
+			list->chans[n++] = list->chans[x];
+	}
+	list->count = n;
+}
+
+static int in_chan_list(const struct chan_list *list, int x)
+{
+	return list->count &&
+		bsearch(&x, list->chans, list->count, sizeof(list->chans[0]), cmp_chan) != NULL;
+}
+
 static int skip_channel(int x)
 {
 	if (restrict_channels) {
-		if (!selected_channels[x])
+		if (!in_chan_list(&selected_channels, x))
 			return 1;
 	} else {
 		if (only_span && !declared_spans[only_span]) {
@@ -375,6 +704,7 @@ static int parseargs(char *input, char *output[], int maxargs, char sep)
 int dspanconfig(char *keyword, char *args)
 {
 	static char *realargs[10];
+	struct dahdi_dynamic_span *tmp;
 	int res;
 	int chans;
 	int timing;
@@ -400,6 +730,18 @@ int dspanconfig(char *keyword, char *args)
 	}
 
 
+	if (numdynamic >= NUM_DYNAMIC) {
+		error("Too many dynamic spans (max %d)\n", NUM_DYNAMIC);
+		return -1;
+	}
+	if (numdynamic == zds_size) {
+		tmp = realloc(zds, (zds_size ? zds_size * 2 : 16) * sizeof(*tmp));
+		if (!tmp)
+			out_of_memory();
+		zds = tmp;
+		zds_size = zds_size ? zds_size * 2 : 16;
+	}
+	memset(&zds[numdynamic], 0, sizeof(zds[0]));
 	dahdi_copy_string(zds[numdynamic].driver, realargs[0], sizeof(zds[numdynamic].driver));
 	dahdi_copy_string(zds[numdynamic].addr, realargs[1], sizeof(zds[numdynamic].addr));
 	zds[numdynamic].numchans = chans;
@@ -498,7 +840,7 @@ int spanconfig(char *keyword, char *args)
 	return 0;
 }
 
-int apply_channels(int chans[], char *argstr)
+int apply_channels(struct chan_list *chans, char *argstr)
 {
 	char *args[DAHDI_MAX_CHANNELS+1];
 	char *range[3];
@@ -541,7 +883,7 @@ int apply_channels(int chans[], char *argstr)
 				return -1;
 			}
 			for (y=start;y<=finish;y++)
-				chans[y]=1;
+				add_chan(chans, y);
 		} else {
 			/* It's a single channel */
 			res2 =sscanf(args[x], "%d", &chan);
@@ -552,9 +894,10 @@ int apply_channels(int chans[], char *argstr)
 				error("Channel must be between 1 and %d (not '%d')\n", DAHDI_MAX_CHANNELS - 1, chan);
 				return -1;
 			}
-			chans[chan]=1;
+			add_chan(chans, chan);
 		}		
 	}
+	sort_chan_list(chans);
 	return res;
 }
 
@@ -593,153 +936,160 @@ static int parse_channel(char *channel, int *startchan)
 
 static int chanconfig(char *keyword, char *args)
 {
-	int chans[DAHDI_MAX_CHANNELS];
+	static struct chan_list chans;
+	struct chan_conf *c, *d = NULL;
 	int res = 0;
-	int x;
+	int i, x;
 	int master=0;
 	int dacschan = 0;
 	char *idle;
-	bzero(chans, sizeof(chans));
+	chans.count = 0;
 	strtok(args, ":");
 	idle = strtok(NULL, ":");
 	if (!strcasecmp(keyword, "dacs") || !strcasecmp(keyword, "dacsrbs")) {
 		res = parse_channel(idle, &dacschan);
 	}
 	if (!res)
-		res = apply_channels(chans, args);
+		res = apply_channels(&chans, args);
 	if (res <= 0)
 		return -1;
-	for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-		if (chans[x]) {
-			if (slineno[x]) {
-				error("Channel %d already configured as '%s' at line %d\n", x, sig[x], slineno[x]);
-				continue;
+	for (i = 0; i < chans.count; i++) {
+		x = chans.chans[i];
+		c = get_chan(x);
+		if (c->slineno) {
+			error("Channel %d already configured as '%s' at line %d\n", x, c->sig, c->slineno);
+			continue;
+		}
+		if (dacschan) {
+			if (dacschan >= DAHDI_MAX_CHANNELS) {
+				error("DACS Destination channel %d is out of range\n", dacschan);
+				return -1;
 			}
-			if ((!strcasecmp(keyword, "dacs") || !strcasecmp(keyword, "dacsrbs")) && slineno[dacschan]) {
-				error("DACS Destination channel %d already configured as '%s' at line %d\n", dacschan, sig[dacschan], slineno[dacschan]);
+			d = get_chan(dacschan);
+			if (d->slineno) {
+				error("DACS Destination channel %d already configured as '%s' at line %d\n", dacschan, d->sig, d->slineno);
 				continue;
+			}
+			d->cc.chan = dacschan;
+			d->cc.master = dacschan;
+			d->slineno = lineno;
+		}
+		c->cc.chan = x;
+		c->cc.master = x;
+		c->slineno = lineno;
+		if (!strcasecmp(keyword, "e&m")) {
+			c->cc.sigtype = DAHDI_SIG_EM;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "e&me1")) {
+			c->cc.sigtype = DAHDI_SIG_EM_E1;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "fxsls")) {
+			c->cc.sigtype = DAHDI_SIG_FXSLS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "fxsgs")) {
+			c->cc.sigtype = DAHDI_SIG_FXSGS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "fxsks")) {
+			c->cc.sigtype = DAHDI_SIG_FXSKS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "fxols")) {
+			c->cc.sigtype = DAHDI_SIG_FXOLS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "fxogs")) {
+			c->cc.sigtype = DAHDI_SIG_FXOGS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "fxoks")) {
+			c->cc.sigtype = DAHDI_SIG_FXOKS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "cas") || !strcasecmp(keyword, "user")) {
+			if (parse_idle(&c->cc.idlebits, idle))
+				return -1;
+			c->cc.sigtype = DAHDI_SIG_CAS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "dacs")) {
+			/* Setup channel for monitor */
+			c->cc.idlebits = dacschan;
+			c->cc.sigtype = DAHDI_SIG_DACS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+			/* Setup inverse */
+			d->cc.idlebits = x;
+			d->cc.sigtype = DAHDI_SIG_DACS;
+			c->sig = sigtype_to_str(d->cc.sigtype);
+			dacschan++;
+		} else if (!strcasecmp(keyword, "dacsrbs")) {
+			/* Setup channel for monitor */
+			c->cc.idlebits = dacschan;
+			c->cc.sigtype = DAHDI_SIG_DACS_RBS;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+			/* Setup inverse */
+			d->cc.idlebits = x;
+			d->cc.sigtype = DAHDI_SIG_DACS_RBS;
+			c->sig = sigtype_to_str(d->cc.sigtype);
+			dacschan++;
+		} else if (!strcasecmp(keyword, "unused")) {
+			c->cc.sigtype = 0;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "indclear") || !strcasecmp(keyword, "bchan")) {
+			c->cc.sigtype = DAHDI_SIG_CLEAR;
+			c->sig = sigtype_to_str(c->cc.sigtype);
+		} else if (!strcasecmp(keyword, "clear")) {
+			c->sig = sigtype_to_str(DAHDI_SIG_CLEAR);
+			if (master) {
+				c->cc.sigtype = DAHDI_SIG_SLAVE;
+				c->cc.master = master;
 			} else {
-				cc[dacschan].chan = dacschan;
-				cc[dacschan].master = dacschan;
-				slineno[dacschan] = lineno;
+				c->cc.sigtype = DAHDI_SIG_CLEAR;
+				master = x;
 			}
-			cc[x].chan = x;
-			cc[x].master = x;
-			slineno[x] = lineno;
-			if (!strcasecmp(keyword, "e&m")) {
-				cc[x].sigtype = DAHDI_SIG_EM;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "e&me1")) {
-				cc[x].sigtype = DAHDI_SIG_EM_E1;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxsls")) {
-				cc[x].sigtype = DAHDI_SIG_FXSLS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxsgs")) {
-				cc[x].sigtype = DAHDI_SIG_FXSGS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxsks")) {
-				cc[x].sigtype = DAHDI_SIG_FXSKS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxols")) {
-				cc[x].sigtype = DAHDI_SIG_FXOLS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxogs")) {
-				cc[x].sigtype = DAHDI_SIG_FXOGS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxoks")) {
-				cc[x].sigtype = DAHDI_SIG_FXOKS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "cas") || !strcasecmp(keyword, "user")) {
-				if (parse_idle(&cc[x].idlebits, idle))
-					return -1;
-				cc[x].sigtype = DAHDI_SIG_CAS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "dacs")) {
-				/* Setup channel for monitor */
-				cc[x].idlebits = dacschan;
-				cc[x].sigtype = DAHDI_SIG_DACS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-				/* Setup inverse */
-				cc[dacschan].idlebits = x;
-				cc[dacschan].sigtype = DAHDI_SIG_DACS;
-				sig[x] = sigtype_to_str(cc[dacschan].sigtype);
-				dacschan++;
-			} else if (!strcasecmp(keyword, "dacsrbs")) {
-				/* Setup channel for monitor */
-				cc[x].idlebits = dacschan;
-				cc[x].sigtype = DAHDI_SIG_DACS_RBS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-				/* Setup inverse */
-				cc[dacschan].idlebits = x;
-				cc[dacschan].sigtype = DAHDI_SIG_DACS_RBS;
-				sig[x] = sigtype_to_str(cc[dacschan].sigtype);
-				dacschan++;
-			} else if (!strcasecmp(keyword, "unused")) {
-				cc[x].sigtype = 0;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "indclear") || !strcasecmp(keyword, "bchan")) {
-				cc[x].sigtype = DAHDI_SIG_CLEAR;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "clear")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_CLEAR);
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_CLEAR;
-					master = x;
-				}
-			} else if (!strcasecmp(keyword, "rawhdlc")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_HDLCRAW);
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_HDLCRAW;
-					master = x;
-				}
-			} else if (!strcasecmp(keyword, "nethdlc")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_HDLCNET);
-				memset(cc[x].netdev_name, 0, sizeof(cc[x].netdev_name));
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_HDLCNET;
-					if (idle) {
-					    dahdi_copy_string(cc[x].netdev_name, idle, sizeof(cc[x].netdev_name));
-					}
-					master = x;
-				}
-			} else if (!strcasecmp(keyword, "fcshdlc")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_HDLCFCS);
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_HDLCFCS;
-					master = x;
+		} else if (!strcasecmp(keyword, "rawhdlc")) {
+			c->sig = sigtype_to_str(DAHDI_SIG_HDLCRAW);
+			if (master) {
+				c->cc.sigtype = DAHDI_SIG_SLAVE;
+				c->cc.master = master;
+			} else {
+				c->cc.sigtype = DAHDI_SIG_HDLCRAW;
+				master = x;
+			}
+		} else if (!strcasecmp(keyword, "nethdlc")) {
+			c->sig = sigtype_to_str(DAHDI_SIG_HDLCNET);
+			memset(c->cc.netdev_name, 0, sizeof(c->cc.netdev_name));
+			if (master) {
+				c->cc.sigtype = DAHDI_SIG_SLAVE;
+				c->cc.master = master;
+			} else {
+				c->cc.sigtype = DAHDI_SIG_HDLCNET;
+				if (idle) {
+				    dahdi_copy_string(c->cc.netdev_name, idle, sizeof(c->cc.netdev_name));
 				}
-			} else if (!strcasecmp(keyword, "dchan")) {
-				sig[x] = "D-channel";
-				cc[x].sigtype = DAHDI_SIG_HDLCFCS;
-			} else if (!strcasecmp(keyword, "hardhdlc")) {
-				sig[x] = "Hardware assisted D-channel";
-				cc[x].sigtype = DAHDI_SIG_HARDHDLC;
-			} else if (!strcasecmp(keyword, "mtp2")) {
-				sig[x] = "MTP2";
-				cc[x].sigtype = DAHDI_SIG_MTP2;
+				master = x;
+			}
+		} else if (!strcasecmp(keyword, "fcshdlc")) {
+			c->sig = sigtype_to_str(DAHDI_SIG_HDLCFCS);
+			if (master) {
+				c->cc.sigtype = DAHDI_SIG_SLAVE;
+				c->cc.master = master;
 			} else {
-				fprintf(stderr, "Huh? (%s)\n", keyword);
+				c->cc.sigtype = DAHDI_SIG_HDLCFCS;
+				master = x;
 			}
+		} else if (!strcasecmp(keyword, "dchan")) {
+			c->sig = "D-channel";
+			c->cc.sigtype = DAHDI_SIG_HDLCFCS;
+		} else if (!strcasecmp(keyword, "hardhdlc")) {
+			c->sig = "Hardware assisted D-channel";
+			c->cc.sigtype = DAHDI_SIG_HARDHDLC;
+		} else if (!strcasecmp(keyword, "mtp2")) {
+			c->sig = "MTP2";
+			c->cc.sigtype = DAHDI_SIG_MTP2;
+		} else {
+			fprintf(stderr, "Huh? (%s)\n", keyword);
+		}
 
-			if (cc[x].sigtype != DAHDI_SIG_CAS &&
-			    cc[x].sigtype != DAHDI_SIG_DACS &&
-			    cc[x].sigtype != DAHDI_SIG_DACS_RBS) {
-				if (NULL != idle) {
-					fprintf(stderr, "WARNING: idlebits are not valid on %s channels.\n", sig[x]);
-				}
+		if (c->cc.sigtype != DAHDI_SIG_CAS &&
+		    c->cc.sigtype != DAHDI_SIG_DACS &&
+		    c->cc.sigtype != DAHDI_SIG_DACS_RBS) {
+			if (NULL != idle) {
+				fprintf(stderr, "WARNING: idlebits are not valid on %s channels.\n", c->sig);
 			}
 		}
 	}
@@ -748,13 +1098,13 @@ static int chanconfig(char *keyword, char *args)
 
 static int setlaw(char *keyword, char *args)
 {
+	static struct chan_list chans;
 	int res;
 	int law;
-	int x;
-	int chans[DAHDI_MAX_CHANNELS];
+	int i;
 
-	bzero(chans, sizeof(chans));
-	res = apply_channels(chans, args);
+	chans.count = 0;
+	res = apply_channels(&chans, args);
 	if (res <= 0)
 		return -1;
 	if (!strcasecmp(keyword, "alaw")) {
@@ -767,83 +1117,101 @@ static int setlaw(char *keyword, char *args)
 		fprintf(stderr, "Huh??? Don't know about '%s' law\n", keyword);
 		return -1;
 	}
-	for (x=0;x<DAHDI_MAX_CHANNELS;x++) {
-		if (chans[x])
-			cc[x].deflaw = law;
-	}
+	for (i = 0; i < chans.count; i++)
+		get_chan(chans.chans[i])->cc.deflaw = law;
 	return 0;
 }
 
 static int setfiftysixkhdlc(char *keyword, char *args)
 {
+	static struct chan_list chans;
 	int res;
+	int i;
 
-	res = apply_channels(fiftysixkhdlc, args);
+	chans.count = 0;
+	res = apply_channels(&chans, args);
 	if (res <= 0)
 		return -1;
 
+	for (i = 0; i < chans.count; i++)
+		get_chan(chans.chans[i])->fiftysixkhdlc = 1;
 	return 0;
 }
 
 static int apply_fiftysix(void)
 {
-	int x;
+	struct chan_conf *c;
+	int i, x;
 	int rate;
 	int chanfd;
 
-	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
-		if (skip_channel(x) || !cc[x].sigtype)
+	for (i = 0; i < numchanconfs; i++) {
+		c = chanconfs[i];
+		x = c->chan;
+		if (skip_channel(x) || !c->cc.sigtype)
+			continue;
+		/* The rate stays set until the channel is configured again */
+		if (have_state && !c->configured && c->fiftysixkhdlc == c->old_fiftysixkhdlc)
 			continue;
 
-		chanfd = open("/dev/dahdi/channel", O_RDWR);
-		if (chanfd == -1) {
-			fprintf(stderr, 
-			    "Couldn't open /dev/dahdi/channel: %s\n", 
-			    strerror(errno));
-			return -1;	
+		/*
+		 * DAHDI_SPECIFY opens the channel in the kernel (driver hooks
+		 * run, a busy channel fails), so test mode only records it.
+		 */
+		chanfd = -1;
+		if (!dry_run) {
+			chanfd = open("/dev/dahdi/channel", O_RDWR);
+			if (chanfd == -1) {
+				fprintf(stderr, 
+				    "Couldn't open /dev/dahdi/channel: %s\n", 
+				    strerror(errno));
+				return -1;	
+			}
 		}
 
-		if (ioctl(chanfd, DAHDI_SPECIFY, &x)) {
+		if (cfg_ioctl(chanfd, DAHDI_SPECIFY, &x)) {
 			close(chanfd);
 			continue;
 		}
 
-		if (fiftysixkhdlc[x]) {
+		if (c->fiftysixkhdlc) {
 			printf("Setting channel %d to 56K mode (only valid on HDLC channels)\n", x);
 			rate = 56;
 		} else {
 			rate = 64;
 		}
 
-		if (ioctl(chanfd, DAHDI_HDLC_RATE, &rate)) {
+		if (cfg_ioctl(chanfd, DAHDI_HDLC_RATE, &rate)) {
 			fprintf(stderr, "Error setting HDLC rate\n");
 			exit(-1);
 		}
-		close(chanfd);
+		if (chanfd != -1)
+			close(chanfd);
 	}
 	return 0;
 }
 
 static int setechocan(char *keyword, char *args)
 {
+	static struct chan_list chans;
+	struct chan_conf *c;
 	int res;
-	int chans[DAHDI_MAX_CHANNELS] = { 0, };
 	char *echocan, *chanlist;
-	unsigned int x;
+	int i;
 
+	chans.count = 0;
 	echocan = strtok(args, ",");
 
 	while ((chanlist = strtok(NULL, ","))) {
-		res = apply_channels(chans, chanlist);
+		res = apply_channels(&chans, chanlist);
 		if (res <= 0) {
 			return -1;
 		}
 	}
 
-	for (x = 0; x < DAHDI_MAX_CHANNELS; x++) {
-		if (chans[x]) {
-			dahdi_copy_string(ae[x].echocan, echocan, sizeof(ae[x].echocan));
-		}
+	for (i = 0; i < chans.count; i++) {
+		c = get_chan(chans.chans[i]);
+		dahdi_copy_string(c->ae.echocan, echocan, sizeof(c->ae.echocan));
 	}
 
 	return 0;
@@ -1194,131 +1562,131 @@ int cor_thresh(char *keyword, char *args)
 
 static int rad_chanconfig(char *keyword, char *args)
 {
-	int chans[DAHDI_MAX_CHANNELS];
+	static struct chan_list chans;
 	int res = 0;
-	int x,i,n;
+	int x,i,j,n;
 	struct dahdi_radio_param p;
 	int chanfd;
 
 	toneindex = 1;
-	bzero(chans, sizeof(chans));
-	res = apply_channels(chans, args);
+	chans.count = 0;
+	res = apply_channels(&chans, args);
 	if (res <= 0)
 		return -1;
-	for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-		if (chans[x]) {
-			const char *CHANNEL_FILENAME = "/dev/dahdi/channel";
-			chanfd = open(CHANNEL_FILENAME, O_RDWR);
-			if (-1 == chanfd) {
-				error("Failed to open '%s'.\n", CHANNEL_FILENAME);
-				exit(-1);
-			}
+	for (j = 0; j < chans.count; j++) {
+		const char *CHANNEL_FILENAME = "/dev/dahdi/channel";
 
-			res = ioctl(chanfd, DAHDI_SPECIFY, &x);
-			if (res) {
-				error("Failed to open channel %d.\n", x);
-				close(chanfd);
-				continue;
-			}
-			p.radpar = DAHDI_RADPAR_NUMTONES;
-			if (ioctl(chanfd,DAHDI_RADIO_GETPARAM,&p) == -1)
-				n = 0;
-			else
-				n = p.data;
+		x = chans.chans[j];
+		chanfd = open(CHANNEL_FILENAME, O_RDWR);
+		if (-1 == chanfd) {
+			error("Failed to open '%s'.\n", CHANNEL_FILENAME);
+			exit(-1);
+		}
 
-			if (n)
+		res = cfg_ioctl(chanfd, DAHDI_SPECIFY, &x);
+		if (res) {
+			error("Failed to open channel %d.\n", x);
+			close(chanfd);
+			continue;
+		}
+		p.radpar = DAHDI_RADPAR_NUMTONES;
+		if (cfg_ioctl(chanfd, DAHDI_RADIO_GETPARAM, &p) == -1)
+			n = 0;
+		else
+			n = p.data;
+
+		if (n)
+		{
+			p.radpar = DAHDI_RADPAR_INITTONE;
+			if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+				error("Cannot init tones for channel %d\n",x);
+			}
+			if (!rxtones[0]) for(i = 1; i <= n; i++)
 			{
-				p.radpar = DAHDI_RADPAR_INITTONE;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1) {
-					error("Cannot init tones for channel %d\n",x);
+				if (rxtones[i])
+				{
+					p.radpar = DAHDI_RADPAR_RXTONE;
+					p.index = i;
+					p.data = rxtones[i];
+					if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+						error("Cannot set rxtone on channel %d\n",x);
 				}
-				if (!rxtones[0]) for(i = 1; i <= n; i++)
+				if (rxtags[i])
 				{
-					if (rxtones[i])
-					{
-						p.radpar = DAHDI_RADPAR_RXTONE;
-						p.index = i;
-						p.data = rxtones[i];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set rxtone on channel %d\n",x);
-					}
-					if (rxtags[i])
-					{
-						p.radpar = DAHDI_RADPAR_RXTONECLASS;
-						p.index = i;
-						p.data = rxtags[i];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set rxtag on channel %d\n",x);
-					}
-					if (txtones[i])
-					{
-						p.radpar = DAHDI_RADPAR_TXTONE;
-						p.index = i;
-						p.data = txtones[i];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set txtone on channel %d\n",x);
-					}
-				} else { /* if we may have DCS receive */
-					if (rxtones[0])
-					{
-						p.radpar = DAHDI_RADPAR_RXTONE;
-						p.index = 0;
-						p.data = rxtones[0];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set DCS rxtone on channel %d\n",x);
-					}
+					p.radpar = DAHDI_RADPAR_RXTONECLASS;
+					p.index = i;
+					p.data = rxtags[i];
+					if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+						error("Cannot set rxtag on channel %d\n",x);
 				}
-				if (txtones[0])
+				if (txtones[i])
 				{
 					p.radpar = DAHDI_RADPAR_TXTONE;
+					p.index = i;
+					p.data = txtones[i];
+					if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+						error("Cannot set txtone on channel %d\n",x);
+				}
+			} else { /* if we may have DCS receive */
+				if (rxtones[0])
+				{
+					p.radpar = DAHDI_RADPAR_RXTONE;
 					p.index = 0;
-					p.data = txtones[0];
-					if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-						error("Cannot set default txtone on channel %d\n",x);
+					p.data = rxtones[0];
+					if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+						error("Cannot set DCS rxtone on channel %d\n",x);
 				}
 			}
-			if (debouncetime)
-			{
-				p.radpar = DAHDI_RADPAR_DEBOUNCETIME;
-				p.data = debouncetime;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-					error("Cannot set debouncetime on channel %d\n",x);
-			}
-			if (bursttime)
-			{
-				p.radpar = DAHDI_RADPAR_BURSTTIME;
-				p.data = bursttime;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-					error("Cannot set bursttime on channel %d\n",x);
-			}
-			p.radpar = DAHDI_RADPAR_DEEMP;
-			p.data = deemp;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_PREEMP;
-			p.data = preemp;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_TXGAIN;
-			p.data = txgain;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_RXGAIN;
-			p.data = rxgain;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_INVERTCOR;
-			p.data = invertcor;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_EXTRXTONE;
-			p.data = exttone;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			if (corthresh)
+			if (txtones[0])
 			{
-				p.radpar = DAHDI_RADPAR_CORTHRESH;
-				p.data = corthresh - 1;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-					error("Cannot set corthresh on channel %d\n",x);
+				p.radpar = DAHDI_RADPAR_TXTONE;
+				p.index = 0;
+				p.data = txtones[0];
+				if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+					error("Cannot set default txtone on channel %d\n",x);
 			}
-
-			close(chanfd);
 		}
+		if (debouncetime)
+		{
+			p.radpar = DAHDI_RADPAR_DEBOUNCETIME;
+			p.data = debouncetime;
+			if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+				error("Cannot set debouncetime on channel %d\n",x);
+		}
+		if (bursttime)
+		{
+			p.radpar = DAHDI_RADPAR_BURSTTIME;
+			p.data = bursttime;
+			if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+				error("Cannot set bursttime on channel %d\n",x);
+		}
+		p.radpar = DAHDI_RADPAR_DEEMP;
+		p.data = deemp;
+		cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+		p.radpar = DAHDI_RADPAR_PREEMP;
+		p.data = preemp;
+		cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+		p.radpar = DAHDI_RADPAR_TXGAIN;
+		p.data = txgain;
+		cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+		p.radpar = DAHDI_RADPAR_RXGAIN;
+		p.data = rxgain;
+		cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+		p.radpar = DAHDI_RADPAR_INVERTCOR;
+		p.data = invertcor;
+		cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+		p.radpar = DAHDI_RADPAR_EXTRXTONE;
+		p.data = exttone;
+		cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+		if (corthresh)
+		{
+			p.radpar = DAHDI_RADPAR_CORTHRESH;
+			p.data = corthresh - 1;
+			if (cfg_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1)
+				error("Cannot set corthresh on channel %d\n",x);
+		}
+
+		close(chanfd);
 	}
 	clear_fields();
 	return 0;
@@ -1328,6 +1696,7 @@ static int rad_chanconfig(char *keyword, char *args)
 
 static void printconfig(int fd)
 {
+	struct chan_conf *c;
 	int x,y;
 	int ps;
 	int configs=0;
@@ -1336,7 +1705,7 @@ static void printconfig(int fd)
 	strcpy(vi.version, "Unknown");
 	strcpy(vi.echo_canceller, "Unknown");
 
-	if (ioctl(fd, DAHDI_GETVERSION, &vi))
+	if (cfg_ioctl(fd, DAHDI_GETVERSION, &vi))
 		error("Unable to read DAHDI version information.\n");
 
 	printf("\nDAHDI Version: %s\n"
@@ -1362,20 +1731,21 @@ static void printconfig(int fd)
 	}
 	if (verbose > 1) {
 		printf("\nChannel map:\n\n");
-		for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-			if (skip_channel(x))
+		for (x = 0; x < numchanconfs; x++) {
+			c = chanconfs[x];
+			if (skip_channel(c->chan))
 				continue;
-			if ((cc[x].sigtype != DAHDI_SIG_SLAVE) && (cc[x].sigtype)) {
+			if ((c->cc.sigtype != DAHDI_SIG_SLAVE) && (c->cc.sigtype)) {
 				configs++;
 				ps = 0;
-				if ((cc[x].sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS)
-					printf("Channel %02d %s to %02d", x, sig[x], cc[x].idlebits);
+				if ((c->cc.sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS)
+					printf("Channel %02d %s to %02d", c->chan, c->sig, c->cc.idlebits);
 				else {
-					printf("Channel %02d: %s (%s)", x, sig[x], laws[cc[x].deflaw]);
-					printf(" (Echo Canceler: %s)", ae[x].echocan[0] ? ae[x].echocan : "none");
-					for (y=1;y<DAHDI_MAX_CHANNELS;y++) {
-						if (cc[y].master == x)  {
-							printf("%s%02d", ps++ ? " " : " (Slaves: ", y);
+					printf("Channel %02d: %s (%s)", c->chan, c->sig, laws[c->cc.deflaw]);
+					printf(" (Echo Canceler: %s)", c->ae.echocan[0] ? c->ae.echocan : "none");
+					for (y = 0; y < numchanconfs; y++) {
+						if (chanconfs[y]->cc.master == c->chan)  {
+							printf("%s%02d", ps++ ? " " : " (Slaves: ", chanconfs[y]->chan);
 						}
 					}
 				}
@@ -1384,19 +1754,20 @@ static void printconfig(int fd)
 				else
 					printf("\n");
 			} else
-				if (cc[x].sigtype) configs++;
+				if (c->cc.sigtype) configs++;
 		}
 	} else {
-		for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-			if (skip_channel(x))
+		for (x = 0; x < numchanconfs; x++) {
+			if (skip_channel(chanconfs[x]->chan))
 				continue;
-			if (cc[x].sigtype)
+			if (chanconfs[x]->cc.sigtype)
 				configs++;
 		}
 	}
 	printf("\n%d channels to configure.\n\n", configs);
 }
 
+
 static struct handler {
 	char *keyword;
 	int (*func)(char *keyword, char *args);
@@ -1449,99 +1820,1235 @@ static struct handler {
 	{ "56k", setfiftysixkhdlc },
 };
 
-static char *readline()
+/*
+ * The state file keeps what was last applied, so that -i can leave alone
+ * what hasn't changed: a header, then the spans, the channels that have a
+ * signalling, the tone zones and the dynamic spans, each as it was given
+ * to the kernel. It only describes the kernel while the DAHDI modules stay
+ * loaded, so it also notes which control device it was applied through.
+ */
+#define STATE_MAGIC	"DAHDICFG"
+#define STATE_VERSION	1
+
+struct state_header {
+	char magic[8];
+	int version;
+	int sizes[4];		/* of the records, to catch a different dahdi/user.h */
+	long long dev_ino;
+	long long dev_ctime;
+	int spans;
+	int channels;
+	int numzones;
+	int numdynamic;
+	int deftonezone;
+};
+
+struct state_channel {
+	struct dahdi_chanconfig cc;
+	struct dahdi_attach_echocan ae;
+	int fiftysixkhdlc;
+};
+
+static void state_sizes(int *sizes)
 {
-	static char buf[256];
-	char *c;
-	do {
-		if (!fgets(buf, sizeof(buf), cf)) 
-			return NULL;
-		/* Strip comments */
-		c = strchr(buf, '#');
-		if (c)
-			*c = '\0';
-		trim(buf);
-		lineno++;
-	} while (!strlen(buf));
-	return buf;
+	sizes[0] = sizeof(struct dahdi_lineconfig);
+	sizes[1] = sizeof(struct state_channel);
+	sizes[2] = sizeof(zonestoload[0]);
+	sizes[3] = sizeof(struct dahdi_dynamic_span);
 }
 
-static void usage(char *argv0, int exitcode)
+/* The control device is made anew each time the modules are loaded */
+static int master_device_id(long long *ino, long long *ctime)
 {
-	char *c;
-	c = strrchr(argv0, '/');
-	if (!c)
-		c = argv0;
-	else
-		c++;
-	fprintf(stderr, "%s\n", dahdi_tools_version);
-	fprintf(stderr, 
-		"Usage: %s [options]\n"
-		"    Valid options are:\n"
-		"  -c <filename>     -- Use <filename> instead of " CONFIG_FILENAME "\n"
-		"  -d [level]        -- Generate debugging output. (Default level is 1.)\n"
-		"  -f                -- Always reconfigure every channel\n"
-		"  -h                -- Generate this help statement\n"
-		"  -s                -- Shutdown spans only\n"
-		"  -t                -- Test mode only, do not apply\n"
-		"  -C <chan_list>    -- Only configure specified channels\n"
-		"  -S <spanno>       -- Only configure specified span\n"
-		"  -v                -- Verbose (more -v's means more verbose)\n"
-	,c);
-	exit(exitcode);
+	struct stat st;
+
+	if (stat(MASTER_DEVICE, &st))
+		return -1;
+	*ino = st.st_ino;
+	*ctime = st.st_ctime;
+	return 0;
 }
 
-static int chan_restrict(char *str)
+/* The channels of a span, from sysfs; -1 if it can't tell */
+static int span_range(int span, int *basechan, int *channels)
 {
-	if (apply_channels(selected_channels, str) < 0)
-		return 0;
-	restrict_channels = 1;
-	return 1;
+	char path[100];
+	FILE *fp;
+	int res;
+
+	snprintf(path, sizeof(path), "/sys/bus/dahdi_spans/devices/span-%d/basechan", span);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	res = fscanf(fp, "%d", basechan);
+	fclose(fp);
+	if (res != 1 || *basechan < 1)
+		return -1;
+	snprintf(path, sizeof(path), "/sys/bus/dahdi_spans/devices/span-%d/channels", span);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	res = fscanf(fp, "%d", channels);
+	fclose(fp);
+	if (res != 1 || *channels < 0)
+		return -1;
+	return 0;
 }
 
-static int span_restrict(char *str)
+/* Returns NULL if the last configuration was loaded, else why not */
+static const char *load_state(void)
 {
-	long	spanno;
-	char	*endptr;
-
-	spanno = strtol(str, &endptr, 10);
-	if (endptr == str) {
-		fprintf(stderr, "Missing valid span number after '-S'\n");
-		return 0;
+	struct state_header hdr;
+	struct state_channel sc;
+	struct dahdi_params p;
+	struct chan_conf *c;
+	int sizes[4];
+	long long ino, ctime;
+	const char *why = NULL;
+	/* Per recorded span: its channels now, and one that was signalled */
+	int basechan[DAHDI_MAX_SPANS], channels[DAHDI_MAX_SPANS];
+	int probe[DAHDI_MAX_SPANS], probe_sigtype[DAHDI_MAX_SPANS];
+	FILE *f;
+	int x, y;
+
+	f = fopen(STATE_FILENAME, "r");
+	if (!f)
+		return strerror(errno);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != STATE_VERSION) {
+		why = "not a dahdi_cfg state file";
+		goto done;
+	}
+	state_sizes(sizes);
+	if (memcmp(hdr.sizes, sizes, sizeof(sizes))) {
+		why = "saved by another version of dahdi_cfg";
+		goto done;
+	}
+	if (master_device_id(&ino, &ctime) || ino != hdr.dev_ino || ctime != hdr.dev_ctime) {
+		why = "DAHDI was loaded again since";
+		goto done;
+	}
+	if (hdr.spans < 0 || hdr.spans > DAHDI_MAX_SPANS ||
+	    hdr.channels < 0 || hdr.channels > DAHDI_MAX_CHANNELS ||
+	    hdr.numzones < 0 || hdr.numzones > DAHDI_TONE_ZONE_MAX ||
+	    hdr.numdynamic < 0 || hdr.numdynamic > NUM_DYNAMIC) {
+		why = "corrupt";
+		goto done;
+	}
+	if (fread(old_lc, sizeof(old_lc[0]), hdr.spans, f) != hdr.spans) {
+		why = "truncated";
+		goto done;
+	}
+	for (y = 0; y < hdr.spans; y++) {
+		if (span_range(old_lc[y].span, &basechan[y], &channels[y])) {
+			why = "sysfs does not show the channels of the spans";
+			goto done;
+		}
+		probe[y] = 0;
 	}
-	if (*endptr != '\0') {
-		fprintf(stderr, "Extra garbage after span number in '-S'\n");
-		return 0;
+	for (x = 0; x < hdr.channels; x++) {
+		if (fread(&sc, sizeof(sc), 1, f) != 1) {
+			why = "truncated";
+			goto done;
+		}
+		if (sc.cc.chan < 1 || sc.cc.chan >= DAHDI_MAX_CHANNELS) {
+			why = "corrupt";
+			goto done;
+		}
+		for (y = 0; y < hdr.spans && sc.cc.sigtype; y++) {
+			if (!probe[y] && sc.cc.chan >= basechan[y] &&
+			    sc.cc.chan < basechan[y] + channels[y]) {
+				probe[y] = sc.cc.chan;
+				probe_sigtype[y] = sc.cc.sigtype;
+			}
+		}
+		/* Channels no longer mentioned are left as they are */
+		c = find_chan(sc.cc.chan);
+		if (!c)
+			continue;
+		memcpy(&c->old_cc, &sc.cc, sizeof(sc.cc));
+		memcpy(&c->old_ae, &sc.ae, sizeof(sc.ae));
+		c->old_fiftysixkhdlc = sc.fiftysixkhdlc;
+	}
+	free(old_zds);
+	old_zds = malloc((hdr.numdynamic ? hdr.numdynamic : 1) * sizeof(old_zds[0]));
+	if (!old_zds)
+		out_of_memory();
+	if (fread(old_zonestoload, sizeof(old_zonestoload[0]), hdr.numzones, f) != hdr.numzones ||
+	    fread(old_zds, sizeof(old_zds[0]), hdr.numdynamic, f) != hdr.numdynamic) {
+		why = "truncated";
+		goto done;
+	}
+	old_spans = hdr.spans;
+	old_numzones = hdr.numzones;
+	old_numdynamic = hdr.numdynamic;
+	old_deftonezone = hdr.deftonezone;
+
+	/*
+	 * One channel per span is enough to see that the span wasn't
+	 * unconfigured (or unassigned and assigned again) since. Such a
+	 * span is forgotten, so it is configured and started as a new one.
+	 */
+	for (y = 0; y < hdr.spans; y++) {
+		if (!probe[y])
+			continue;
+		memset(&p, 0, sizeof(p));
+		p.channo = probe[y];
+		if (!cfg_ioctl(fd, DAHDI_GET_PARAMS, &p) && p.sigtype == probe_sigtype[y])
+			continue;
+		if (verbose > 1)
+			printf("Span %d lost its configuration since the last run\n", old_lc[y].span);
+		memset(&old_lc[y], 0, sizeof(old_lc[y]));
 	}
-	only_span = spanno;
-	return 1;
+done:
+	fclose(f);
+	return why;
 }
 
-static const char *SEM_NAME = "dahdi_cfg";
-static sem_t *lock = SEM_FAILED;
+static void save_state(void)
+{
+	struct state_header hdr;
+	struct state_channel sc;
+	struct chan_conf *c;
+	FILE *f;
+	int x;
+	int res = 0;
 
-static void signal_handler(int signal)
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+	hdr.version = STATE_VERSION;
+	state_sizes(hdr.sizes);
+	if (master_device_id(&hdr.dev_ino, &hdr.dev_ctime))
+		return;
+	hdr.spans = spans;
+	/* With no zones recorded, the next run loads them all again */
+	hdr.numzones = zones_failed ? 0 : numzones;
+	hdr.numdynamic = numdynamic;
+	hdr.deftonezone = deftonezone;
+	for (x = 0; x < numchanconfs; x++) {
+		if (chanconfs[x]->cc.sigtype)
+			hdr.channels++;
+	}
+
+	f = fopen(STATE_FILENAME ".new", "w");
+	if (!f) {
+		if (verbose)
+			fprintf(stderr, "Unable to save configuration state in %s: %s\n", STATE_FILENAME, strerror(errno));
+		return;
+	}
+	res |= fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+	res |= fwrite(lc, sizeof(lc[0]), spans, f) != spans;
+	for (x = 0; x < numchanconfs; x++) {
+		c = chanconfs[x];
+		if (!c->cc.sigtype)
+			continue;
+		memset(&sc, 0, sizeof(sc));
+		memcpy(&sc.cc, &c->cc, sizeof(sc.cc));
+		memcpy(&sc.ae, &c->ae, sizeof(sc.ae));
+		sc.ae.chan = c->chan;
+		sc.fiftysixkhdlc = c->fiftysixkhdlc;
+		res |= fwrite(&sc, sizeof(sc), 1, f) != 1;
+	}
+	res |= fwrite(zonestoload, sizeof(zonestoload[0]), hdr.numzones, f) != hdr.numzones;
+	res |= fwrite(zds, sizeof(zds[0]), numdynamic, f) != numdynamic;
+	res |= fclose(f) != 0;
+	if (res || rename(STATE_FILENAME ".new", STATE_FILENAME)) {
+		fprintf(stderr, "Unable to save configuration state in %s\n", STATE_FILENAME);
+		unlink(STATE_FILENAME ".new");
+	}
+}
+
+static int span_changed(int x)
 {
-	if (SEM_FAILED != lock) {
-		sem_unlink(SEM_NAME);
+	int y;
+
+	if (!have_state)
+		return 1;
+	for (y = 0; y < old_spans; y++) {
+		if (old_lc[y].span == lc[x].span)
+			return memcmp(&old_lc[y], &lc[x], sizeof(lc[x])) != 0;
 	}
-	/* The default handler should have been restored before this handler was
-	 * called, so we can let the "normal" processing finish the cleanup. */
-	raise(signal);
+	return 1;
 }
 
-int main(int argc, char *argv[])
+static int chan_changed(struct chan_conf *c)
 {
-	int c;
-	char *buf;
-	char *key, *value;
-	int x,found;
-	int exit_code = 0;
-	struct sigaction act;
+	return !have_state || memcmp(&c->old_cc, &c->cc, sizeof(c->cc));
+}
 
-	while((c = getopt(argc, argv, "fthc:vsd::C:S:")) != -1) {
-		switch(c) {
-		case 'c':
+static int echocan_changed(struct chan_conf *c)
+{
+	return !have_state || strcmp(c->old_ae.echocan, c->ae.echocan);
+}
+
+static int zones_changed(void)
+{
+	return !have_state || old_numzones != numzones ||
+		memcmp(old_zonestoload, zonestoload, sizeof(zonestoload[0]) * numzones);
+}
+
+static int dynamic_changed(void)
+{
+	return !have_state || old_numdynamic != numdynamic ||
+		(numdynamic && memcmp(old_zds, zds, sizeof(zds[0]) * numdynamic));
+}
+
+/*
+ * A span that is configured again may change what its channels are, so
+ * they are compared with the kernel as without -i. If sysfs can't tell
+ * which channels they are, all channels are.
+ */
+static void recheck_span(int span)
+{
+	int basechan, channels;
+	int x;
+
+	if (span_range(span, &basechan, &channels)) {
+		recheck_all = 1;
+		return;
+	}
+	for (x = chan_index(basechan); x < numchanconfs && chanconfs[x]->chan < basechan + channels; x++)
+		chanconfs[x]->recheck = 1;
+}
+
+/* Counters may be updated by several threads with -j */
+static void add_count(int *counter)
+{
+	pthread_mutex_lock(&count_lock);
+	(*counter)++;
+	pthread_mutex_unlock(&count_lock);
+}
+
+/* Configure a channel, and attach its echo canceller, through ctlfd */
+static int apply_channel(int ctlfd, struct chan_conf *c)
+{
+	struct dahdi_params current_state;
+	int x = c->chan;
+	int master;
+	int needupdate = force;
+	int verify = !have_state || recheck_all || c->recheck;
+
+	if (!c->cc.sigtype)
+		return 0;
+	add_count(&chans_total);
+
+	if (have_state && chan_changed(c)) {
+		needupdate = 1;
+		if (verbose > 1)
+			printf("Channel %d changed\n", c->cc.chan);
+	}
+	
+	if (!needupdate && verify) {
+		memset(&current_state, 0, sizeof(current_state));
+		current_state.channo = c->cc.chan | DAHDI_GET_PARAMS_RETURN_MASTER;
+		if (cfg_ioctl(ctlfd, DAHDI_GET_PARAMS, &current_state))
+			needupdate = 1;
+	}
+	
+	if (!needupdate && verify) {
+		master = current_state.channo >> 16;
+		
+		if (c->cc.sigtype != current_state.sigtype) {
+			needupdate++;
+			if (verbose > 1)
+				printf("Changing signalling on channel %d from %s to %s\n",
+				       c->cc.chan, sigtype_to_str(current_state.sigtype),
+				       sigtype_to_str(c->cc.sigtype));
+		}
+		
+		if ((c->cc.deflaw != DAHDI_LAW_DEFAULT) && (c->cc.deflaw != current_state.curlaw)) {
+			needupdate++;
+			if (verbose > 1)
+				printf("Changing law on channel %d from %s to %s\n",
+				       c->cc.chan, laws[current_state.curlaw],
+				       laws[c->cc.deflaw]);
+		}
+		
+		if (c->cc.master != master) {
+			needupdate++;
+			if (verbose > 1)
+				printf("Changing master of channel %d from %d to %d\n",
+				       c->cc.chan, master,
+				       c->cc.master);
+		}
+		
+		if (c->cc.idlebits != current_state.idlebits) {
+			needupdate++;
+			if (verbose > 1)
+				printf("Changing idle bits of channel %d from %d to %d\n",
+				       c->cc.chan, current_state.idlebits,
+				       c->cc.idlebits);
+		}
+	}
+	
+	if (needupdate && cfg_ioctl(ctlfd, DAHDI_CHANCONFIG, &c->cc)) {
+		fprintf(stderr, "DAHDI_CHANCONFIG failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
+		if (errno == EINVAL) {
+			/* give helpful suggestions on signaling errors */
+			fprintf(stderr, "Selected signaling not "
+					"supported\n");
+			fprintf(stderr, "Possible causes:\n");
+			switch(c->cc.sigtype) {
+			case DAHDI_SIG_FXOKS:
+			case DAHDI_SIG_FXOLS:
+			case DAHDI_SIG_FXOGS:
+				fprintf(stderr, "\tFXO signaling is "
+					"being used on a FXO interface"
+					" (use a FXS signaling variant"
+					")\n");
+				fprintf(stderr, "\tRBS signaling is "
+					"being used on a E1 CCS span"
+					"\n");
+				break;
+			case DAHDI_SIG_FXSKS:
+			case DAHDI_SIG_FXSLS:
+			case DAHDI_SIG_FXSGS:
+				fprintf(stderr, "\tFXS signaling is "
+					"being used on a FXS interface"
+					" (use a FXO signaling variant"
+					")\n");
+				fprintf(stderr, "\tRBS signaling is "
+					"being used on a E1 CCS span"
+					"\n");
+				break;
+			case DAHDI_SIG_EM:
+				fprintf(stderr, "\te&m signaling is "
+					"being used on a E1 line (use"
+					" e&me1)\n");
+				break;
+			case DAHDI_SIG_EM_E1:
+				fprintf(stderr, "\te&me1 signaling is "
+					"being used on a T1 line (use "
+					"e&m)\n");
+				fprintf(stderr, "\tRBS signaling is "
+					"being used on a E1 CCS span"
+					"\n");
+				break;
+			case DAHDI_SIG_HARDHDLC:
+				fprintf(stderr, "\thardhdlc is being "
+					"used on a TE12x (use dchan)\n"
+					);
+				break;
+			case DAHDI_SIG_HDLCFCS:
+				fprintf(stderr, "\tdchan is being used"
+					" on a BRI span (use hardhdlc)"
+					"\n");
+				break;
+			default:
+				break;
+			}
+			fprintf(stderr, "\tSignaling is being assigned"
+				" to channel 16 of an E1 CAS span\n");
+		}
+		return -1;
+	}
+	if (needupdate) {
+		c->configured = 1;
+		add_count(&chans_changed);
+	}
+
+	/* Without a change the echo canceller is still attached */
+	if (!needupdate && !verify && !echocan_changed(c))
+		return 0;
+	add_count(&echocans_changed);
+
+	c->ae.chan = x;
+	if (verbose) {
+		printf("Setting echocan for channel %d to %s\n", c->ae.chan, c->ae.echocan[0] ? c->ae.echocan : "none");
+	}
+
+	if (cfg_ioctl(ctlfd, DAHDI_ATTACH_ECHOCAN, &c->ae)) {
+		fprintf(stderr, "DAHDI_ATTACH_ECHOCAN failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * With -j, spans are configured and started by a pool of threads, each
+ * with a control device of its own. The job of a span is its SPANCONFIG,
+ * then its channels in order; spans without a span= line (analog and
+ * dynamic ones) get a job for their channels too. Channels that depend
+ * on another span (slaves of a master elsewhere, DACS) or that sysfs puts
+ * in no span are left to the main thread, after the pool, as without -j.
+ */
+struct span_job {
+	int span;
+	int lcidx;		/* in lc[], or -1 without a span= line */
+	int basechan;
+	int channels;
+	int res;
+};
+
+enum apply_phase {
+	PHASE_CONFIG,
+	PHASE_STARTUP,
+};
+
+struct apply_pool {
+	enum apply_phase phase;
+	int next;		/* next job to take */
+	pthread_mutex_t lock;
+};
+
+static struct span_job span_jobs[DAHDI_MAX_SPANS];
+static int num_span_jobs;
+
+static void add_span_job(int span, int lcidx)
+{
+	int x;
+
+	for (x = 0; x < num_span_jobs; x++) {
+		if (span_jobs[x].span == span)
+			return;
+	}
+	if (num_span_jobs >= DAHDI_MAX_SPANS)
+		return;
+	memset(&span_jobs[num_span_jobs], 0, sizeof(span_jobs[0]));
+	span_jobs[num_span_jobs].span = span;
+	span_jobs[num_span_jobs].lcidx = lcidx;
+	num_span_jobs++;
+}
+
+/* The span job of a channel, which needn't be configured */
+static int chan_span_job(int chan)
+{
+	struct chan_conf *c = find_chan(chan);
+	int y, res = -1;
+
+	if (c)
+		return c->job;
+	for (y = 0; y < num_span_jobs; y++) {
+		if (chan >= span_jobs[y].basechan &&
+		    chan < span_jobs[y].basechan + span_jobs[y].channels)
+			res = y;
+	}
+	return res;
+}
+
+static void plan_span_jobs(void)
+{
+	DIR *dirp;
+	struct dirent *dirent;
+	struct span_job *job;
+	struct chan_conf *c;
+	int span;
+	int x, y;
+
+	for (x = 0; x < spans; x++) {
+		if (only_span && lc[x].span != only_span)
+			continue;
+		add_span_job(lc[x].span, x);
+	}
+	dirp = opendir("/sys/bus/dahdi_spans/devices");
+	if (dirp) {
+		while ((dirent = readdir(dirp))) {
+			if (sscanf(dirent->d_name, "span-%d", &span) != 1)
+				continue;
+			if (only_span && span != only_span)
+				continue;
+			add_span_job(span, -1);
+		}
+		closedir(dirp);
+	}
+
+	for (x = 0; x < numchanconfs; x++)
+		chanconfs[x]->job = -1;
+	for (y = 0; y < num_span_jobs; y++) {
+		job = &span_jobs[y];
+		if (span_range(job->span, &job->basechan, &job->channels)) {
+			job->basechan = 0;
+			job->channels = 0;
+		}
+		for (x = chan_index(job->basechan); x < numchanconfs && chanconfs[x]->chan < job->basechan + job->channels; x++)
+			chanconfs[x]->job = y;
+	}
+	for (x = 0; x < numchanconfs; x++) {
+		c = chanconfs[x];
+		if (c->job < 0 || !c->cc.sigtype)
+			continue;
+		if (c->cc.sigtype == DAHDI_SIG_DACS || c->cc.sigtype == DAHDI_SIG_DACS_RBS)
+			c->job = -1;
+		else if (c->cc.master != c->chan &&
+			 (c->cc.master < 1 || c->cc.master >= DAHDI_MAX_CHANNELS ||
+			  chan_span_job(c->cc.master) != c->job))
+			c->job = -1;
+	}
+}
+
+static int config_span(int ctlfd, struct span_job *job)
+{
+	int x;
+
+	if (job->lcidx >= 0 && span_changed(job->lcidx)) {
+		if (cfg_ioctl(ctlfd, DAHDI_SPANCONFIG, &lc[job->lcidx])) {
+			fprintf(stderr, "DAHDI_SPANCONFIG failed on span %d: %s (%d)\n", job->span, strerror(errno), errno);
+			return -1;
+		}
+	}
+	for (x = chan_index(job->basechan); x < numchanconfs && chanconfs[x]->chan < job->basechan + job->channels; x++) {
+		if (chanconfs[x]->job != job - span_jobs || skip_channel(chanconfs[x]->chan))
+			continue;
+		if (apply_channel(ctlfd, chanconfs[x]))
+			return -1;
+	}
+	return 0;
+}
+
+static int startup_span(int ctlfd, struct span_job *job)
+{
+	if (job->lcidx < 0 || !span_changed(job->lcidx))
+		return 0;
+	if (cfg_ioctl(ctlfd, DAHDI_STARTUP, &job->span)) {
+		fprintf(stderr, "DAHDI startup failed on span %d: %s\n", job->span, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void *span_worker(void *data)
+{
+	struct apply_pool *pool = data;
+	struct span_job *job;
+	int ctlfd;
+
+	ctlfd = open(MASTER_DEVICE, O_RDWR);
+	if (ctlfd < 0) {
+		fprintf(stderr, "Unable to open master device '%s': %s\n", MASTER_DEVICE, strerror(errno));
+		return NULL;
+	}
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		job = (pool->next < num_span_jobs) ? &span_jobs[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (!job)
+			break;
+		if (pool->phase == PHASE_STARTUP)
+			job->res = startup_span(ctlfd, job);
+		else
+			job->res = config_span(ctlfd, job);
+	}
+	close(ctlfd);
+	return NULL;
+}
+
+/* Run a phase for every span, up to jobs at a time; -1 if any failed */
+static int run_span_jobs(enum apply_phase phase)
+{
+	struct apply_pool pool;
+	pthread_t threads[DAHDI_MAX_SPANS];
+	int started = 0;
+	int res = 0;
+	int x;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.phase = phase;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (x = 0; x < num_span_jobs; x++)
+		span_jobs[x].res = -1;	/* until a worker has done it */
+
+	/* The main thread is one of the workers */
+	while (started < jobs - 1 && started < num_span_jobs - 1) {
+		if (pthread_create(&threads[started], NULL, span_worker, &pool))
+			break;
+		started++;
+	}
+	span_worker(&pool);
+	for (x = 0; x < started; x++)
+		pthread_join(threads[x], NULL);
+	pthread_mutex_destroy(&pool.lock);
+
+	for (x = 0; x < num_span_jobs; x++) {
+		if (span_jobs[x].res)
+			res = -1;
+	}
+	return res;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 32)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * -p: what was parsed, then every ioctl in the order it was issued (or,
+ * in test mode, would have been), with its latency, and the time spent
+ * in each phase.
+ */
+static void write_plan(int exit_code)
+{
+	double end = now();
+	struct ioctl_record *r;
+	struct chan_conf *c;
+	FILE *f;
+	int x, n;
+
+	f = fopen(plan_file, "w");
+	if (!f) {
+		fprintf(stderr, "Unable to write '%s': %s\n", plan_file, strerror(errno));
+		return;
+	}
+	fprintf(f, "{\n\t\"version\": ");
+	json_string(f, dahdi_tools_version);
+	fprintf(f, ",\n\t\"mode\": \"%s\",\n\t\"config\": ", dry_run ? "plan" : "report");
+	json_string(f, filename);
+	fprintf(f, ",\n\t\"exit_code\": %d,\n", exit_code);
+
+	fprintf(f, "\t\"spans\": [");
+	for (x = 0, n = 0; x < spans; x++) {
+		if (only_span && only_span != lc[x].span)
+			continue;
+		fprintf(f, "%s\n\t\t{\"span\": %d, \"timing\": %d, \"lbo\": %d, "
+			"\"framing\": \"%s\", \"coding\": \"%s\", \"lineconfig\": %d, "
+			"\"changed\": %s}",
+			n++ ? "," : "", lc[x].span, lc[x].sync, lc[x].lbo,
+			(lc[x].lineconfig & DAHDI_CONFIG_D4 ? "D4" :
+			 lc[x].lineconfig & DAHDI_CONFIG_ESF ? "ESF" :
+			 lc[x].lineconfig & DAHDI_CONFIG_CCS ? "CCS" : "CAS"),
+			(lc[x].lineconfig & DAHDI_CONFIG_AMI ? "AMI" :
+			 lc[x].lineconfig & DAHDI_CONFIG_B8ZS ? "B8ZS" :
+			 lc[x].lineconfig & DAHDI_CONFIG_HDB3 ? "HDB3" : "???"),
+			lc[x].lineconfig, span_changed(x) ? "true" : "false");
+	}
+	fprintf(f, "%s],\n", n ? "\n\t" : "");
+
+	fprintf(f, "\t\"channels\": [");
+	for (x = 0, n = 0; x < numchanconfs; x++) {
+		c = chanconfs[x];
+		if (skip_channel(c->chan) || (!c->cc.sigtype && !c->ae.echocan[0]))
+			continue;
+		fprintf(f, "%s\n\t\t{\"channel\": %d, \"signalling\": ", n++ ? "," : "", c->chan);
+		json_string(f, c->sig ? c->sig : "");
+		fprintf(f, ", \"sigtype\": %d, \"law\": \"%s\", \"master\": %d, "
+			"\"idlebits\": %d, \"echocan\": ",
+			c->cc.sigtype, laws[c->cc.deflaw], c->cc.master, c->cc.idlebits);
+		json_string(f, c->ae.echocan);
+		fprintf(f, ", \"56k\": %s, \"changed\": %s}",
+			c->fiftysixkhdlc ? "true" : "false",
+			chan_changed(c) || echocan_changed(c) ? "true" : "false");
+	}
+	fprintf(f, "%s],\n", n ? "\n\t" : "");
+
+	fprintf(f, "\t\"dynamic\": [");
+	for (x = 0; x < numdynamic; x++) {
+		fprintf(f, "%s\n\t\t{\"driver\": ", x ? "," : "");
+		json_string(f, zds[x].driver);
+		fprintf(f, ", \"address\": ");
+		json_string(f, zds[x].addr);
+		fprintf(f, ", \"channels\": %d, \"timing\": %d}",
+			zds[x].numchans, zds[x].timing);
+	}
+	fprintf(f, "%s],\n", numdynamic ? "\n\t" : "");
+
+	fprintf(f, "\t\"tone_zones\": {\"load\": [");
+	for (x = 0; x < numzones; x++) {
+		if (x)
+			fprintf(f, ", ");
+		json_string(f, zonestoload[x]);
+	}
+	fprintf(f, "], \"default\": %d},\n", deftonezone);
+
+	fprintf(f, "\t\"phases\": [");
+	for (x = 0; x < numphases; x++) {
+		fprintf(f, "%s\n\t\t{\"phase\": \"%s\", \"start_us\": %.0f, \"us\": %.0f}",
+			x ? "," : "", phases[x].name,
+			(phases[x].start - start_time) * 1e6,
+			((x + 1 < numphases ? phases[x + 1].start : end) - phases[x].start) * 1e6);
+	}
+	fprintf(f, "%s],\n", numphases ? "\n\t" : "");
+
+	fprintf(f, "\t\"ioctls\": [");
+	for (x = 0; x < ioctl_log_len; x++) {
+		r = &ioctl_log[x];
+		fprintf(f, "%s\n\t\t{\"ioctl\": \"%s\"", x ? "," : "", r->name);
+		if (r->what)
+			fprintf(f, ", \"%s\": %d", r->what, r->target);
+		if (r->label_key) {
+			fprintf(f, ", \"%s\": ", r->label_key);
+			json_string(f, r->label);
+		}
+		fprintf(f, ", \"issued\": %s", r->issued ? "true" : "false");
+		if (r->issued) {
+			fprintf(f, ", \"start_us\": %.0f, \"latency_us\": %.1f, \"result\": %d",
+				r->start * 1e6, r->latency * 1e6, r->res);
+			if (r->res) {
+				fprintf(f, ", \"error\": ");
+				json_string(f, strerror(r->err));
+			}
+		}
+		fprintf(f, "}");
+	}
+	fprintf(f, "%s]\n}\n", ioctl_log_len ? "\n\t" : "");
+	if (fclose(f))
+		fprintf(stderr, "Unable to write '%s': %s\n", plan_file, strerror(errno));
+}
+
+/*
+ * The configuration file is read whole, mapped privately where it can be,
+ * and cut into lines in place: each line is seen once, and the handlers
+ * get pointers into the file rather than a copy.
+ */
+struct conf_reader {
+	char *buf;		/* the file, followed by a NUL */
+	size_t size;
+	size_t maplen;		/* if buf is mapped */
+	char *next;		/* start of the next line */
+};
+
+static int conf_open(struct conf_reader *r, const char *name)
+{
+	struct stat st;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	size_t alloc = 0;
+	ssize_t res;
+	char *tmp;
+	int cfd;
+
+	memset(r, 0, sizeof(*r));
+	if (strcmp(name, "-") == 0)
+		cfd = dup(STDIN_FILENO);
+	else
+		cfd = open(name, O_RDONLY);
+	if (cfd < 0)
+		return -1;
+
+	/* Past the end of the file the rest of its last page reads as zeros */
+	if (!fstat(cfd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    pagesize > 0 && st.st_size % pagesize) {
+		r->buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, cfd, 0);
+		if (r->buf != MAP_FAILED) {
+			r->size = st.st_size;
+			r->maplen = st.st_size;
+			goto done;
+		}
+		r->buf = NULL;
+	}
+
+	/* A pipe, or no room for the NUL: read it all */
+	for (;;) {
+		if (r->size + 1 >= alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			tmp = realloc(r->buf, alloc);
+			if (!tmp) {
+				free(r->buf);
+				close(cfd);
+				return -1;
+			}
+			r->buf = tmp;
+		}
+		res = read(cfd, r->buf + r->size, alloc - r->size - 1);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		r->size += res;
+	}
+	if (res < 0) {
+		free(r->buf);
+		close(cfd);
+		return -1;
+	}
+	r->buf[r->size] = '\0';
+done:
+	close(cfd);
+	r->next = r->buf;
+	return 0;
+}
+
+static void conf_close(struct conf_reader *r)
+{
+	if (r->maplen)
+		munmap(r->buf, r->maplen);
+	else
+		free(r->buf);
+	r->buf = NULL;
+}
+
+/* The next line that isn't empty once comments and trailing blanks are gone */
+static char *conf_next_line(struct conf_reader *r)
+{
+	char *end = r->buf + r->size;
+	char *line, *c;
+
+	while (r->next < end) {
+		line = r->next;
+		c = memchr(line, '\n', end - line);
+		if (c) {
+			*c = '\0';
+			r->next = c + 1;
+		} else {
+			r->next = end;
+		}
+		lineno++;
+		/* Strip comments */
+		c = strchr(line, '#');
+		if (c)
+			*c = '\0';
+		trim(line);
+		if (*line)
+			return line;
+	}
+	return NULL;
+}
+
+/*
+ * Keywords are found through a table indexed by a hash of their lower
+ * case name: FNV-1a, with a seed picked so that no two keywords in
+ * handlers[] land in the same slot. Finding one is a hash and a single
+ * strcasecmp. A new keyword that collides with another one takes the
+ * next free slot, and is found by probing on from there: the table has
+ * room for several times the keywords.
+ */
+#define KEYWORD_HASH_BITS	8
+#define KEYWORD_HASH_SEED	0x811c9de1
+#define KEYWORD_HASH_MASK	((1 << KEYWORD_HASH_BITS) - 1)
+
+static unsigned char keyword_slots[1 << KEYWORD_HASH_BITS];	/* handler + 1 */
+
+static unsigned int keyword_hash(const char *key)
+{
+	unsigned int h = KEYWORD_HASH_SEED;
+
+	while (*key) {
+		h ^= (unsigned char)tolower((unsigned char)*key++);
+		h *= 16777619;
+	}
+	return (h ^ (h >> KEYWORD_HASH_BITS)) & KEYWORD_HASH_MASK;
+}
+
+static void init_keywords(void)
+{
+	unsigned int h;
+	int x;
+
+	for (x = 0; x < sizeof(handlers) / sizeof(handlers[0]); x++) {
+		h = keyword_hash(handlers[x].keyword);
+		while (keyword_slots[h])
+			h = (h + 1) & KEYWORD_HASH_MASK;
+		keyword_slots[h] = x + 1;
+	}
+}
+
+static struct handler *find_handler(const char *key)
+{
+	unsigned int h = keyword_hash(key);
+	int x;
+
+	while ((x = keyword_slots[h])) {
+		if (!strcasecmp(key, handlers[x - 1].keyword))
+			return &handlers[x - 1];
+		h = (h + 1) & KEYWORD_HASH_MASK;
+	}
+	return NULL;
+}
+
+/* Hand a <keyword>=<value> line to its handler */
+static void parse_line(char *buf, struct handler *(*find)(const char *key))
+{
+	char *key, *value;
+	struct handler *h;
+
+	if (debug & DEBUG_READER) 
+		fprintf(stderr, "Line %d: %s\n", lineno, buf);
+
+	if ((value = strchr(buf, '='))) {
+		*value++ = '\0';
+		value = trim(value);
+		key = trim(buf);
+	}
+
+	if (!value || !*value || !*key) {
+		error("Syntax error. Should be <keyword>=<value>\n");
+		return;
+	}
+
+	if (debug & DEBUG_PARSER)
+		fprintf(stderr, "Keyword: [%s], Value: [%s]\n", key, value);
+
+	h = find(key);
+	if (h)
+		h->func(key, value);
+	else
+		error("Unknown keyword '%s'\n", key);
+}
+
+static void parse_config(void)
+{
+	struct conf_reader conf;
+	char *buf;
+
+	if (conf_open(&conf, filename)) {
+		error("Unable to open configuration file '%s'\n", filename);
+		return;
+	}
+	while ((buf = conf_next_line(&conf)))
+		parse_line(buf, find_handler);
+	if (debug & DEBUG_READER)
+		fprintf(stderr, "<End of File>\n");
+	conf_close(&conf);
+}
+
+#ifdef PARSE_BENCH
+/*
+ * Hooks for dahdi_cfg_bench, which times parsing alone: the reader and
+ * keyword lookup above, against the fgets() line reader and linear
+ * search of handlers[] that dahdi_cfg used before them.
+ */
+static FILE *cf;
+
+static char *readline_fgets(void)
+{
+	static char buf[256];
+	char *c;
+	do {
+		if (!fgets(buf, sizeof(buf), cf)) 
+			return NULL;
+		/* Strip comments */
+		c = strchr(buf, '#');
+		if (c)
+			*c = '\0';
+		trim(buf);
+		lineno++;
+	} while (!strlen(buf));
+	return buf;
+}
+
+static struct handler *find_handler_linear(const char *key)
+{
+	int x;
+
+	for (x = 0; x < sizeof(handlers) / sizeof(handlers[0]); x++) {
+		if (!strcasecmp(key, handlers[x].keyword))
+			return &handlers[x];
+	}
+	return NULL;
+}
+
+void parse_bench_init(const char *name)
+{
+	filename = (char *)name;
+	init_keywords();
+}
+
+/* Forget everything parsed so far */
+static void parse_bench_reset(void)
+{
+	int x;
+
+	for (x = 0; x < numchanconfs; x++)
+		free(chanconfs[x]);
+	numchanconfs = 0;
+	memset(lc, 0, sizeof(lc));
+	memset(declared_spans, 0, sizeof(declared_spans));
+	memset(zonestoload, 0, sizeof(zonestoload));
+	spans = 0;
+	numdynamic = 0;
+	numzones = 0;
+	deftonezone = -1;
+	toneindex = 1;
+	lineno = 0;
+	errcnt = 0;
+	clear_fields();
+}
+
+/* Parse the whole file, the old way if reference; returns the error count */
+int parse_bench_parse(int reference)
+{
+	char *buf;
+
+	parse_bench_reset();
+	if (!reference) {
+		parse_config();
+		return errcnt;
+	}
+	cf = fopen(filename, "r");
+	if (!cf) {
+		error("Unable to open configuration file '%s'\n", filename);
+		return errcnt;
+	}
+	while ((buf = readline_fgets())) {
+		if (*buf == 10) /* skip new line */
+			continue;
+		parse_line(buf, find_handler_linear);
+	}
+	fclose(cf);
+	return errcnt;
+}
+
+static unsigned long scan_line(unsigned long sum, char *buf,
+			       struct handler *(*find)(const char *key))
+{
+	char *value = strchr(buf, '=');
+	struct handler *h;
+
+	if (value)
+		*value = '\0';
+	h = find(trim(buf));
+	return sum * 31 + (h ? h - handlers + 1 : 0);
+}
+
+/*
+ * Only read the lines and look their keywords up, without calling the
+ * handlers; returns a checksum of the handlers found.
+ */
+unsigned long parse_bench_scan(int reference)
+{
+	struct conf_reader conf;
+	unsigned long sum = 0;
+	char *buf;
+
+	lineno = 0;
+	if (!reference) {
+		if (conf_open(&conf, filename))
+			return 0;
+		while ((buf = conf_next_line(&conf)))
+			sum = scan_line(sum, buf, find_handler);
+		conf_close(&conf);
+		return sum;
+	}
+	cf = fopen(filename, "r");
+	if (!cf)
+		return 0;
+	while ((buf = readline_fgets())) {
+		if (*buf != 10)
+			sum = scan_line(sum, buf, find_handler_linear);
+	}
+	fclose(cf);
+	return sum;
+}
+
+static unsigned long digest(unsigned long h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+
+	while (len--)
+		h = h * 33 + *c++;
+	return h;
+}
+
+/* A digest of everything the last parse filled in */
+unsigned long parse_bench_digest(void)
+{
+	unsigned long h = 5381;
+	struct chan_conf *c;
+	int x;
+
+	h = digest(h, lc, sizeof(lc));
+	h = digest(h, zds, sizeof(zds[0]) * numdynamic);
+	h = digest(h, declared_spans, sizeof(declared_spans));
+	h = digest(h, zonestoload, sizeof(zonestoload));
+	for (x = 0; x < numchanconfs; x++) {
+		c = chanconfs[x];
+		h = digest(h, &c->chan, sizeof(c->chan));
+		h = digest(h, &c->cc, sizeof(c->cc));
+		h = digest(h, &c->ae, sizeof(c->ae));
+		h = digest(h, &c->slineno, sizeof(c->slineno));
+		h = digest(h, &c->fiftysixkhdlc, sizeof(c->fiftysixkhdlc));
+		if (c->sig)
+			h = digest(h, c->sig, strlen(c->sig));
+	}
+	h = digest(h, &spans, sizeof(spans));
+	h = digest(h, &numdynamic, sizeof(numdynamic));
+	h = digest(h, &numzones, sizeof(numzones));
+	h = digest(h, &deftonezone, sizeof(deftonezone));
+	h = digest(h, &lineno, sizeof(lineno));
+	h = digest(h, &errcnt, sizeof(errcnt));
+	return h;
+}
+
+/* dahdi_cfg_bench has its own */
+#define main dahdi_cfg_main
+#endif /* PARSE_BENCH */
+
+static void usage(char *argv0, int exitcode)
+{
+	char *c;
+	c = strrchr(argv0, '/');
+	if (!c)
+		c = argv0;
+	else
+		c++;
+	fprintf(stderr, "%s\n", dahdi_tools_version);
+	fprintf(stderr, 
+		"Usage: %s [options]\n"
+		"    Valid options are:\n"
+		"  -c <filename>     -- Use <filename> instead of " CONFIG_FILENAME "\n"
+		"  -d [level]        -- Generate debugging output. (Default level is 1.)\n"
+		"  -f                -- Always reconfigure every channel\n"
+		"  -h                -- Generate this help statement\n"
+		"  -i                -- Only apply what changed since the last run\n"
+		"  -j <jobs>         -- Configure up to <jobs> spans at the same time\n"
+		"  -p <filename>     -- Write what was done (with -t: the plan) as JSON\n"
+		"  -s                -- Shutdown spans only\n"
+		"  -t                -- Test mode only, do not apply\n"
+		"  -C <chan_list>    -- Only configure specified channels\n"
+		"  -S <spanno>       -- Only configure specified span\n"
+		"  -v                -- Verbose (more -v's means more verbose)\n"
+	,c);
+	exit(exitcode);
+}
+
+static int chan_restrict(char *str)
+{
+	if (apply_channels(&selected_channels, str) < 0)
+		return 0;
+	restrict_channels = 1;
+	return 1;
+}
+
+static int span_restrict(char *str)
+{
+	long	spanno;
+	char	*endptr;
+
+	spanno = strtol(str, &endptr, 10);
+	if (endptr == str) {
+		fprintf(stderr, "Missing valid span number after '-S'\n");
+		return 0;
+	}
+	if (*endptr != '\0') {
+		fprintf(stderr, "Extra garbage after span number in '-S'\n");
+		return 0;
+	}
+	only_span = spanno;
+	return 1;
+}
+
+static const char *SEM_NAME = "dahdi_cfg";
+static sem_t *lock = SEM_FAILED;
+
+static void signal_handler(int signal)
+{
+	if (SEM_FAILED != lock) {
+		sem_unlink(SEM_NAME);
+	}
+	/* The default handler should have been restored before this handler was
+	 * called, so we can let the "normal" processing finish the cleanup. */
+	raise(signal);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int x;
+	int exit_code = 0;
+	int reload_zones;
+	struct sigaction act;
+
+	start_time = now();
+	while((c = getopt(argc, argv, "fthij:p:c:vsd::C:S:")) != -1) {
+		switch(c) {
+		case 'c':
 			filename=optarg;
 			break;
 		case 'h':
@@ -1559,6 +3066,17 @@ int main(int argc, char *argv[])
 		case 't':
 			dry_run = 1;
 			break;
+		case 'i':
+			incremental = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1)
+				usage(argv[0], 1);
+			break;
+		case 'p':
+			plan_file = optarg;
+			break;
 		case 's':
 			stopmode = 1;
 			break;
@@ -1587,6 +3105,10 @@ int main(int argc, char *argv[])
 		error("-S requires -C\n");
 		goto finish;
 	}
+	if (incremental && restrict_channels) {
+		error("-i can't be used with -C or -S\n");
+		goto finish;
+	}
 	if (!restrict_channels && !only_span) {
 		bool all_assigned = wait_for_all_spans_assigned(5);
 
@@ -1601,50 +3123,9 @@ int main(int argc, char *argv[])
 		error("Unable to open master device '%s'\n", MASTER_DEVICE);
 		goto finish;
 	}
-	if (strcmp(filename, "-") == 0)
-		cf = fdopen(STDIN_FILENO, "r");
-	else
-		cf = fopen(filename, "r");
-	if (cf) {
-		while((buf = readline())) {
-			if (*buf == 10) /* skip new line */
-				continue;
-
-			if (debug & DEBUG_READER) 
-				fprintf(stderr, "Line %d: %s\n", lineno, buf);
-
-			if ((value = strchr(buf, '='))) {
-				*value++ = '\0';
-				value = trim(value);
-				key = trim(buf);
-			}
-
-			if (!value || !*value || !*key) {
-				error("Syntax error. Should be <keyword>=<value>\n");
-				continue;
-			}
-
-			if (debug & DEBUG_PARSER)
-				fprintf(stderr, "Keyword: [%s], Value: [%s]\n", key, value);
-
-			found = 0;
-			for (x = 0; x < sizeof(handlers) / sizeof(handlers[0]); x++) {
-				if (!strcasecmp(key, handlers[x].keyword)) {
-					found++;
-					handlers[x].func(key, value);
-					break;
-				}
-			}
-
-			if (!found) 
-				error("Unknown keyword '%s'\n", key);
-		}
-		if (debug & DEBUG_READER)
-			fprintf(stderr, "<End of File>\n");
-		/* fclose(cf); // causes seg fault (double free) */
-	} else {
-		error("Unable to open configuration file '%s'\n", filename);
-	}
+	begin_phase("parse");
+	init_keywords();
+	parse_config();
 
 finish:
 	if (errcnt) {
@@ -1655,7 +3136,7 @@ finish:
 		printconfig(fd);
 	}
 
-	if (dry_run)
+	if (dry_run && !plan_file)
 		exit(0);
 	
 	if (debug & DEBUG_APPLY) {
@@ -1689,10 +3170,34 @@ finish:
 		goto unlink_sem;
 	}
 
+	if (incremental && !force && !stopmode) {
+		const char *why = load_state();
+
+		if (why)
+			printf("Configuring everything: no record of the last configuration (%s)\n", why);
+		else
+			have_state = 1;
+	}
+	/* Until it is all applied, the kernel matches no record */
+	if (!dry_run)
+		unlink(STATE_FILENAME);
+
+	begin_phase(stopmode ? "shutdown" : "spans");
+
 	if (!restrict_channels && !only_span) {
-		for (x=0;x<numdynamic;x++) {
-			/* destroy them all */
-			ioctl(fd, DAHDI_DYNAMIC_DESTROY, &zds[x]);
+		if (dynamic_changed() && have_state) {
+			/* The spans after them are numbered again: do everything */
+			if (verbose)
+				printf("Dynamic spans changed: configuring everything\n");
+			for (x=0;x<old_numdynamic;x++)
+				cfg_ioctl(fd, DAHDI_DYNAMIC_DESTROY, &old_zds[x]);
+			have_state = 0;
+		}
+		if (!have_state) {
+			for (x=0;x<numdynamic;x++) {
+				/* destroy them all */
+				cfg_ioctl(fd, DAHDI_DYNAMIC_DESTROY, &zds[x]);
+			}
 		}
 	}
 
@@ -1700,7 +3205,7 @@ finish:
 		for (x=0;x<spans;x++) {
 			if (only_span && lc[x].span != only_span)
 				continue;
-			if (ioctl(fd, DAHDI_SHUTDOWN, &lc[x].span)) {
+			if (cfg_ioctl(fd, DAHDI_SHUTDOWN, &lc[x].span)) {
 				fprintf(stderr, "DAHDI shutdown failed: %s\n", strerror(errno));
 				close(fd);
 				exit_code = 1;
@@ -1713,7 +3218,17 @@ finish:
 	for (x=0;x<spans;x++) {
 		if (only_span && lc[x].span != only_span)
 			continue;
-		if (ioctl(fd, DAHDI_SPANCONFIG, lc + x)) {
+		if (!span_changed(x))
+			continue;
+		if (have_state) {
+			if (verbose > 1)
+				printf("Span %d changed\n", lc[x].span);
+			recheck_span(lc[x].span);
+		}
+		spans_changed++;
+		if (jobs > 1)
+			continue;	/* with its channels, below */
+		if (cfg_ioctl(fd, DAHDI_SPANCONFIG, lc + x)) {
 			fprintf(stderr, "DAHDI_SPANCONFIG failed on span %d: %s (%d)\n", lc[x].span, strerror(errno), errno);
 			close(fd);
 			exit_code = 1;
@@ -1721,18 +3236,20 @@ finish:
 		}
 	}
 
-	if (!restrict_channels && !only_span) {
+	if (!restrict_channels && !only_span && !have_state) {
 
 		sem_post(lock);
 
+		begin_phase("dynamic");
 		for (x=0;x<numdynamic;x++) {
-			if (ioctl(fd, DAHDI_DYNAMIC_CREATE, &zds[x])) {
+			if (cfg_ioctl(fd, DAHDI_DYNAMIC_CREATE, &zds[x])) {
 				fprintf(stderr, "DAHDI dynamic span creation failed: %s\n", strerror(errno));
 				close(fd);
 				exit_code = 1;
 				goto release_sem;
 			}
-			wait_for_all_spans_assigned(1);
+			if (!dry_run)
+				wait_for_all_spans_assigned(1);
 		}
 
 		if (-1 == sem_wait(lock)) {
@@ -1742,139 +3259,31 @@ finish:
 		}
 	}
 
-	for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-		struct dahdi_params current_state;
-		int master;
-		int needupdate = force;
+	begin_phase("channels");
+	if (jobs > 1) {
+		plan_span_jobs();
+		if (run_span_jobs(PHASE_CONFIG)) {
+			close(fd);
+			exit_code = 1;
+			goto release_sem;
+		}
+	}
 
-		if (skip_channel(x)) {
+	for (x = 0; x < numchanconfs; x++) {
+		if (skip_channel(chanconfs[x]->chan)) {
 			if (debug & DEBUG_APPLY) {
-				printf("Skip device %d\n", x);
+				printf("Skip device %d\n", chanconfs[x]->chan);
 				fflush(stdout);
 			}
 			continue;
 		}
+		if (jobs > 1 && chanconfs[x]->job >= 0)
+			continue;	/* done with its span */
 		if (debug & DEBUG_APPLY) {
-			printf("Configuring device %d\n", x);
+			printf("Configuring device %d\n", chanconfs[x]->chan);
 			fflush(stdout);
 		}
-		if (!cc[x].sigtype)
-			continue;
-		
-		if (!needupdate) {
-			memset(&current_state, 0, sizeof(current_state));
-			current_state.channo = cc[x].chan | DAHDI_GET_PARAMS_RETURN_MASTER;
-			if (ioctl(fd, DAHDI_GET_PARAMS, &current_state))
-				needupdate = 1;
-		}
-		
-		if (!needupdate) {
-			master = current_state.channo >> 16;
-			
-			if (cc[x].sigtype != current_state.sigtype) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing signalling on channel %d from %s to %s\n",
-					       cc[x].chan, sigtype_to_str(current_state.sigtype),
-					       sigtype_to_str(cc[x].sigtype));
-			}
-			
-			if ((cc[x].deflaw != DAHDI_LAW_DEFAULT) && (cc[x].deflaw != current_state.curlaw)) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing law on channel %d from %s to %s\n",
-					       cc[x].chan, laws[current_state.curlaw],
-					       laws[cc[x].deflaw]);
-			}
-			
-			if (cc[x].master != master) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing master of channel %d from %d to %d\n",
-					       cc[x].chan, master,
-					       cc[x].master);
-			}
-			
-			if (cc[x].idlebits != current_state.idlebits) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing idle bits of channel %d from %d to %d\n",
-					       cc[x].chan, current_state.idlebits,
-					       cc[x].idlebits);
-			}
-		}
-		
-		if (needupdate && ioctl(fd, DAHDI_CHANCONFIG, &cc[x])) {
-			fprintf(stderr, "DAHDI_CHANCONFIG failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
-			if (errno == EINVAL) {
-				/* give helpful suggestions on signaling errors */
-				fprintf(stderr, "Selected signaling not "
-						"supported\n");
-				fprintf(stderr, "Possible causes:\n");
-				switch(cc[x].sigtype) {
-				case DAHDI_SIG_FXOKS:
-				case DAHDI_SIG_FXOLS:
-				case DAHDI_SIG_FXOGS:
-					fprintf(stderr, "\tFXO signaling is "
-						"being used on a FXO interface"
-						" (use a FXS signaling variant"
-						")\n");
-					fprintf(stderr, "\tRBS signaling is "
-						"being used on a E1 CCS span"
-						"\n");
-					break;
-				case DAHDI_SIG_FXSKS:
-				case DAHDI_SIG_FXSLS:
-				case DAHDI_SIG_FXSGS:
-					fprintf(stderr, "\tFXS signaling is "
-						"being used on a FXS interface"
-						" (use a FXO signaling variant"
-						")\n");
-					fprintf(stderr, "\tRBS signaling is "
-						"being used on a E1 CCS span"
-						"\n");
-					break;
-				case DAHDI_SIG_EM:
-					fprintf(stderr, "\te&m signaling is "
-						"being used on a E1 line (use"
-						" e&me1)\n");
-					break;
-				case DAHDI_SIG_EM_E1:
-					fprintf(stderr, "\te&me1 signaling is "
-						"being used on a T1 line (use "
-						"e&m)\n");
-					fprintf(stderr, "\tRBS signaling is "
-						"being used on a E1 CCS span"
-						"\n");
-					break;
-				case DAHDI_SIG_HARDHDLC:
-					fprintf(stderr, "\thardhdlc is being "
-						"used on a TE12x (use dchan)\n"
-						);
-					break;
-				case DAHDI_SIG_HDLCFCS:
-					fprintf(stderr, "\tdchan is being used"
-						" on a BRI span (use hardhdlc)"
-						"\n");
-					break;
-				default:
-					break;
-				}
-				fprintf(stderr, "\tSignaling is being assigned"
-					" to channel 16 of an E1 CAS span\n");
-			}
-			close(fd);
-			exit_code = 1;
-			goto release_sem;
-		}
-
-		ae[x].chan = x;
-		if (verbose) {
-			printf("Setting echocan for channel %d to %s\n", ae[x].chan, ae[x].echocan[0] ? ae[x].echocan : "none");
-		}
-
-		if (ioctl(fd, DAHDI_ATTACH_ECHOCAN, &ae[x])) {
-			fprintf(stderr, "DAHDI_ATTACH_ECHOCAN failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
+		if (apply_channel(fd, chanconfs[x])) {
 			close(fd);
 			exit_code = 1;
 			goto release_sem;
@@ -1886,46 +3295,70 @@ finish:
 		deftonezone = 0;
 	}
 
-	for (x=0;x<numzones;x++) {
+	begin_phase("zones");
+	reload_zones = zones_changed();
+	for (x=0;x<numzones && reload_zones;x++) {
 		if (debug & DEBUG_APPLY) {
 			printf("Loading tone zone for %s\n", zonestoload[x]);
 			fflush(stdout);
 		}
-		if (tone_zone_register(fd, zonestoload[x])) {
-			if (errno != EBUSY)
+		if (load_zone(fd, zonestoload[x])) {
+			if (errno != EBUSY) {
 				error("Unable to register tone zone '%s'\n", zonestoload[x]);
+				zones_failed = 1;
+			}
 		}
 	}
 	if (debug & DEBUG_APPLY) {
 		printf("Doing startup\n");
 		fflush(stdout);
 	}
-	if (deftonezone > -1) {
-		if (ioctl(fd, DAHDI_DEFAULTZONE, &deftonezone)) {
+	if (deftonezone > -1 && (reload_zones || deftonezone != old_deftonezone)) {
+		if (cfg_ioctl(fd, DAHDI_DEFAULTZONE, &deftonezone)) {
 			fprintf(stderr, "DAHDI_DEFAULTZONE failed: %s (%d)\n", strerror(errno), errno);
 			close(fd);
 			exit_code = 1;
 			goto release_sem;
 		}
 	}
-	for (x=0;x<spans;x++) {
-		if (only_span && lc[x].span != only_span)
-			continue;
-		if (ioctl(fd, DAHDI_STARTUP, &lc[x].span)) {
-			fprintf(stderr, "DAHDI startup failed: %s\n", strerror(errno));
+	begin_phase("startup");
+	if (jobs > 1) {
+		if (run_span_jobs(PHASE_STARTUP)) {
 			close(fd);
 			exit_code = 1;
 			goto release_sem;
 		}
+	} else {
+		for (x=0;x<spans;x++) {
+			if (only_span && lc[x].span != only_span)
+				continue;
+			if (!span_changed(x))
+				continue;
+			if (cfg_ioctl(fd, DAHDI_STARTUP, &lc[x].span)) {
+				fprintf(stderr, "DAHDI startup failed: %s\n", strerror(errno));
+				close(fd);
+				exit_code = 1;
+				goto release_sem;
+			}
+		}
 	}
+	begin_phase("56k");
 	exit_code = apply_fiftysix();
+	if (incremental && !exit_code) {
+		printf("Configured %d of %d spans, %d of %d channels, %d echo cancellers\n",
+		       spans_changed, spans, chans_changed, chans_total, echocans_changed);
+	}
 
 release_sem:
+	if (!exit_code && !restrict_channels && !only_span && !dry_run)
+		save_state();
 	if (SEM_FAILED != lock)
 		sem_post(lock);
 
 unlink_sem:
 	if (SEM_FAILED != lock)
 		sem_unlink(SEM_NAME);
+	if (plan_file)
+		write_plan(exit_code);
 	exit(exit_code);
 }
@@ -0,0 +1,184 @@
+/*
+ * dahdi_cfg_bench -- check and time parsing of system.conf
+ *
+ * dahdi_cfg built with PARSE_BENCH parses a configuration file without
+ * opening any device. The file (by default one generated for a large
+ * system: many spans, a line per channel for signalling and for its echo
+ * canceller, comments and blank lines) is parsed with the mapped reader
+ * and hashed keyword lookup, and with the old fgets() reader and linear
+ * lookup: both must fill in exactly the same configuration. Then reading
+ * and lookup alone, and whole parses, are timed for each.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define SPANS		40	/* T1 spans in the generated file */
+#define SPAN_CHANS	24
+#define DYNAMIC		64
+
+/* From dahdi_cfg.c, built with PARSE_BENCH */
+void parse_bench_init(const char *name);
+int parse_bench_parse(int reference);
+unsigned long parse_bench_scan(int reference);
+unsigned long parse_bench_digest(void);
+
+static char tmpname[] = "/tmp/dahdi_cfg_bench.XXXXXX";
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: dahdi_cfg_bench [-n PASSES] [system.conf]\n");
+	fprintf(stderr, "        -n PASSES: parses timed per reader (default: 200)\n");
+	exit(1);
+}
+
+/* A system.conf for a large system; returns the number of lines */
+static int generate(FILE *f)
+{
+	static const char *const sigs[] = { "fxoks", "fxsks", "e&m", "bchan" };
+	int lines = 0;
+	int span, x, chan;
+
+	fprintf(f, "# Generated by dahdi_cfg_bench\n\n");
+	lines += 2;
+	for (span = 1; span <= SPANS; span++) {
+		fprintf(f, "# Span %d: a T1 line\n", span);
+		fprintf(f, "span=%d,%d,0,esf,b8zs\n\n", span, span == 1 ? 1 : 0);
+		lines += 3;
+		for (x = 0; x < SPAN_CHANS; x++) {
+			chan = (span - 1) * SPAN_CHANS + x + 1;
+			if (x == SPAN_CHANS - 1)
+				fprintf(f, "dchan=%d\t\t# D-channel\n", chan);
+			else
+				fprintf(f, "%s = %d\n", sigs[span % 4], chan);
+			fprintf(f, "echocanceller=mg2,%d\n", chan);
+			lines += 2;
+		}
+		fprintf(f, "\n");
+		lines++;
+	}
+	for (x = 0; x < DYNAMIC; x++) {
+		fprintf(f, "dynamic=eth,eth%d/00:11:22:33:44:%02x/0,24,0\n", x % 4, x);
+		lines++;
+	}
+	fprintf(f, "\n# Tone zones\nloadzone = us\nloadzone = uk\ndefaultzone = us\n");
+	lines += 5;
+	return lines;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile unsigned long sink;
+
+/* Microseconds per pass */
+static double time_scan(int reference, long passes)
+{
+	double start;
+	long n;
+
+	start = now();
+	for (n = 0; n < passes; n++)
+		sink += parse_bench_scan(reference);
+	return (now() - start) * 1e6 / passes;
+}
+
+static double time_parse(int reference, long passes)
+{
+	double start;
+	long n;
+
+	start = now();
+	for (n = 0; n < passes; n++)
+		sink += parse_bench_parse(reference);
+	return (now() - start) * 1e6 / passes;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long want, got;
+	double old_us, us;
+	long passes = 200;
+	const char *name;
+	int errors;
+	int opt;
+	int fd;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			passes = atol(optarg);
+			if (passes < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind < argc) {
+		name = argv[optind];
+	} else {
+		fd = mkstemp(tmpname);
+		if (fd < 0 || !(f = fdopen(fd, "w"))) {
+			perror(tmpname);
+			exit(1);
+		}
+		printf("%d lines in %s\n", generate(f), tmpname);
+		fclose(f);
+		name = tmpname;
+	}
+	parse_bench_init(name);
+
+	errors = parse_bench_parse(1);
+	want = parse_bench_digest();
+	if (parse_bench_parse(0) != errors || parse_bench_digest() != want) {
+		fprintf(stderr, "The two readers parse %s differently\n", name);
+		if (name == tmpname)
+			unlink(tmpname);
+		exit(1);
+	}
+	got = parse_bench_scan(0);
+	if (got != parse_bench_scan(1)) {
+		fprintf(stderr, "The two lookups find different keywords\n");
+		if (name == tmpname)
+			unlink(tmpname);
+		exit(1);
+	}
+	if (errors)
+		printf("(%d errors in the file)\n", errors);
+
+	printf("%-6s %12s %12s %8s\n", "pass", "old us", "new us", "speedup");
+	old_us = time_scan(1, passes);
+	us = time_scan(0, passes);
+	printf("%-6s %12.1f %12.1f %7.2fx\n", "scan", old_us, us, old_us / us);
+	old_us = time_parse(1, passes);
+	us = time_parse(0, passes);
+	printf("%-6s %12.1f %12.1f %7.2fx\n", "parse", old_us, us, old_us / us);
+
+	if (name == tmpname)
+		unlink(tmpname);
+	return 0;
+}
@@ -30,17 +30,21 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <dahdi/user.h>
 #include "dahdi_tools_version.h"
 #include "wavformat.h"
+#include "pcm_kernels.h"
 #include "autoconfig.h"
 
 #ifdef HAVE_SYS_SOUNDCARD_H
@@ -63,7 +67,7 @@
 #define MON_STEREO     4	/*!< stereo mix of rx/tx streams */
 #define MON_PRE_STEREO 5	/*!< stereo mix of rx/tx before echo can.  This is exactly what is fed into the echo can */
 
-#define BLOCK_SIZE 240
+#define BLOCK_SIZE PCM_BLOCK_SAMPLES
 
 #define BUFFERS 4
 
@@ -71,11 +75,63 @@
 
 #define MAX_OFH 6
 
+/*
+ * Recorded audio goes through a single-producer/single-consumer ring per
+ * output file: the capture loop only copies each block into the ring and
+ * a writer thread drains the rings into the files. A slow disk then no
+ * longer stalls the reads of the pseudo channels; if a ring does fill up
+ * the whole block is dropped and counted as an overrun.
+ */
+#define RING_SECONDS	10	/*!< default ring length, in seconds of mono audio */
+#define WRITER_SLEEP_US	50000	/*!< writer thread poll interval when idle */
+#define WRITE_BUF_SIZE	(256 * 1024)	/*!< stdio buffer of each output file */
+
+struct ring {
+	unsigned char *buf;
+	size_t size;		/*!< power of two */
+	size_t head;		/*!< only written by the capture loop */
+	size_t tail;		/*!< only written by the writer thread */
+	size_t highwater;
+	unsigned int overruns;
+	unsigned long long dropped;
+	uint64_t queued;	/*!< bytes accepted in all */
+	uint64_t limit;		/*!< most bytes the file can take, 0 for no limit */
+	int full;		/*!< stopped at the limit */
+};
+
+/*
+ * The RIFF sizes of a WAV file are 32 bits: a recording stops before its
+ * data passes them. Blocks are whole frames, so what is kept is too.
+ */
+#define WAV_MAX_DATA	(0xffffffffULL - (sizeof(struct wavheader) - 8))
+
+/* The files a writer thread drains, as parallel arrays */
+struct writer_set {
+	int count;
+	FILE **fh;
+	struct ring *rings;
+	uint64_t *written;
+};
+
 /* Put the ofh (output file handles) outside the main loop in case we ever add a
  * signal handler.
  */
 static FILE *ofh[MAX_OFH];
+static struct ring rings[MAX_OFH];
+static uint64_t bytes_written[MAX_OFH];
 static int run = 1;
+static int writer_run = 1;
+
+static const char *stream_names[MAX_OFH] = {
+	[MON_BRX] = "rx",
+	[MON_TX] = "tx",
+	[MON_PRE_BRX] = "pre-echo rx",
+	[MON_PRE_TX] = "pre-echo tx",
+	[MON_STEREO] = "stereo",
+	[MON_PRE_STEREO] = "pre-echo stereo",
+};
+
+static struct writer_set mon_writer = { MAX_OFH, ofh, rings, bytes_written };
 
 static int stereo;
 static int verbose;
@@ -87,6 +143,123 @@ void cleanup_and_exit(int signal)
 	run = 0; /* stop reading */
 }
 
+static int ring_init(struct ring *r, size_t len)
+{
+	memset(r, 0, sizeof(*r));
+	for (r->size = 4096; r->size < len; r->size <<= 1)
+		;
+	r->buf = malloc(r->size);
+	return r->buf ? 0 : -1;
+}
+
+/*
+ * Capture side: queue a whole block, or drop it if it doesn't fit. A
+ * block that would take the file past its limit stops the recording.
+ */
+static void ring_put(struct ring *r, const void *data, size_t len)
+{
+	size_t head = r->head;
+	size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	size_t off = head & (r->size - 1);
+	size_t first;
+
+	if (r->limit && r->queued + len > r->limit) {
+		r->full = 1;
+		run = 0;
+		return;
+	}
+	if (len > r->size - (head - tail)) {
+		r->overruns++;
+		r->dropped += len;
+		return;
+	}
+	first = (len < r->size - off) ? len : r->size - off;
+	memcpy(r->buf + off, data, first);
+	memcpy(r->buf, (const unsigned char *)data + first, len - first);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+	r->queued += len;
+	if (head + len - tail > r->highwater)
+		r->highwater = head + len - tail;
+}
+
+/* Writer side: write out what is queued, returns the number of bytes */
+static size_t ring_drain(struct ring *r, FILE *f, uint64_t *written)
+{
+	size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	size_t tail = r->tail;
+	size_t off, len;
+	size_t total = 0;
+
+	while (head != tail) {
+		off = tail & (r->size - 1);
+		len = head - tail;
+		if (len > r->size - off)
+			len = r->size - off;
+		*written += fwrite(r->buf + off, 1, len, f);
+		tail += len;
+		total += len;
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	return total;
+}
+
+static void *writer_thread(void *data)
+{
+	struct writer_set *set = data;
+	size_t busy;
+	int stopping;
+	int i;
+
+	do {
+		stopping = !__atomic_load_n(&writer_run, __ATOMIC_ACQUIRE);
+		busy = 0;
+		for (i = 0; i < set->count; i++) {
+			if (set->fh[i])
+				busy += ring_drain(&set->rings[i], set->fh[i], &set->written[i]);
+		}
+		if (!busy && !stopping)
+			usleep(WRITER_SLEEP_US);
+	} while (busy || !stopping);
+	return NULL;
+}
+
+static void writer_start(struct writer_set *set, pthread_t *thread)
+{
+	sigset_t sigs, oldsigs;
+
+	/* Leave ctrl-c to the capture loop */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+	if (pthread_create(thread, NULL, writer_thread, set)) {
+		fprintf(stderr, "Unable to start writer thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+}
+
+/* Let the writer flush whatever is still queued and wait for it */
+static void writer_stop(pthread_t thread)
+{
+	__atomic_store_n(&writer_run, 0, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+}
+
+static void ring_report(const char *name, struct ring *r, uint64_t written)
+{
+	fprintf(stderr, "%s: %llu bytes written, buffer peak %lu of %lu bytes, %u overruns (%llu bytes dropped)\n",
+		name, (unsigned long long)written, (unsigned long)r->highwater,
+		(unsigned long)r->size, r->overruns, r->dropped);
+	if (r->full)
+		fprintf(stderr, "%s: stopped before the 4 GiB size limit of a WAV file\n", name);
+}
+
+static void record(int stream, const void *data, size_t len)
+{
+	if (ofh[stream])
+		ring_put(&rings[stream], data, len);
+}
+
 int filename_is_wav(char *filename)
 {
 	if (NULL != strstr(filename, ".wav"))
@@ -96,7 +269,7 @@ int filename_is_wav(char *filename)
 
 /*
  * Fill the wav header with default info
- * num_chans - 0 = mono; 1 = stereo
+ * num_chans - number of interleaved 16 bit tracks
  */
 void wavheader_init(struct wavheader *wavheader, int num_chans)
 {
@@ -110,13 +283,25 @@ void wavheader_init(struct wavheader *wavheader, int num_chans)
 	wavheader->fmt_compression_code = 1;
 	wavheader->fmt_num_channels = num_chans;
 	wavheader->fmt_sample_rate = 8000;
-	wavheader->fmt_avg_bytes_per_sec = 16000;
-	wavheader->fmt_block_align = 2;
+	wavheader->fmt_avg_bytes_per_sec = 16000 * num_chans;
+	wavheader->fmt_block_align = 2 * num_chans;
 	wavheader->fmt_significant_bps = 16;
 
 	memcpy(&wavheader->data_chunk_id, "data", 4);
 }
 
+/* Rewrite the wav header with the final sizes */
+static void wavheader_finish(FILE *fh, struct wavheader *wavheader, uint64_t bytes)
+{
+	wavheader->riff_chunk_size = bytes + sizeof(struct wavheader) - 8; /* filesize - 8 */
+	wavheader->data_data_size = bytes;
+
+	rewind(fh);
+	if (fwrite(wavheader, 1, sizeof(struct wavheader), fh) != sizeof(struct wavheader)) {
+		fprintf(stderr, "Failed to write out a full wav header.\n");
+	}
+}
+
 int audio_open(void)
 {
 	int fd;
@@ -198,6 +383,378 @@ int pseudo_open(void)
 	return fd;
 }
 
+/*
+ * Multi-channel recording: every DAHDI channel gets one monitor pseudo
+ * (rx and tx mixed) or two (rx and tx apart, with -m). Each pseudo is a
+ * track and all of them are read from a single epoll loop. Tracks are
+ * grouped into outputs, either one multi-track file holding every track
+ * or one file per channel, and an output is interleaved and queued for
+ * the writer thread once all of its tracks have audio.
+ */
+#define MAX_EVENTS	64
+#define TRACK_SAMPLES	(BLOCK_SIZE * 4)	/*!< pending audio per track, whole blocks */
+
+struct track {
+	int fd;
+	int chan;
+	int output;
+	int count;		/*!< samples pending in buf */
+	short buf[TRACK_SAMPLES];
+};
+
+struct output {
+	char *name;
+	int first;		/*!< index of the first track */
+	int ntracks;
+	int is_wav;
+	struct wavheader wavheader;
+	struct ring *ring;
+	unsigned long long padded;	/*!< silence inserted for lagging tracks */
+};
+
+static int *mon_chans;
+static int mon_numchans;
+
+static int add_chans(int start, int finish)
+{
+	int chan;
+
+	mon_chans = realloc(mon_chans, (mon_numchans + finish - start + 1) * sizeof(*mon_chans));
+	if (!mon_chans) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (chan = start; chan <= finish; chan++)
+		mon_chans[mon_numchans++] = chan;
+	return 0;
+}
+
+/* Parse a channel list such as "1-15,17-31" */
+static int parse_chanlist(const char *list)
+{
+	char *copy, *tok, *saveptr;
+	int start, finish;
+	int res = 0;
+
+	copy = strdup(list);
+	if (!copy)
+		return -1;
+	for (tok = strtok_r(copy, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (sscanf(tok, "%d-%d", &start, &finish) == 2) {
+			/* range */
+		} else if (sscanf(tok, "%d", &start) == 1) {
+			finish = start;
+		} else {
+			fprintf(stderr, "Bad channel list item '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		if (start < 1 || finish < start) {
+			fprintf(stderr, "Bad channel range '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		if ((res = add_chans(start, finish)))
+			break;
+	}
+	free(copy);
+	return res;
+}
+
+static int get_basechan(unsigned int spanno)
+{
+	int res;
+	int basechan;
+	char filename[256];
+	FILE *fp;
+
+	snprintf(filename, sizeof(filename),
+		 "/sys/bus/dahdi_spans/devices/span-%u/basechan", spanno);
+	fp = fopen(filename, "r");
+	if (NULL == fp) {
+		return -1;
+	}
+	res = fscanf(fp, "%d", &basechan);
+	fclose(fp);
+	if (EOF == res) {
+		return -1;
+	}
+	return basechan;
+}
+
+/* Add all the channels of a span */
+static int add_span(int spanno)
+{
+	struct dahdi_spaninfo s;
+	int basechan;
+	int fd;
+	int x;
+
+	fd = open("/dev/dahdi/ctl", O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open /dev/dahdi/ctl: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&s, 0, sizeof(s));
+	s.spanno = spanno;
+	if (ioctl(fd, DAHDI_SPANSTAT, &s)) {
+		fprintf(stderr, "Unable to get span %d: %s\n", spanno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	basechan = get_basechan(spanno);
+	if (basechan < 0) {
+		/* Older kernels: spans are numbered consecutively */
+		struct dahdi_spaninfo prev;
+
+		basechan = 1;
+		for (x = 1; x < spanno; x++) {
+			memset(&prev, 0, sizeof(prev));
+			prev.spanno = x;
+			if (!ioctl(fd, DAHDI_SPANSTAT, &prev))
+				basechan += prev.totalchans;
+		}
+	}
+	close(fd);
+	if (s.totalchans < 1) {
+		fprintf(stderr, "Span %d has no channels\n", spanno);
+		return -1;
+	}
+	return add_chans(basechan, basechan + s.totalchans - 1);
+}
+
+/* A file name pattern must have exactly one %d (with optional width) */
+static int pattern_valid(const char *pattern)
+{
+	const char *p;
+	int convs = 0;
+
+	for (p = pattern; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (*++p == '%')
+			continue;
+		while (isdigit(*p))
+			p++;
+		if (*p != 'd')
+			return 0;
+		convs++;
+	}
+	return convs == 1;
+}
+
+static FILE *output_open(struct output *o)
+{
+	FILE *fh;
+
+	if ((fh = fopen(o->name, "w")) == NULL) {
+		fprintf(stderr, "Could not open %s for writing: %s\n", o->name, strerror(errno));
+		return NULL;
+	}
+	o->is_wav = filename_is_wav(o->name);
+	if (o->is_wav) {
+		wavheader_init(&o->wavheader, o->ntracks);
+		if (fwrite(&o->wavheader, 1, sizeof(struct wavheader), fh) != sizeof(struct wavheader)) {
+			fprintf(stderr, "Could not write wav header to %s: %s\n", o->name, strerror(errno));
+			fclose(fh);
+			return NULL;
+		}
+	}
+	setvbuf(fh, NULL, _IOFBF, WRITE_BUF_SIZE);
+	return fh;
+}
+
+/*
+ * Interleave the samples every track of an output has and queue them.
+ * With force, lagging tracks are padded with silence so that the
+ * fullest track is emptied.
+ */
+static void output_flush(struct output *o, struct track *tracks, short *frame, int force)
+{
+	struct track *t;
+	int m = force ? 0 : TRACK_SAMPLES;
+	int i, x;
+
+	for (i = 0; i < o->ntracks; i++) {
+		t = &tracks[o->first + i];
+		if (force ? t->count > m : t->count < m)
+			m = t->count;
+	}
+	if (!m)
+		return;
+	if (o->ntracks == 2 && !force) {
+		/* The common case of a stereo rx/tx file per channel */
+		t = &tracks[o->first];
+		pcm_interleave(frame, t[0].buf, t[1].buf, m);
+		for (i = 0; i < 2; i++) {
+			t[i].count -= m;
+			memmove(t[i].buf, t[i].buf + m, t[i].count * sizeof(short));
+		}
+		ring_put(o->ring, frame, m * 2 * sizeof(short));
+		return;
+	}
+	for (i = 0; i < o->ntracks; i++) {
+		t = &tracks[o->first + i];
+		for (x = 0; x < m && x < t->count; x++)
+			frame[x * o->ntracks + i] = t->buf[x];
+		if (t->count < m) {
+			o->padded += m - t->count;
+			for (; x < m; x++)
+				frame[x * o->ntracks + i] = 0;
+			t->count = 0;
+		} else {
+			t->count -= m;
+			memmove(t->buf, t->buf + m, t->count * sizeof(short));
+		}
+	}
+	ring_put(o->ring, frame, m * o->ntracks * sizeof(short));
+}
+
+static int monitor_chans(int separate, const char *multifile, const char *pattern,
+			 int ring_seconds, int limit)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct dahdi_confinfo zc;
+	struct writer_set set;
+	struct track *tracks, *t;
+	struct output *outputs, *o;
+	pthread_t writer;
+	short *frame;
+	int per_chan = separate ? 2 : 1;
+	int ntracks = mon_numchans * per_chan;
+	int noutputs = multifile ? 1 : mon_numchans;
+	int readcount = 0;
+	int epfd;
+	int i, n, res;
+	char name[PATH_MAX];
+
+	tracks = calloc(ntracks, sizeof(*tracks));
+	outputs = calloc(noutputs, sizeof(*outputs));
+	set.count = noutputs;
+	set.fh = calloc(noutputs, sizeof(*set.fh));
+	set.rings = calloc(noutputs, sizeof(*set.rings));
+	set.written = calloc(noutputs, sizeof(*set.written));
+	frame = malloc(TRACK_SAMPLES * (multifile ? ntracks : per_chan) * sizeof(short));
+	if (!tracks || !outputs || !set.fh || !set.rings || !set.written || !frame) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	if ((epfd = epoll_create(ntracks)) < 0) {
+		fprintf(stderr, "Unable to create epoll: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < noutputs; i++) {
+		o = &outputs[i];
+		if (multifile) {
+			o->name = strdup(multifile);
+			o->first = 0;
+			o->ntracks = ntracks;
+		} else {
+			snprintf(name, sizeof(name), pattern, mon_chans[i]);
+			o->name = strdup(name);
+			o->first = i * per_chan;
+			o->ntracks = per_chan;
+		}
+		o->ring = &set.rings[i];
+		if (!o->name || !(set.fh[i] = output_open(o)))
+			return -1;
+		if (ring_init(o->ring, (size_t)ring_seconds * 8000 * 2 * o->ntracks)) {
+			fprintf(stderr, "Unable to allocate %d seconds of buffer\n", ring_seconds);
+			return -1;
+		}
+		if (o->is_wav)
+			o->ring->limit = WAV_MAX_DATA;
+		fprintf(stderr, "Writing %d track(s) to %s\n", o->ntracks, o->name);
+	}
+
+	for (i = 0; i < ntracks; i++) {
+		t = &tracks[i];
+		t->chan = mon_chans[i / per_chan];
+		t->output = multifile ? 0 : i / per_chan;
+		if ((t->fd = pseudo_open()) < 0)
+			return -1;
+		memset(&zc, 0, sizeof(zc));
+		zc.chan = 0;
+		zc.confno = t->chan;
+		if (!separate)
+			zc.confmode = DAHDI_CONF_MONITORBOTH;
+		else if (i % 2)
+			zc.confmode = DAHDI_CONF_MONITORTX;
+		else
+			zc.confmode = DAHDI_CONF_MONITOR;
+		if (ioctl(t->fd, DAHDI_SETCONF, &zc) < 0) {
+			fprintf(stderr, "Unable to monitor channel %d: %s\n", t->chan, strerror(errno));
+			return -1;
+		}
+		fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_NONBLOCK);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd, &ev)) {
+			fprintf(stderr, "Unable to add channel %d to epoll: %s\n", t->chan, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (signal(SIGINT, cleanup_and_exit) == SIG_ERR) {
+		fprintf(stderr, "Error registering signal handler: %s\n", strerror(errno));
+	}
+	writer_start(&set, &writer);
+
+	while (run) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			t = &tracks[events[i].data.u32];
+			o = &outputs[t->output];
+			/* A linear read is a whole block: a short one loses the rest */
+			if (TRACK_SAMPLES - t->count < BLOCK_SIZE)
+				output_flush(o, tracks, frame, 1);
+			res = read(t->fd, t->buf + t->count, (TRACK_SAMPLES - t->count) * sizeof(short));
+			if (res < 0) {
+				if (errno == EAGAIN)
+					continue;
+				fprintf(stderr, "Read from channel %d failed: %s\n", t->chan, strerror(errno));
+				run = 0;
+				break;
+			}
+			t->count += res / sizeof(short);
+			readcount += res;
+		}
+		for (i = 0; i < noutputs; i++)
+			output_flush(&outputs[i], tracks, frame, 0);
+		if (limit && readcount >= limit)
+			break;
+	}
+
+	writer_stop(writer);
+	for (i = 0; i < noutputs; i++) {
+		o = &outputs[i];
+		ring_report(o->name, o->ring, set.written[i]);
+		if (o->padded)
+			fprintf(stderr, "%s: %llu samples of silence inserted for lagging tracks\n",
+				o->name, o->padded);
+		if (o->is_wav)
+			wavheader_finish(set.fh[i], &o->wavheader, set.written[i]);
+		fclose(set.fh[i]);
+	}
+	for (i = 0; i < ntracks; i++)
+		close(tracks[i].fd);
+	close(epfd);
+	for (i = 0; i < noutputs; i++) {
+		if (outputs[i].ring->full)
+			return -1;
+	}
+	return 0;
+}
+
 #define barlen 35
 #define baroptimal 3250
 //define barlevel 200
@@ -245,7 +802,7 @@ void draw_bar(int avg, int max)
 
 void visualize(short *tx, short *rx, int cnt)
 {
-	int x;
+	struct pcm_level txlvl, rxlvl;
 	float txavg = 0;
 	float rxavg = 0;
 	static int txmax = 0;
@@ -260,10 +817,10 @@ void visualize(short *tx, short *rx, int cnt)
 
 	gettimeofday(&tv, NULL);
 	ms = (tv.tv_sec - last.tv_sec) * 1000.0 + (tv.tv_usec - last.tv_usec) / 1000.0;
-	for (x = 0; x < cnt; x++) {
-		txavg += abs(tx[x]);
-		rxavg += abs(rx[x]);
-	}
+	pcm_level(tx, cnt, &txlvl);
+	pcm_level(rx, cnt, &rxlvl);
+	txavg = txlvl.sum;
+	rxavg = rxlvl.sum;
 	txavg = abs(txavg / cnt);
 	rxavg = abs(rxavg / cnt);
 
@@ -332,16 +889,21 @@ int main(int argc, char *argv[])
 	int opt;
 	extern char *optarg;
 	struct wavheader wavheaders[MAX_OFH]; /* we have one for each potential filehandle */
-	unsigned int bytes_written[MAX_OFH] = {0};
 	int file_is_wav[MAX_OFH] = {0};
 	int i;
+	int ring_seconds = RING_SECONDS;
+	pthread_t writer;
+	const char *multifile = NULL;
+	const char *pattern = NULL;
 
-	if ((argc < 2) || (atoi(argv[1]) < 1)) {
-		fprintf(stderr, "Usage: dahdi_monitor <channel num> [-v[v]] [-m] [-o] [-l limit] [-f FILE | -s FILE | -r FILE1 -t FILE2] [-F FILE | -S FILE | -R FILE1 -T FILE2]\n");
+	if ((argc < 2) || (atoi(argv[1]) < 1 && argv[1][0] != '-')) {
+		fprintf(stderr, "Usage: dahdi_monitor <channel num> [-v[v]] [-m] [-o] [-l limit] [-b SECONDS] [-f FILE | -s FILE | -r FILE1 -t FILE2] [-F FILE | -S FILE | -R FILE1 -T FILE2]\n");
+		fprintf(stderr, "       dahdi_monitor <-c CHANLIST | -p SPAN> [-m] [-l limit] [-b SECONDS] <-M FILE | -P PATTERN>\n");
 		fprintf(stderr, "Options:\n");
 		fprintf(stderr, "        -v: Visual mode.  Implies -m.\n");
 		fprintf(stderr, "        -vv: Visual/Verbose mode.  Implies -m.\n");
 		fprintf(stderr, "        -l LIMIT: Stop after reading LIMIT bytes\n");
+		fprintf(stderr, "        -b SECONDS: Buffer up to SECONDS of audio per file for the writer thread (default: %d)\n", RING_SECONDS);
 		fprintf(stderr, "        -m: Separate rx/tx streams.\n");
 		fprintf(stderr, "        -o: Output audio via OSS.  Note: Only 'normal' combined rx/tx streams are output via OSS.\n");
 		fprintf(stderr, "        -f FILE: Save combined rx/tx stream to mono FILE. Cannot be used with -m.\n");
@@ -352,6 +914,11 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "        -R FILE: Save pre-echocanceled rx stream to FILE. Implies -m.\n");
 		fprintf(stderr, "        -T FILE: Save pre-echocanceled tx stream to FILE. Implies -m.\n");
 		fprintf(stderr, "        -S FILE: Save pre-echocanceled stereo rx/tx stream to FILE. Implies -m.\n");
+		fprintf(stderr, "        -c CHANLIST: Record the channels in CHANLIST (e.g. 1-15,17-31). May be repeated.\n");
+		fprintf(stderr, "        -p SPAN: Record all the channels of SPAN. May be repeated.\n");
+		fprintf(stderr, "        -M FILE: Save the recorded channels as tracks of one multi-track FILE.\n");
+		fprintf(stderr, "        -P PATTERN: Save each recorded channel to its own file, named by PATTERN with %%d as the channel number.\n");
+		fprintf(stderr, "                    With -m the channel files (or tracks) are rx/tx stereo.\n");
 		fprintf(stderr, "Examples:\n");
 		fprintf(stderr, "Save a stream to a file\n");
 		fprintf(stderr, "        dahdi_monitor 1 -f stream.raw\n");
@@ -363,12 +930,15 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "        dahdi_monitor 1 -f stream.raw -F streampreecho.raw\n");
 		fprintf(stderr, "Save a normal rx/tx stream and a 'preecho' rx/tx stream to separate files\n");
 		fprintf(stderr, "        dahdi_monitor 1 -m -r streamrx.raw -t streamtx.raw -R streampreechorx.raw -T streampreechotx.raw\n");
+		fprintf(stderr, "Save every channel of span 1 to its own stereo rx/tx wav file\n");
+		fprintf(stderr, "        dahdi_monitor -p 1 -m -P chan%%03d.wav\n");
 		exit(1);
 	}
 
 	chan = atoi(argv[1]);
+	pcm_kernels_init();
 
-	while ((opt = getopt(argc, argv, "vmol:f:r:t:s:F:R:T:S:")) != -1) {
+	while ((opt = getopt(argc, argv, "vmol:b:f:r:t:s:F:R:T:S:c:p:M:P:")) != -1) {
 		switch (opt) {
 		case '?':
 			exit(EXIT_FAILURE);
@@ -389,6 +959,30 @@ int main(int argc, char *argv[])
 				limit = 0;
 			fprintf(stderr, "Will stop reading after %d bytes\n", limit);
 			break;
+		case 'b':
+			if (sscanf(optarg, "%d", &ring_seconds) != 1 || ring_seconds < 1) {
+				fprintf(stderr, "Invalid buffer length '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'c':
+			if (parse_chanlist(optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case 'p':
+			if (add_span(atoi(optarg)))
+				exit(EXIT_FAILURE);
+			break;
+		case 'M':
+			multifile = optarg;
+			break;
+		case 'P':
+			if (!pattern_valid(optarg)) {
+				fprintf(stderr, "Pattern '%s' needs a single %%d for the channel number\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			pattern = optarg;
+			break;
 		case 'f':
 			if (multichannel) {
 				fprintf(stderr, "'%c' mode cannot be used when multichannel mode is enabled.\n", opt);
@@ -596,6 +1190,29 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (mon_numchans) {
+		if (visual || ossoutput || savefile) {
+			fprintf(stderr, "Only -m, -l and -b can be combined with -c or -p.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!multifile == !pattern) {
+			fprintf(stderr, "Use exactly one of -M and -P with -c or -p.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (monitor_chans(multichannel, multifile, pattern, ring_seconds, limit))
+			exit(EXIT_FAILURE);
+		printf("done cleaning up ... exiting.\n");
+		return 0;
+	}
+	if (multifile || pattern) {
+		fprintf(stderr, "-M and -P need channels from -c or -p.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (chan < 1) {
+		fprintf(stderr, "No channel to monitor.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (ossoutput) {
 		if (multichannel) {
 			printf("Multi-channel audio is enabled.  OSS output will be disabled.\n");
@@ -685,6 +1302,22 @@ int main(int argc, char *argv[])
 	if (signal(SIGINT, cleanup_and_exit) == SIG_ERR) {
 		fprintf(stderr, "Error registering signal handler: %s\n", strerror(errno));
 	}
+	if (savefile) {
+		for (i = 0; i < MAX_OFH; i++) {
+			if (!ofh[i])
+				continue;
+			/* Stereo streams carry twice the data */
+			x = (i == MON_STEREO || i == MON_PRE_STEREO) ? 2 : 1;
+			if (ring_init(&rings[i], (size_t)ring_seconds * 8000 * 2 * x)) {
+				fprintf(stderr, "Unable to allocate %d seconds of buffer\n", ring_seconds);
+				exit(EXIT_FAILURE);
+			}
+			if (file_is_wav[i])
+				rings[i].limit = WAV_MAX_DATA;
+			setvbuf(ofh[i], NULL, _IOFBF, WRITE_BUF_SIZE);
+		}
+		writer_start(&mon_writer, &writer);
+	}
 	if (visual) {
 		printf("\nVisual Audio Levels.\n");
 		printf("--------------------\n");
@@ -698,22 +1331,17 @@ int main(int argc, char *argv[])
 		if (res_brx < 1)
 			break;
 		readcount += res_brx;
-		if (ofh[MON_BRX])
-			bytes_written[MON_BRX] += fwrite(buf_brx, 1, res_brx, ofh[MON_BRX]);
+		record(MON_BRX, buf_brx, res_brx);
 
 		if (multichannel) {
 			res_tx = read(pfd[MON_TX], buf_tx, res_brx);
 			if (res_tx < 1)
 				break;
-			if (ofh[MON_TX])
-				bytes_written[MON_TX] += fwrite(buf_tx, 1, res_tx, ofh[MON_TX]);
+			record(MON_TX, buf_tx, res_tx);
 
 			if (stereo_output && ofh[MON_STEREO]) {
-				for (x = 0; x < res_tx; x++) {
-					stereobuf[x*2] = buf_brx[x];
-					stereobuf[x*2+1] = buf_tx[x];
-				}
-				bytes_written[MON_STEREO] += fwrite(stereobuf, 1, res_tx*2, ofh[MON_STEREO]);
+				pcm_interleave(stereobuf, buf_brx, buf_tx, res_tx / 2);
+				record(MON_STEREO, stereobuf, res_tx*2);
 			}
 
 			if (visual) {
@@ -728,31 +1356,24 @@ int main(int argc, char *argv[])
 			res_brx = read(pfd[MON_PRE_BRX], buf_brx, sizeof(buf_brx));
 			if (res_brx < 1)
 				break;
-			if (ofh[MON_PRE_BRX])
-				bytes_written[MON_PRE_BRX] += fwrite(buf_brx, 1, res_brx, ofh[MON_PRE_BRX]);
+			record(MON_PRE_BRX, buf_brx, res_brx);
 
 			if (multichannel) {
 				res_tx = read(pfd[MON_PRE_TX], buf_tx, res_brx);
 				if (res_tx < 1)
 					break;
-				if (ofh[MON_PRE_TX])
-					bytes_written[MON_PRE_TX] += fwrite(buf_tx, 1, res_tx, ofh[MON_PRE_TX]);
+				record(MON_PRE_TX, buf_tx, res_tx);
 
 				if (stereo_output && ofh[MON_PRE_STEREO]) {
-					for (x = 0; x < res_brx; x++) {
-						stereobuf[x*2] = buf_brx[x];
-						stereobuf[x*2+1] = buf_tx[x];
-					}
-					bytes_written[MON_PRE_STEREO] += fwrite(stereobuf, 1, res_brx * 2, ofh[MON_PRE_STEREO]);
+					pcm_interleave(stereobuf, buf_brx, buf_tx, res_brx / 2);
+					record(MON_PRE_STEREO, stereobuf, res_brx * 2);
 				}
 			}
 		}
 
 		if (ossoutput && afd) {
 			if (stereo) {
-				for (x = 0; x < res_brx; x++) {
-					buf_tx[x << 1] = buf_tx[(x << 1) + 1] = buf_brx[x];
-				}
+				pcm_interleave(buf_tx, buf_brx, buf_brx, res_brx / 2);
 				x = write(afd, buf_tx, res_brx << 1);
 			} else {
 				x = write(afd, buf_brx, res_brx);
@@ -764,6 +1385,13 @@ int main(int argc, char *argv[])
 			break;
 		}
 	}
+	if (savefile) {
+		writer_stop(writer);
+		for (i = 0; i < MAX_OFH; i++) {
+			if (ofh[i])
+				ring_report(stream_names[i], &rings[i], bytes_written[i]);
+		}
+	}
 	/* write filesize info */
 	for (i = 0; i < MAX_OFH; i++) {
 		if (NULL == ofh[i])
@@ -771,15 +1399,13 @@ int main(int argc, char *argv[])
 		if (!(file_is_wav[i]))
 			continue;
 
-		wavheaders[i].riff_chunk_size = (bytes_written[i]) + sizeof(struct wavheader) - 8; /* filesize - 8 */
-		wavheaders[i].data_data_size = bytes_written[i];
-
-		rewind(ofh[i]);
-		if (fwrite(&wavheaders[i], 1, sizeof(struct wavheader), ofh[i]) != sizeof(struct wavheader)) {
-			fprintf(stderr, "Failed to write out a full wav header.\n");
-		}
+		wavheader_finish(ofh[i], &wavheaders[i], bytes_written[i]);
 		fclose(ofh[i]);
 	}
 	printf("done cleaning up ... exiting.\n");
+	for (i = 0; i < MAX_OFH; i++) {
+		if (rings[i].full)
+			return EXIT_FAILURE;
+	}
 	return 0;
 }
@@ -41,10 +41,18 @@
 #include <sys/ioctl.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/epoll.h>
 #include <linux/if_packet.h>
 
 #define BLOCK_SIZE 512
-#define MAX_CHAN 16
+#define NUM_BUFS 32
+#define MAX_EVENTS 64
+#define FLUSH_INTERVAL 1000		/* ms between flushes of the capture file */
+#define FLUSH_BYTES (256 * 1024)	/* or flush once this much is pending */
 //char ETH_P_LAPD[2] = {0x00, 0x30};
 
 struct mtp2_phdr {
@@ -63,28 +71,66 @@ struct lapd_sll_hdr {
 };
 
 
+/* Per direction counters; index 1 is rx (is_read), 0 is tx */
+struct chan_stats {
+	unsigned long packets;
+	unsigned long dups;
+	unsigned long overruns;	/* all NUM_BUFS buffers were full: frames were likely lost */
+	unsigned long errors;
+};
+
 struct chan_fds {
 	int rfd;
 	int tfd;
 	int chan_id;
 	int proto;
+	int ifid;	/* pcapng interface of the rx side, tx is ifid + 1 */
 	char tx_buf[BLOCK_SIZE * 4];
 	int tx_len;
 	char rx_buf[BLOCK_SIZE * 4];
 	int rx_len;
+	struct chan_stats stats[2];
+};
+
+/* Output formats */
+#define FORMAT_PCAPNG 0
+#define FORMAT_PCAP 1
+
+struct capture {
+	int format;
+	FILE *out;
+	pcap_t *pcap;		/* classic pcap only */
+	pcap_dumper_t *dump;
+	struct timespec start;
+	struct timespec opened;		/* CLOCK_MONOTONIC, for rotation */
+	unsigned long long bytes;
+	struct chan_stats *base;	/* counters when the file was opened */
 };
 
+/* Rotation: a new file every rotate_seconds or rotate_bytes, keeping keep_files */
+static int rotate_seconds;
+static unsigned long long rotate_bytes;
+static int keep_files;
+static char **kept;
+static int kept_next;
+
+static int run = 1;
+
 int make_mirror(long type, int chan)
 {
 	int res = 0;
 	int fd = 0;	
 	struct dahdi_bufferinfo bi;
-	fd = open("/dev/dahdi/pseudo", O_RDONLY);
+	fd = open("/dev/dahdi/pseudo", O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror("/dev/dahdi/pseudo");
+		return -1;
+	}
 
 	memset(&bi, 0, sizeof(bi));
         bi.txbufpolicy = DAHDI_POLICY_IMMEDIATE;
         bi.rxbufpolicy = DAHDI_POLICY_IMMEDIATE;
-        bi.numbufs = 32;
+        bi.numbufs = NUM_BUFS;
         bi.bufsize = BLOCK_SIZE;
 
 	ioctl(fd, DAHDI_SET_BUFINFO, &bi);
@@ -94,6 +140,7 @@ int make_mirror(long type, int chan)
 	if(res)
 	{
 		printf("error setting channel err=%d!\n", res);
+		close(fd);
 		return -1;
 	}
 
@@ -101,7 +148,352 @@ int make_mirror(long type, int chan)
 	return fd;
 }
 
-int log_packet(struct chan_fds * fd, char is_read, int we_are_network, pcap_dumper_t * dump)
+/*
+ * pcapng (https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-01.html)
+ * is written directly: one interface per channel and direction, so links
+ * of different protocols can share a file, and nanosecond timestamps.
+ * Interface 2*i is the rx side of chans[i], 2*i+1 the tx side.
+ */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_ISB 0x00000005
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BOM 0x1A2B3C4D
+
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT 1
+#define SHB_USERAPPL 4
+#define IF_NAME 2
+#define IF_DESCRIPTION 3
+#define IF_TSRESOL 9
+#define ISB_STARTTIME 2
+#define ISB_ENDTIME 3
+#define ISB_IFRECV 4
+#define ISB_IFDROP 5
+
+#define PAD4(x) (((x) + 3) & ~3)
+
+struct pcapng_block {
+	unsigned char data[BLOCK_SIZE * 4 + 256];
+	uint32_t len;
+};
+
+static void block_start(struct pcapng_block *b, uint32_t type)
+{
+	memcpy(b->data, &type, 4);
+	b->len = 8;	/* type and length, filled in by block_end() */
+}
+
+static void block_add(struct pcapng_block *b, const void *data, uint32_t len)
+{
+	memcpy(b->data + b->len, data, len);
+	memset(b->data + b->len + len, 0, PAD4(len) - len);
+	b->len += PAD4(len);
+}
+
+static void block_u32(struct pcapng_block *b, uint32_t val)
+{
+	block_add(b, &val, 4);
+}
+
+static void block_option(struct pcapng_block *b, uint16_t code, const void *data, uint16_t len)
+{
+	uint16_t hdr[2] = {code, len};
+
+	block_add(b, hdr, 4);
+	if (len)
+		block_add(b, data, len);
+}
+
+/* Timestamps are two 32 bit halves, in if_tsresol units (ns) */
+static void block_ts(struct pcapng_block *b, const struct timespec *ts)
+{
+	uint64_t ns = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+
+	block_u32(b, ns >> 32);
+	block_u32(b, ns & 0xffffffff);
+}
+
+static void block_option_ts(struct pcapng_block *b, uint16_t code, const struct timespec *ts)
+{
+	uint64_t ns = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+	uint32_t halves[2] = {ns >> 32, ns & 0xffffffff};
+
+	block_option(b, code, halves, 8);
+}
+
+static int block_end(struct pcapng_block *b, FILE *out)
+{
+	uint32_t total = b->len + 4;
+
+	memcpy(b->data + 4, &total, 4);
+	memcpy(b->data + b->len, &total, 4);
+	if (fwrite(b->data, 1, total, out) != total)
+		return -1;
+	return total;
+}
+
+static int pcapng_header(FILE *out, struct chan_fds *chans, int num_chans)
+{
+	static const char appl[] = "dahdi_pcap";
+	struct pcapng_block b;
+	uint32_t bom = PCAPNG_BOM;
+	uint16_t version[2] = {1, 0};
+	uint64_t section_len = (uint64_t)-1;
+	uint16_t linktype[2];
+	uint8_t tsresol = 9;	/* nanoseconds */
+	char name[32];
+	const char *desc;
+	int i, dir;
+
+	block_start(&b, PCAPNG_SHB);
+	block_add(&b, &bom, 4);
+	block_add(&b, version, 4);
+	block_add(&b, &section_len, 8);
+	block_option(&b, SHB_USERAPPL, appl, strlen(appl));
+	block_option(&b, OPT_ENDOFOPT, NULL, 0);
+	if (block_end(&b, out) < 0)
+		return -1;
+
+	for (i = 0; i < num_chans; i++) {
+		desc = (chans[i].proto == DLT_LINUX_LAPD) ? "LAPD" : "MTP2";
+		for (dir = 0; dir < 2; dir++) {
+			block_start(&b, PCAPNG_IDB);
+			linktype[0] = chans[i].proto;
+			linktype[1] = 0;
+			block_add(&b, linktype, 4);
+			block_u32(&b, BLOCK_SIZE * 4);
+			snprintf(name, sizeof(name), "dahdi%d-%s", chans[i].chan_id, dir ? "tx" : "rx");
+			block_option(&b, IF_NAME, name, strlen(name));
+			block_option(&b, IF_DESCRIPTION, desc, strlen(desc));
+			block_option(&b, IF_TSRESOL, &tsresol, 1);
+			block_option(&b, OPT_ENDOFOPT, NULL, 0);
+			if (block_end(&b, out) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* One statistics block per interface, for the packets and overruns so far */
+static void pcapng_stats(FILE *out, struct chan_fds *chans, int num_chans,
+			 const struct chan_stats *base, const struct timespec *start)
+{
+	struct chan_stats diff;
+	struct pcapng_block b;
+	struct chan_stats *st;
+	struct timespec now;
+	uint64_t val;
+	char comment[96];
+	int i, dir;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (i = 0; i < num_chans; i++) {
+		for (dir = 0; dir < 2; dir++) {
+			st = &chans[i].stats[dir ? 0 : 1];
+			diff.packets = st->packets - base[i * 2 + !dir].packets;
+			diff.dups = st->dups - base[i * 2 + !dir].dups;
+			diff.overruns = st->overruns - base[i * 2 + !dir].overruns;
+			diff.errors = st->errors - base[i * 2 + !dir].errors;
+			st = &diff;
+			block_start(&b, PCAPNG_ISB);
+			block_u32(&b, i * 2 + dir);
+			block_ts(&b, &now);
+			block_option_ts(&b, ISB_STARTTIME, start);
+			block_option_ts(&b, ISB_ENDTIME, &now);
+			val = st->packets + st->dups;
+			block_option(&b, ISB_IFRECV, &val, 8);
+			/* The mirror has no drop counter; overruns is the closest */
+			val = st->overruns;
+			block_option(&b, ISB_IFDROP, &val, 8);
+			snprintf(comment, sizeof(comment),
+				 "duplicates skipped: %lu, buffer overruns: %lu, read errors: %lu",
+				 st->dups, st->overruns, st->errors);
+			block_option(&b, OPT_COMMENT, comment, strlen(comment));
+			block_option(&b, OPT_ENDOFOPT, NULL, 0);
+			block_end(&b, out);
+		}
+	}
+}
+
+static int capture_open(struct capture *cap, const char *filename, struct chan_fds *chans,
+			int num_chans, int flush_bytes)
+{
+	int i;
+
+	if (!strcmp(filename, "-"))
+		cap->out = stdout;
+	else if (!(cap->out = fopen(filename, "w"))) {
+		perror(filename);
+		return -1;
+	}
+	/* Packets reach the disk in flush_bytes sized writes, or on the timer */
+	setvbuf(cap->out, NULL, _IOFBF, flush_bytes);
+	clock_gettime(CLOCK_REALTIME, &cap->start);
+	clock_gettime(CLOCK_MONOTONIC, &cap->opened);
+	cap->bytes = 0;
+	free(cap->base);
+	cap->base = malloc(num_chans * sizeof(chans->stats));
+	if (!cap->base) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < num_chans; i++)
+		memcpy(&cap->base[i * 2], chans[i].stats, sizeof(chans->stats));
+
+	if (cap->format == FORMAT_PCAP) {
+		cap->pcap = pcap_open_dead(chans[0].proto, BLOCK_SIZE*4);
+		cap->dump = pcap_dump_fopen(cap->pcap, cap->out);
+		if (!cap->dump) {
+			fprintf(stderr, "Unable to write to %s\n", filename);
+			return -1;
+		}
+		return 0;
+	}
+	if (pcapng_header(cap->out, chans, num_chans)) {
+		fprintf(stderr, "Unable to write to %s\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the number of bytes added to the file */
+static int capture_packet(struct capture *cap, struct chan_fds *fd, char is_read,
+			  const struct timespec *ts, struct pcap_pkthdr *hdr, unsigned char *buf)
+{
+	struct pcapng_block b;
+	int res;
+
+	if (cap->format == FORMAT_PCAP) {
+		hdr->ts.tv_sec = ts->tv_sec;
+		hdr->ts.tv_usec = ts->tv_nsec / 1000;
+		pcap_dump((u_char*)cap->dump, hdr, buf);
+		cap->bytes += hdr->caplen + sizeof(struct pcap_pkthdr);
+		return hdr->caplen + sizeof(struct pcap_pkthdr);
+	}
+	block_start(&b, PCAPNG_EPB);
+	block_u32(&b, fd->ifid + (is_read ? 0 : 1));
+	block_ts(&b, ts);
+	block_u32(&b, hdr->caplen);
+	block_u32(&b, hdr->len);
+	block_add(&b, buf, hdr->caplen);
+	res = block_end(&b, cap->out);
+	if (res > 0)
+		cap->bytes += res;
+	return res;
+}
+
+static void capture_flush(struct capture *cap)
+{
+	if (cap->format == FORMAT_PCAP)
+		pcap_dump_flush(cap->dump);
+	else
+		fflush(cap->out);
+}
+
+static void capture_close(struct capture *cap, struct chan_fds *chans, int num_chans)
+{
+	if (cap->format == FORMAT_PCAP) {
+		pcap_dump_close(cap->dump);
+		pcap_close(cap->pcap);
+		return;
+	}
+	pcapng_stats(cap->out, chans, num_chans, cap->base, &cap->start);
+	if (cap->out == stdout)
+		fflush(stdout);
+	else
+		fclose(cap->out);
+}
+
+/*
+ * Name a rotated file after the current time: strftime() expands the
+ * pattern if it has any %, otherwise the time goes before the extension.
+ * Files opened within the same second get a sequence number too.
+ */
+static void rotation_name(char *name, size_t len, const char *pattern)
+{
+	static char last[PATH_MAX];
+	static int seq;
+	char stamp[64];
+	char *ext;
+	struct tm tm;
+	time_t now;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	if (strchr(pattern, '%')) {
+		strftime(name, len, pattern, &tm);
+	} else {
+		strftime(stamp, sizeof(stamp), "-%Y%m%d-%H%M%S", &tm);
+		ext = strrchr(pattern, '.');
+		if (!ext || strchr(ext, '/'))
+			ext = (char *)pattern + strlen(pattern);
+		snprintf(name, len, "%.*s%s%s", (int)(ext - pattern), pattern, stamp, ext);
+	}
+	if (!strcmp(name, last)) {
+		snprintf(stamp, sizeof(stamp), "-%d", ++seq);
+		ext = strrchr(name, '.');
+		if (!ext || strchr(ext, '/'))
+			ext = name + strlen(name);
+		memmove(ext + strlen(stamp), ext, strlen(ext) + 1);
+		memcpy(ext, stamp, strlen(stamp));
+		return;
+	}
+	seq = 0;
+	snprintf(last, sizeof(last), "%s", name);
+}
+
+/* Remember a new capture file, deleting the oldest beyond keep_files */
+static void rotation_keep(const char *name)
+{
+	if (!keep_files)
+		return;
+	if (kept[kept_next]) {
+		if (unlink(kept[kept_next]))
+			perror(kept[kept_next]);
+		free(kept[kept_next]);
+	}
+	kept[kept_next] = strdup(name);
+	kept_next = (kept_next + 1) % keep_files;
+}
+
+static int rotation_due(struct capture *cap)
+{
+	struct timespec now;
+
+	if (rotate_bytes && cap->bytes >= rotate_bytes)
+		return 1;
+	if (!rotate_seconds)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec - cap->opened.tv_sec >= rotate_seconds;
+}
+
+/*
+ * Switch to a new file. This runs between reads: anything that arrives
+ * meanwhile waits in the mirror buffers, so no frame is lost or split.
+ */
+static int capture_rotate(struct capture *cap, const char *pattern, struct chan_fds *chans,
+			  int num_chans, int flush_bytes)
+{
+	struct capture old = *cap;
+	char name[PATH_MAX];
+
+	rotation_name(name, sizeof(name), pattern);
+	cap->base = NULL;
+	if (capture_open(cap, name, chans, num_chans, flush_bytes)) {
+		free(cap->base);
+		*cap = old;
+		return -1;
+	}
+	capture_close(&old, chans, num_chans);
+	free(old.base);
+	rotation_keep(name);
+	return 0;
+}
+
+int log_packet(struct chan_fds * fd, char is_read, int we_are_network, struct capture *cap,
+	       const struct timespec *ts)
 {
 	unsigned char buf[BLOCK_SIZE * 4];
 	int res = 0;
@@ -125,9 +517,11 @@ int log_packet(struct chan_fds * fd, char is_read, int we_are_network, pcap_dump
 	}
 
 	memset(buf, 0, sizeof(buf));
+	res = read(is_read ? fd->rfd : fd->tfd, dataptr, datasize);
+	if (res <= 0)
+		return -1;
 	if(is_read)
 	{
-		res = read(fd->rfd, dataptr, datasize);
 		if(fd->rx_len > 0 && res == fd->rx_len && !memcmp(fd->rx_buf, dataptr, res) )
 		{
 			//skipping dup
@@ -139,7 +533,6 @@ int log_packet(struct chan_fds * fd, char is_read, int we_are_network, pcap_dump
 	}
 	else
 	{
-		res = read(fd->tfd, dataptr, datasize);
 		if(fd->tx_len > 0 && res == fd->tx_len && !memcmp(fd->tx_buf, dataptr, res) )
 		{
 			//skipping dup
@@ -150,11 +543,6 @@ int log_packet(struct chan_fds * fd, char is_read, int we_are_network, pcap_dump
 		fd->tx_len = res;
 	}
 
-	gettimeofday(&hdr.ts, NULL);
-
-	
-
-	
 	if(res > 0)
 	{
 		if(fd->proto == DLT_LINUX_LAPD)
@@ -187,10 +575,73 @@ int log_packet(struct chan_fds * fd, char is_read, int we_are_network, pcap_dump
 			}
 			mtp2->link_number = htons(fd->chan_id);
 		}
-		pcap_dump((u_char*)dump, &hdr, buf);
-		pcap_dump_flush(dump);
 	}
-	return 1;
+	return capture_packet(cap, fd, is_read, ts, &hdr, buf);
+}
+
+/*
+ * Read everything queued on one mirror. Returns the bytes added to the
+ * capture file. The mirror has NUM_BUFS buffers; finding all of them
+ * full means the kernel may have had nowhere to put further frames.
+ */
+static int drain_mirror(struct chan_fds *fd, char is_read, int we_are_network, struct capture *cap,
+			const struct timespec *ts)
+{
+	struct chan_stats *stats = &fd->stats[is_read ? 1 : 0];
+	int reads = 0;
+	int bytes = 0;
+	int res;
+
+	while (reads < NUM_BUFS) {
+		res = log_packet(fd, is_read, we_are_network, cap, ts);
+		if (res < 0) {
+			if (errno != EAGAIN)
+				stats->errors++;
+			break;
+		}
+		reads++;
+		if (res == 0) {
+			stats->dups++;
+			continue;
+		}
+		stats->packets++;
+		bytes += res;
+	}
+	if (reads == NUM_BUFS)
+		stats->overruns++;
+	return bytes;
+}
+
+static void print_stats(struct chan_fds *chans, int num_chans)
+{
+	static const char *dirs[2] = {"tx", "rx"};
+	struct chan_stats *st;
+	int i, dir;
+
+	fprintf(stderr, "%6s %3s %10s %8s %9s %7s\n",
+		"chan", "dir", "packets", "dups", "overruns", "errors");
+	for (i = 0; i < num_chans; i++) {
+		for (dir = 1; dir >= 0; dir--) {
+			st = &chans[i].stats[dir];
+			fprintf(stderr, "%6d %3s %10lu %8lu %9lu %7lu\n",
+				chans[i].chan_id, dirs[dir], st->packets,
+				st->dups, st->overruns, st->errors);
+		}
+	}
+}
+
+static void stop_capture(int sig)
+{
+	run = 0;
+}
+
+static long elapsed_ms(struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+		(now.tv_nsec - since->tv_nsec) / 1000000;
 }
 
 void usage() 
@@ -198,24 +649,42 @@ void usage()
 	printf("Usage: dahdi_pcap [OPTIONS]\n");
 	printf("Capture packets from DAHDI channels to pcap file\n\n");
 	printf("Options:\n");
-	printf("  -p, --proto=[mtp2|lapd]   The protocol to capture, default mtp2\n");
-	printf("  -c, --chan=<channels>     Comma separated list of channels to capture from, max %d. Mandatory\n", MAX_CHAN);
+	printf("  -p, --proto=[mtp2|lapd]   The protocol of the channels that follow, default mtp2\n");
+	printf("  -c, --chan=<channels>     Comma separated list of channels to capture from. Mandatory\n");
+	printf("                            May be repeated, e.g. -p lapd -c 16 -p mtp2 -c 1,2 (pcapng only)\n");
 	printf("  -r, --role=[network|user] Is the local side the network or user side in ISDN?\n");
 	printf("  -f, --file=<filename>     The pcap file to capture to. Mandatory\n");
+	printf("  -F, --format=[pcapng|pcap] The file format, default pcapng\n");
+	printf("  -G, --rotate-seconds=<s>  Start a new file every s seconds\n");
+	printf("  -C, --rotate-size=<MB>    Start a new file once the current one reaches MB megabytes\n");
+	printf("  -W, --keep-files=<n>      With rotation, delete all but the newest n files\n");
+	printf("                            Rotated files are named by time: by strftime() if the\n");
+	printf("                            file name has a %%, else with -YYYYmmdd-HHMMSS added\n");
+	printf("  -i, --flush-interval=<ms> Write captured packets to the file at least this often, default %d\n", FLUSH_INTERVAL);
+	printf("  -b, --flush-bytes=<bytes> Or once this many bytes are pending, default %d\n", FLUSH_BYTES);
 	printf("  -h, --help                Display this text\n");
 }
 
 int main(int argc, char **argv)
 {
-	struct chan_fds chans[MAX_CHAN];
+	struct chan_fds *chans = NULL;
 	char *filename = NULL;
 	int num_chans = 0;
-	int max_fd = 0;
 	int proto = DLT_MTP2_WITH_PHDR;
 	int we_are_network = 0;
-
-	int i;
-	int packetcount;
+	int flush_interval = FLUSH_INTERVAL;
+	int flush_bytes = FLUSH_BYTES;
+	int format = FORMAT_PCAPNG;
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct timespec last_flush, wakeup;
+	struct capture cap;
+	char rotated[PATH_MAX];
+	int epfd;
+	int pending = 0;
+	long timeout;
+
+	int i, n;
+	unsigned long packetcount;
 	int c;
 
 	while (1) {
@@ -225,11 +694,17 @@ int main(int argc, char **argv)
 			{"chan", required_argument, 0, 'c'},
 			{"role", required_argument, 0, 'r'},
 			{"file", required_argument, 0, 'f'},
+			{"flush-interval", required_argument, 0, 'i'},
+			{"flush-bytes", required_argument, 0, 'b'},
+			{"format", required_argument, 0, 'F'},
+			{"rotate-seconds", required_argument, 0, 'G'},
+			{"rotate-size", required_argument, 0, 'C'},
+			{"keep-files", required_argument, 0, 'W'},
 			{"help", 0, 0, 'h'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "p:c:r:f:?",
+		c = getopt_long(argc, argv, "p:c:r:f:i:b:F:G:C:W:?",
 			  long_options, &option_index);
 		if (c == -1)
 			break;
@@ -241,36 +716,41 @@ int main(int argc, char **argv)
 				{
 					proto = DLT_LINUX_LAPD;
 				}
-				else if(argc > 0 && strcasecmp("MTP2", argv[1])==0)
+				else if(strcasecmp("MTP2", optarg)==0)
 				{
 					proto = DLT_MTP2_WITH_PHDR;
 				}
+				else
+				{
+					fprintf(stderr, "Protocol must be mtp2 or lapd!\n");
+					exit(1);
+				}
 				break;
 			case 'c':
-				// TODO Should it be possible to override protocol per channel?
-				// Channels, comma separated list
-				while(optarg != NULL && num_chans < MAX_CHAN)
+				// Channels, comma separated list, using the last
+				// protocol given
+				while(optarg != NULL)
 				{
 					int chan = atoi(strsep(&optarg, ","));
 
-
+					chans = realloc(chans, (num_chans + 1) * sizeof(*chans));
+					if (!chans) {
+						fprintf(stderr, "Out of memory\n");
+						exit(1);
+					}
+					memset(&chans[num_chans], 0, sizeof(*chans));
 					chans[num_chans].tfd = make_mirror(DAHDI_TXMIRROR, chan);
 					chans[num_chans].rfd = make_mirror(DAHDI_RXMIRROR, chan);
 					chans[num_chans].chan_id = chan;
 					chans[num_chans].proto = proto;
-
-					if(chans[num_chans].tfd > max_fd)
-					{
-						max_fd = chans[num_chans].tfd;
-					}
-					if(chans[num_chans].rfd > max_fd)
-					{
-						max_fd = chans[num_chans].rfd;
+					chans[num_chans].ifid = num_chans * 2;
+					if (chans[num_chans].tfd < 0 || chans[num_chans].rfd < 0) {
+						fprintf(stderr, "Unable to mirror channel %d\n", chan);
+						exit(1);
 					}
 
 					num_chans++;
 				}
-				max_fd++;
 				break;
 			case 'r':
 				if (!strcasecmp("network", optarg))
@@ -286,6 +766,51 @@ int main(int argc, char **argv)
 				// File to capture to
 				filename=optarg;
 				break;
+			case 'i':
+				flush_interval = atoi(optarg);
+				if (flush_interval < 1) {
+					fprintf(stderr, "Flush interval must be at least 1 ms\n");
+					exit(1);
+				}
+				break;
+			case 'b':
+				flush_bytes = atoi(optarg);
+				if (flush_bytes < 1) {
+					fprintf(stderr, "Flush size must be at least 1 byte\n");
+					exit(1);
+				}
+				break;
+			case 'F':
+				if (!strcasecmp("pcapng", optarg))
+					format = FORMAT_PCAPNG;
+				else if (!strcasecmp("pcap", optarg))
+					format = FORMAT_PCAP;
+				else {
+					fprintf(stderr, "Format must be pcapng or pcap!\n");
+					exit(1);
+				}
+				break;
+			case 'G':
+				rotate_seconds = atoi(optarg);
+				if (rotate_seconds < 1) {
+					fprintf(stderr, "Rotation interval must be at least 1 second\n");
+					exit(1);
+				}
+				break;
+			case 'C':
+				rotate_bytes = strtoull(optarg, NULL, 10) * 1000000;
+				if (!rotate_bytes) {
+					fprintf(stderr, "Rotation size must be at least 1 MB\n");
+					exit(1);
+				}
+				break;
+			case 'W':
+				keep_files = atoi(optarg);
+				if (keep_files < 1) {
+					fprintf(stderr, "Must keep at least 1 file\n");
+					exit(1);
+				}
+				break;
 			case 'h':
 			default:
 				// Usage
@@ -299,10 +824,14 @@ int main(int argc, char **argv)
 	}
 	else
 	{
-		printf("Capturing protocol %s on channels ", (proto == DLT_MTP2_WITH_PHDR ? "mtp2":"lapd"));
+		printf("Capturing on channels ");
 		for(i = 0; i < num_chans; i++)
 		{
-			printf("%d", chans[i].chan_id);
+			printf("%d (%s)", chans[i].chan_id, (chans[i].proto == DLT_MTP2_WITH_PHDR ? "mtp2":"lapd"));
+			if (format == FORMAT_PCAP && chans[i].proto != chans[0].proto) {
+				fprintf(stderr, "\nA pcap file has a single protocol; use pcapng to mix them\n");
+				exit(1);
+			}
 			if(i<num_chans-1)
 			{
 				printf(", ");
@@ -311,36 +840,101 @@ int main(int argc, char **argv)
 		printf(" to file %s\n", filename);
 	}
 
-	pcap_t * pcap = pcap_open_dead(chans[0].proto, BLOCK_SIZE*4);
-	pcap_dumper_t * dump = pcap_dump_open(pcap, filename);
-	
+	memset(&cap, 0, sizeof(cap));
+	cap.format = format;
+	if (rotate_seconds || rotate_bytes) {
+		if (!strcmp(filename, "-")) {
+			fprintf(stderr, "Cannot rotate standard output\n");
+			exit(1);
+		}
+		if (keep_files && !(kept = calloc(keep_files, sizeof(*kept)))) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		rotation_name(rotated, sizeof(rotated), filename);
+		if (capture_open(&cap, rotated, chans, num_chans, flush_bytes))
+			exit(1);
+		rotation_keep(rotated);
+		printf("Writing %s\n", rotated);
+	} else {
+		if (keep_files) {
+			fprintf(stderr, "--keep-files needs --rotate-seconds or --rotate-size\n");
+			exit(1);
+		}
+		if (capture_open(&cap, filename, chans, num_chans, flush_bytes))
+			exit(1);
+	}
+
+	epfd = epoll_create(num_chans * 2);
+	if (epfd < 0) {
+		perror("epoll_create");
+		exit(1);
+	}
+	for(i = 0; i < num_chans; i++)
+	{
+		/* data is the channel index, with the direction in the low bit */
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = (i << 1) | 1;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, chans[i].rfd, &ev))
+			perror("epoll_ctl");
+		ev.data.u32 = i << 1;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, chans[i].tfd, &ev))
+			perror("epoll_ctl");
+	}
+
+	signal(SIGINT, stop_capture);
+	signal(SIGTERM, stop_capture);
+
 	packetcount=0;
-	while(1)
+	clock_gettime(CLOCK_MONOTONIC, &last_flush);
+	while(run)
 	{
-		fd_set rd_set;
-		FD_ZERO(&rd_set);
-		for(i = 0; i < num_chans; i++)
+		timeout = flush_interval - elapsed_ms(&last_flush);
+		n = epoll_wait(epfd, events, MAX_EVENTS, timeout > 0 ? timeout : 0);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+		/*
+		 * The mirror carries no receive time, so the wakeup is the
+		 * earliest point we know every queued frame had arrived by.
+		 */
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+
+		for(i = 0; i < n; i++)
 		{
-			FD_SET(chans[i].tfd, &rd_set);
-			FD_SET(chans[i].rfd, &rd_set);
+			struct chan_fds *fd = &chans[events[i].data.u32 >> 1];
+			char is_read = events[i].data.u32 & 1;
+
+			pending += drain_mirror(fd, is_read, we_are_network, &cap, &wakeup);
 		}
 
-		select(max_fd, &rd_set, NULL, NULL, NULL);
+		if ((rotate_seconds || rotate_bytes) && rotation_due(&cap)) {
+			if (capture_rotate(&cap, filename, chans, num_chans, flush_bytes))
+				fprintf(stderr, "Rotation failed, still writing the old file\n");
+			pending = 0;
+		}
 
-		for(i = 0; i < num_chans; i++)
-		{
-			if(FD_ISSET(chans[i].rfd, &rd_set))
-			{
-				packetcount += log_packet(&chans[i], 1, we_are_network, dump);
-			}
-			if(FD_ISSET(chans[i].tfd, &rd_set))
-			{
-				packetcount += log_packet(&chans[i], 0, we_are_network, dump);
+		if (pending >= flush_bytes || elapsed_ms(&last_flush) >= flush_interval) {
+			if (pending)
+				capture_flush(&cap);
+			pending = 0;
+			clock_gettime(CLOCK_MONOTONIC, &last_flush);
+			packetcount = 0;
+			for (i = 0; i < num_chans; i++)
+				packetcount += chans[i].stats[0].packets + chans[i].stats[1].packets;
+			if (cap.out != stdout) {
+				printf("Packets captured: %lu\r", packetcount);
+				fflush(stdout);
 			}
 		}
-		printf("Packets captured: %d\r", packetcount);
-		fflush(stdout);
 	}
 
+	capture_close(&cap, chans, num_chans);
+	free(cap.base);
+	printf("\n");
+	print_stats(chans, num_chans);
+
 	return 0;
 }
@@ -14,12 +14,14 @@
 
 /*
  * 
- * Generic speed test -- Run an infinite loop and
- * see how high we can count (in 5 seconds).  You 
- * can use this to measure how much CPU DAHDI REALLY 
- * is taking.
- * 
- * MUST BE COMPILED WITHOUT OPTIMIZATION
+ * Generic speed test -- Run a calibrated workload on every CPU at
+ * once and see how much work each core gets done. Comparing a run
+ * with the spans idle against one with the spans running shows how
+ * much CPU DAHDI REALLY is taking on each core.
+ *
+ * The workload is a xorshift chain: every step depends on the previous
+ * one, so the compiler cannot fold or vectorise it and the figures do
+ * not depend on the optimisation level.
  *
  */
 
@@ -36,30 +38,436 @@
  * this program for more details.
  */
 
+#define _GNU_SOURCE	/* for sched_setaffinity() */
 #include <stdio.h>
 #include <sys/signal.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "dahdi_tools_version.h"
 
-static long count=0;
+#define CHUNK_NS	100000		/* Check the clock about every 0.1 ms */
+#define MAX_IRQ_LINES	1024
+#define TOP_IRQS	8
+
+struct cpu_times {
+	unsigned long long total;
+	unsigned long long irq;
+	unsigned long long softirq;
+};
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	uint64_t loops;
+	double seconds;
+	uint32_t sink;
+	struct cpu_times before;
+	struct cpu_times after;
+	unsigned long long irqs_before;
+	unsigned long long irqs_after;
+	double baseline;	/* Loops per second from the baseline file, or 0 */
+};
+
+struct irq_line {
+	char label[16];
+	char name[64];
+	unsigned long long *counts;	/* One per CPU column */
+	unsigned long long delta;
+};
+
+static volatile int stop;
+static long chunk;
+static pthread_barrier_t start_barrier;
 
-static void alm(int sig)
+static struct worker *workers;
+static int numworkers;
+
+static inline uint32_t workload(uint32_t x, long loops)
 {
-	printf("Count: %ld\n", count);
-	exit(0);
+	while (loops--) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	return x;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Find how many loops take CHUNK_NS on this CPU */
+static void calibrate(void)
+{
+	long loops;
+	double start, elapsed;
+	uint32_t x = 1;
+
+	for (loops = 1000; ; loops *= 2) {
+		start = now();
+		x = workload(x, loops);
+		elapsed = now() - start;
+		if (elapsed > 0.01)
+			break;
+	}
+	chunk = loops * (CHUNK_NS / 1e9) / elapsed;
+	if (chunk < 1)
+		chunk = 1;
+	workers[0].sink = x;
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *w = data;
+	cpu_set_t cpus;
+	uint32_t x = w->cpu + 1;
+	double start;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus))
+		fprintf(stderr, "Unable to pin to CPU %d: %s\n", w->cpu, strerror(errno));
+
+	pthread_barrier_wait(&start_barrier);
+	start = now();
+	while (!stop) {
+		x = workload(x, chunk);
+		w->loops += chunk;
+	}
+	w->seconds = now() - start;
+	w->sink = x;
+	return NULL;
+}
+
+static struct worker *find_worker(int cpu)
+{
+	int x;
+
+	for (x = 0; x < numworkers; x++) {
+		if (workers[x].cpu == cpu)
+			return &workers[x];
+	}
+	return NULL;
+}
+
+static void read_proc_stat(int after)
+{
+	FILE *fp;
+	char line[512];
+	int cpu;
+	unsigned long long v[10];
+	struct worker *w;
+	struct cpu_times *t;
+	int n, x;
+
+	fp = fopen("/proc/stat", "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		memset(v, 0, sizeof(v));
+		n = sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &cpu, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+			   &v[7], &v[8], &v[9]);
+		if (n < 8 || !(w = find_worker(cpu)))
+			continue;
+		t = after ? &w->after : &w->before;
+		/* user nice system idle iowait irq softirq steal (guest is in user) */
+		t->total = 0;
+		for (x = 0; x < 8; x++)
+			t->total += v[x];
+		t->irq = v[5];
+		t->softirq = v[6];
+	}
+	fclose(fp);
+}
+
+/*
+ * Read /proc/interrupts. Adds the per-CPU totals to the workers and, if
+ * 'lines' is given, keeps the per-line counts so the busiest lines can
+ * be shown.
+ */
+static int read_proc_interrupts(int after, struct irq_line *lines, int *numlines,
+				int **columns, int *numcolumns)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t len = 0;
+	char *p, *end;
+	int col, cpu;
+	int nlines = 0;
+	struct worker *w;
+	unsigned long long count;
+
+	fp = fopen("/proc/interrupts", "r");
+	if (!fp)
+		return -1;
+	/* Header: the CPU of each column */
+	if (getline(&line, &len, fp) < 0) {
+		fclose(fp);
+		free(line);
+		return -1;
+	}
+	if (!*columns) {
+		*numcolumns = 0;
+		for (p = line; (p = strstr(p, "CPU")); p += 3)
+			(*numcolumns)++;
+		*columns = calloc(*numcolumns ? *numcolumns : 1, sizeof(int));
+		col = 0;
+		for (p = line; (p = strstr(p, "CPU")) && col < *numcolumns; p += 3)
+			(*columns)[col++] = atoi(p + 3);
+	}
+	while (getline(&line, &len, fp) >= 0) {
+		struct irq_line *l = NULL;
+
+		p = strchr(line, ':');
+		if (!p)
+			continue;
+		*p++ = '\0';
+		if (lines && nlines < MAX_IRQ_LINES) {
+			l = &lines[nlines];
+			if (!after) {
+				snprintf(l->label, sizeof(l->label), "%s", line + strspn(line, " "));
+				l->counts = calloc(*numcolumns, sizeof(*l->counts));
+			} else if (strcmp(l->label, line + strspn(line, " "))) {
+				l = NULL;	/* Lines changed under us */
+			}
+		}
+		for (col = 0; col < *numcolumns; col++) {
+			count = strtoull(p, &end, 10);
+			if (end == p)
+				break;
+			p = end;
+			cpu = (*columns)[col];
+			if ((w = find_worker(cpu))) {
+				if (after)
+					w->irqs_after += count;
+				else
+					w->irqs_before += count;
+			}
+			if (l && l->counts) {
+				if (after) {
+					l->delta += count - l->counts[col];
+					l->counts[col] = count - l->counts[col];
+				} else {
+					l->counts[col] = count;
+				}
+			}
+		}
+		if (l && !after) {
+			snprintf(l->name, sizeof(l->name), "%s", p + strspn(p, " "));
+			l->name[strcspn(l->name, "\n")] = '\0';
+		}
+		nlines++;
+	}
+	if (numlines)
+		*numlines = nlines < MAX_IRQ_LINES ? nlines : MAX_IRQ_LINES;
+	free(line);
+	fclose(fp);
+	return 0;
 }
 
+static int cmp_irq_delta(const void *a, const void *b)
+{
+	const struct irq_line *la = a, *lb = b;
+
+	if (la->delta == lb->delta)
+		return 0;
+	return (la->delta < lb->delta) ? 1 : -1;
+}
+
+static void load_baseline(const char *name)
+{
+	FILE *fp;
+	char line[128];
+	int cpu;
+	double rate;
+	struct worker *w;
+
+	fp = fopen(name, "r");
+	if (!fp) {
+		fprintf(stderr, "Unable to open baseline '%s': %s\n", name, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%d %lf", &cpu, &rate) == 2 && (w = find_worker(cpu)))
+			w->baseline = rate;
+	}
+	fclose(fp);
+}
+
+static void save_results(const char *name)
+{
+	FILE *fp;
+	int x;
+
+	fp = fopen(name, "w");
+	if (!fp) {
+		fprintf(stderr, "Unable to open '%s': %s\n", name, strerror(errno));
+		return;
+	}
+	fprintf(fp, "# cpu loops_per_second\n");
+	for (x = 0; x < numworkers; x++)
+		fprintf(fp, "%d %.0f\n", workers[x].cpu,
+			workers[x].loops / workers[x].seconds);
+	fclose(fp);
+}
+
+static double percent(unsigned long long part, unsigned long long total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+static void report(int baseline, struct irq_line *lines, int numlines,
+		   int *columns, int numcolumns, int top)
+{
+	double rate, total = 0;
+	int x, col;
+
+	printf("%4s %14s %7s %9s %12s%s\n", "CPU", "Loops/s", "IRQ %",
+	       "SoftIRQ %", "IRQs/s", baseline ? "   vs idle" : "");
+	for (x = 0; x < numworkers; x++) {
+		struct worker *w = &workers[x];
+		unsigned long long jiffies = w->after.total - w->before.total;
+
+		rate = w->loops / w->seconds;
+		total += rate;
+		printf("%4d %14.0f %7.2f %9.2f %12.0f", w->cpu, rate,
+		       percent(w->after.irq - w->before.irq, jiffies),
+		       percent(w->after.softirq - w->before.softirq, jiffies),
+		       (w->irqs_after - w->irqs_before) / w->seconds);
+		if (w->baseline > 0)
+			printf(" %+9.2f%%", 100.0 * (rate - w->baseline) / w->baseline);
+		printf("\n");
+	}
+	printf("Count: %.0f loops/s on %d CPUs (%ld loops per chunk)\n",
+	       total, numworkers, chunk);
+
+	if (!top || !lines)
+		return;
+	qsort(lines, numlines, sizeof(*lines), cmp_irq_delta);
+	printf("\nBusiest interrupt lines (per second, per CPU):\n");
+	for (x = 0; x < numlines && x < top && lines[x].delta; x++) {
+		printf("%6s:", lines[x].label);
+		for (col = 0; col < numcolumns; col++) {
+			if (find_worker(columns[col]))
+				printf(" %d=%.0f", columns[col],
+				       lines[x].counts[col] / workers[0].seconds);
+		}
+		printf("  %s\n", lines[x].name);
+	}
+}
+
+static void usage(char *argv0)
+{
+	char *c;
+	c = strrchr(argv0, '/');
+	if (!c)
+		c = argv0;
+	else
+		c++;
+	fprintf(stderr,
+		"Usage: %s [-t SECONDS] [-o FILE] [-B FILE] [-v]\n"
+		"    Runs a calibrated workload on every CPU at once.\n"
+		"    Valid options are:\n"
+		"  -t SECONDS  Run for SECONDS (default: 5).\n"
+		"  -o FILE     Save the per-CPU results to FILE (e.g. with spans idle).\n"
+		"  -B FILE     Compare against results saved earlier with -o.\n"
+		"  -v          Also show the busiest interrupt lines.\n"
+		"  -h          This help text.\n"
+	, c);
+}
 
 int main(int argc, char *argv[])
 {
-	int a=0,b=0,c;
-	signal(SIGALRM, alm);
-	alarm(5);
-	for (;;) {
-		for (c=0;c<1000;c++)
-			a = a * b;
-		count++;
+	static struct irq_line lines[MAX_IRQ_LINES];
+	int numlines = 0;
+	int *columns = NULL;
+	int numcolumns = 0;
+	int seconds = 5;
+	const char *outfile = NULL;
+	const char *basefile = NULL;
+	int verbose = 0;
+	cpu_set_t allowed;
+	int c, x;
+
+	while ((c = getopt(argc, argv, "t:o:B:vh")) != -1) {
+		switch (c) {
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'B':
+			basefile = optarg;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (seconds < 1) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	/* One worker per CPU we are allowed to run on */
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		fprintf(stderr, "Unable to get CPU affinity: %s\n", strerror(errno));
+		exit(1);
+	}
+	numworkers = CPU_COUNT(&allowed);
+	workers = calloc(numworkers, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	}
+	for (c = 0, x = 0; c < CPU_SETSIZE && x < numworkers; c++) {
+		if (CPU_ISSET(c, &allowed))
+			workers[x++].cpu = c;
+	}
+	if (basefile)
+		load_baseline(basefile);
+
+	calibrate();
+	pthread_barrier_init(&start_barrier, NULL, numworkers + 1);
+	for (x = 0; x < numworkers; x++) {
+		if (pthread_create(&workers[x].thread, NULL, worker_run, &workers[x])) {
+			fprintf(stderr, "Unable to create worker thread\n");
+			exit(1);
+		}
+	}
+	read_proc_stat(0);
+	read_proc_interrupts(0, verbose ? lines : NULL, &numlines, &columns, &numcolumns);
+	pthread_barrier_wait(&start_barrier);
+	sleep(seconds);
+	stop = 1;
+	for (x = 0; x < numworkers; x++)
+		pthread_join(workers[x].thread, NULL);
+	read_proc_stat(1);
+	read_proc_interrupts(1, verbose ? lines : NULL, NULL, &columns, &numcolumns);
+
+	report(basefile != NULL, lines, numlines, columns, numcolumns,
+	       verbose ? TOP_IRQS : 0);
+	if (outfile)
+		save_results(outfile);
+	exit(0);
 }
@@ -25,21 +25,40 @@
  * this program for more details.
  */
 
+#define _GNU_SOURCE	/* for pthread_setaffinity_np() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/signal.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <sys/epoll.h>
 #include <math.h>
 #include <getopt.h>
 
+#include <dahdi/user.h>
 #include "dahdi_tools_version.h"
+#include "timing_hist.h"
 
 #define SIZE 8000
 
+/*
+ * Histogram mode: the pseudo channel is read one 1 ms block at a time and
+ * the interval between consecutive reads is kept in a log-bucketed
+ * histogram (see timing_hist.h).
+ */
+#define TICK_SAMPLES	8		/* 1 ms at 8000 Hz */
+#define SAMPLE_NS	125000ULL
+#define TICK_NS		(TICK_SAMPLES * SAMPLE_NS)
+
 static int verbose;
 static int pass = 0;
 static float best = 0.0;
@@ -48,6 +67,46 @@ static double total = 0.0;
 static double total_time = 0.0;
 static double total_count = 0.0;
 
+static int histogram;
+static const char *json_file;
+static int blocksize;
+
+struct interval_stats {
+	struct timing_hist hist;	/* Read intervals, in ns */
+	uint64_t samples;
+	uint64_t late;		/* Reads that completed more than half a tick late */
+	uint64_t missed;	/* Whole 1 ms ticks lost in those late reads */
+	struct timespec start;
+	struct timespec last;
+};
+
+static struct interval_stats stats;
+
+/*
+ * Benchmark mode: many channels read at once by several worker threads,
+ * each pinned to its own CPU and waiting on its share of the channels
+ * with epoll.
+ */
+struct bench_chan {
+	int fd;
+	int channo;		/* 0 for a pseudo channel */
+	struct interval_stats stats;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	int cpu;
+	int nchans;
+	struct bench_chan **chans;
+	uint64_t cputime_ns;
+};
+
+static int bench_numchans;
+static struct bench_chan *bench_chans;
+static int bench_numworkers;
+static struct bench_worker *bench_workers;
+static volatile sig_atomic_t bench_stop;
+
 static inline float _fmin(float a, float b)
 {
 	return (a < b) ? a : b;
@@ -58,9 +117,151 @@ static double calculate_accuracy(double count, double ms)
 	return ((count - _fmin(count, fabs(count - ms))) / count) * 100.0;
 }
 
+static void stats_record(struct interval_stats *s, uint64_t interval, int samples)
+{
+	uint64_t expected = samples * SAMPLE_NS;
+
+	hist_add(&s->hist, interval);
+	s->samples += samples;
+	if (interval > expected + TICK_NS / 2) {
+		s->late++;
+		s->missed += (interval - expected + TICK_NS / 2) / TICK_NS;
+	}
+}
+
+static void stats_merge(struct interval_stats *dst, const struct interval_stats *src)
+{
+	if (!src->hist.count)
+		return;
+	if (!dst->hist.count || timespec_before(&src->start, &dst->start))
+		dst->start = src->start;
+	if (!dst->hist.count || timespec_before(&dst->last, &src->last))
+		dst->last = src->last;
+	hist_merge(&dst->hist, &src->hist);
+	dst->samples += src->samples;
+	dst->late += src->late;
+	dst->missed += src->missed;
+}
+
+static void read_clocksource(char *buf, size_t len)
+{
+	FILE *fp;
+
+	snprintf(buf, len, "unknown");
+	fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+	if (!fp)
+		return;
+	if (fgets(buf, len, fp))
+		buf[strcspn(buf, "\n")] = '\0';
+	fclose(fp);
+}
+
+static void write_json_stats(FILE *fp, const char *indent,
+			     const struct interval_stats *s)
+{
+	const struct timing_hist *h = &s->hist;
+
+	fprintf(fp, "%s\"reads\": %llu,\n", indent, (unsigned long long)h->count);
+	fprintf(fp, "%s\"samples\": %llu,\n", indent, (unsigned long long)s->samples);
+	fprintf(fp, "%s\"late_reads\": %llu,\n", indent, (unsigned long long)s->late);
+	fprintf(fp, "%s\"missed_ticks\": %llu,\n", indent, (unsigned long long)s->missed);
+	fprintf(fp, "%s\"interval_ns\": {\n", indent);
+	fprintf(fp, "%s\t\"min\": %llu,\n", indent, (unsigned long long)h->min);
+	fprintf(fp, "%s\t\"mean\": %.1f,\n", indent, hist_mean(h));
+	fprintf(fp, "%s\t\"p50\": %llu,\n", indent, (unsigned long long)hist_percentile(h, 50.0));
+	fprintf(fp, "%s\t\"p99\": %llu,\n", indent, (unsigned long long)hist_percentile(h, 99.0));
+	fprintf(fp, "%s\t\"p99_9\": %llu,\n", indent, (unsigned long long)hist_percentile(h, 99.9));
+	fprintf(fp, "%s\t\"max\": %llu\n", indent, (unsigned long long)h->max);
+	fprintf(fp, "%s}", indent);
+}
+
+static uint64_t bench_cputime(void)
+{
+	uint64_t sum = 0;
+	int x;
+
+	for (x = 0; x < bench_numworkers; x++)
+		sum += bench_workers[x].cputime_ns;
+	return sum;
+}
+
+static void write_json(const char *name)
+{
+	FILE *fp;
+	struct utsname uts;
+	char clocksource[64];
+	uint64_t duration;
+	int x;
+
+	if (!strcmp(name, "-")) {
+		fp = stdout;
+	} else if (!(fp = fopen(name, "w"))) {
+		fprintf(stderr, "Unable to open '%s': %s\n", name, strerror(errno));
+		return;
+	}
+	if (uname(&uts))
+		memset(&uts, 0, sizeof(uts));
+	read_clocksource(clocksource, sizeof(clocksource));
+	duration = timespec_diff_ns(&stats.last, &stats.start);
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"host\": \"%s\",\n", uts.nodename);
+	fprintf(fp, "\t\"kernel\": \"%s\",\n", uts.release);
+	fprintf(fp, "\t\"clocksource\": \"%s\",\n", clocksource);
+	fprintf(fp, "\t\"clock\": \"CLOCK_MONOTONIC_RAW\",\n");
+	fprintf(fp, "\t\"block_samples\": %d,\n", blocksize);
+	fprintf(fp, "\t\"duration_ns\": %llu,\n", (unsigned long long)duration);
+	write_json_stats(fp, "\t", &stats);
+	fprintf(fp, ",\n");
+	if (bench_numchans) {
+		fprintf(fp, "\t\"threads\": %d,\n", bench_numworkers);
+		fprintf(fp, "\t\"cpu_ns\": %llu,\n", (unsigned long long)bench_cputime());
+		fprintf(fp, "\t\"cpu_ns_per_read\": %.1f,\n",
+			stats.hist.count ? (double)bench_cputime() / stats.hist.count : 0.0);
+		fprintf(fp, "\t\"channels\": [");
+		for (x = 0; x < bench_numchans; x++) {
+			fprintf(fp, "%s\n\t\t{\n", x ? "," : "");
+			fprintf(fp, "\t\t\t\"channel\": %d,\n", bench_chans[x].channo);
+			write_json_stats(fp, "\t\t\t", &bench_chans[x].stats);
+			fprintf(fp, "\n\t\t}");
+		}
+		fprintf(fp, "\n\t],\n");
+	}
+	/* Only the populated buckets, as [highest value in ns, count] */
+	fprintf(fp, "\t\"histogram\": ");
+	hist_print_json(fp, &stats.hist, "\t");
+	fprintf(fp, "\n}\n");
+	if (fp != stdout)
+		fclose(fp);
+}
+
+static void print_histogram(void)
+{
+	const struct timing_hist *h = &stats.hist;
+
+	printf("\n--- Read interval after %llu reads (%llu samples) ---\n",
+	       (unsigned long long)h->count, (unsigned long long)stats.samples);
+	printf("Min: %.3f ms -- p50: %.3f ms -- p99: %.3f ms -- p99.9: %.3f ms -- Max: %.3f ms\n",
+	       h->min / 1e6, hist_percentile(h, 50.0) / 1e6,
+	       hist_percentile(h, 99.0) / 1e6,
+	       hist_percentile(h, 99.9) / 1e6, h->max / 1e6);
+	printf("Late reads: %llu -- Missed 1 ms ticks: %llu\n",
+	       (unsigned long long)stats.late, (unsigned long long)stats.missed);
+	if (verbose)
+		hist_print_buckets(stdout, h, 1e6, "ms");
+}
+
 void hup_handler(int sig)
 {
-	double accuracy = calculate_accuracy(total_count, total_time);
+	double accuracy;
+
+	if (histogram) {
+		print_histogram();
+		if (json_file)
+			write_json(json_file);
+		exit(0);
+	}
+	accuracy = calculate_accuracy(total_count, total_time);
 	printf("\n--- Results after %d passes ---\n", pass);
 	printf("Best: %.3f%% -- Worst: %.3f%% -- Average: %f%%\n",
 			best, worst, pass ? total/pass : 100.00);
@@ -69,6 +270,268 @@ void hup_handler(int sig)
 	exit(0);
 }
 
+static void bench_stop_handler(int sig)
+{
+	bench_stop = 1;
+}
+
+/* Parse a channel list such as "1-24,31" into bench_chans[] */
+static int parse_chanlist(const char *list)
+{
+	char *copy, *tok, *saveptr;
+	int start, finish, chan;
+	int res = 0;
+
+	copy = strdup(list);
+	if (!copy)
+		return -1;
+	for (tok = strtok_r(copy, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (sscanf(tok, "%d-%d", &start, &finish) == 2) {
+			/* range */
+		} else if (sscanf(tok, "%d", &start) == 1) {
+			finish = start;
+		} else {
+			fprintf(stderr, "Bad channel list item '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		if (start < 1 || finish < start) {
+			fprintf(stderr, "Bad channel range '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		bench_chans = realloc(bench_chans, (bench_numchans + finish - start + 1) *
+				      sizeof(*bench_chans));
+		if (!bench_chans) {
+			res = -1;
+			break;
+		}
+		for (chan = start; chan <= finish; chan++) {
+			memset(&bench_chans[bench_numchans], 0, sizeof(*bench_chans));
+			bench_chans[bench_numchans++].channo = chan;
+		}
+	}
+	free(copy);
+	return res;
+}
+
+static int bench_open(struct bench_chan *chan)
+{
+	int flush = DAHDI_FLUSH_READ;
+	int bs = blocksize;
+
+	if (chan->channo) {
+		chan->fd = open("/dev/dahdi/channel", O_RDWR | O_NONBLOCK);
+		if (chan->fd >= 0 && ioctl(chan->fd, DAHDI_SPECIFY, &chan->channo)) {
+			fprintf(stderr, "Unable to specify channel %d: %s\n",
+				chan->channo, strerror(errno));
+			close(chan->fd);
+			return -1;
+		}
+	} else {
+		chan->fd = open("/dev/dahdi/pseudo", O_RDWR | O_NONBLOCK);
+	}
+	if (chan->fd < 0) {
+		fprintf(stderr, "Unable to open dahdi interface: %s\n", strerror(errno));
+		return -1;
+	}
+	if (ioctl(chan->fd, DAHDI_SET_BLOCKSIZE, &bs)) {
+		fprintf(stderr, "Unable to set block size to %d: %s\n",
+			bs, strerror(errno));
+		close(chan->fd);
+		return -1;
+	}
+	ioctl(chan->fd, DAHDI_FLUSH, &flush);
+	return 0;
+}
+
+static void *bench_worker_run(void *data)
+{
+	struct bench_worker *w = data;
+	struct epoll_event ev;
+	struct epoll_event *events;
+	struct timespec now, cpustart, cpuend;
+	cpu_set_t cpus;
+	char buf[8192];
+	int epfd;
+	int x, n, res;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		fprintf(stderr, "Unable to pin worker to CPU %d\n", w->cpu);
+
+	epfd = epoll_create1(0);
+	events = calloc(w->nchans, sizeof(*events));
+	if (epfd < 0 || !events) {
+		fprintf(stderr, "Unable to set up epoll: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (x = 0; x < w->nchans; x++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = w->chans[x];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->chans[x]->fd, &ev)) {
+			fprintf(stderr, "Unable to poll channel: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpustart);
+	while (!bench_stop) {
+		n = epoll_wait(epfd, events, w->nchans, 100);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		for (x = 0; x < n; x++) {
+			struct bench_chan *chan = events[x].data.ptr;
+
+			res = read(chan->fd, buf, sizeof(buf));
+			clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+			if (res < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				fprintf(stderr, "Failed to read from channel %d: %s\n",
+					chan->channo, strerror(errno));
+				exit(1);
+			}
+			/* The first read only establishes the reference point */
+			if (chan->stats.last.tv_sec || chan->stats.last.tv_nsec)
+				stats_record(&chan->stats, timespec_diff_ns(&now, &chan->stats.last), res);
+			else
+				chan->stats.start = now;
+			chan->stats.last = now;
+		}
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuend);
+	w->cputime_ns = timespec_diff_ns(&cpuend, &cpustart);
+
+	close(epfd);
+	free(events);
+	return NULL;
+}
+
+static void bench_report(void)
+{
+	uint64_t cpu = bench_cputime();
+	double seconds;
+	int x;
+
+	for (x = 0; x < bench_numchans; x++)
+		stats_merge(&stats, &bench_chans[x].stats);
+	seconds = timespec_diff_ns(&stats.last, &stats.start) / 1e9;
+
+	if (verbose) {
+		printf("\n%-8s %10s %9s %9s %9s %9s %7s %7s\n", "Channel", "Reads",
+		       "p50 ms", "p99 ms", "p99.9 ms", "Max ms", "Late", "Missed");
+		for (x = 0; x < bench_numchans; x++) {
+			const struct interval_stats *s = &bench_chans[x].stats;
+			const struct timing_hist *h = &s->hist;
+			char name[20];
+
+			if (bench_chans[x].channo)
+				snprintf(name, sizeof(name), "%d", bench_chans[x].channo);
+			else
+				snprintf(name, sizeof(name), "pseudo%d", x + 1);
+			printf("%-8s %10llu %9.3f %9.3f %9.3f %9.3f %7llu %7llu\n",
+			       name, (unsigned long long)h->count,
+			       hist_percentile(h, 50.0) / 1e6,
+			       hist_percentile(h, 99.0) / 1e6,
+			       hist_percentile(h, 99.9) / 1e6, h->max / 1e6,
+			       (unsigned long long)s->late,
+			       (unsigned long long)s->missed);
+		}
+	}
+	print_histogram();
+	printf("Channels: %d -- Threads: %d -- CPU: %.3f s in %.3f s\n",
+	       bench_numchans, bench_numworkers, cpu / 1e9, seconds);
+	if (stats.hist.count && seconds > 0) {
+		printf("CPU per channel: %.3f%% -- CPU per read: %.1f us\n",
+		       100.0 * cpu / 1e9 / seconds / bench_numchans,
+		       cpu / 1e3 / stats.hist.count);
+	}
+	for (x = 0; x < bench_numworkers; x++) {
+		printf("  Thread %d (CPU %d): %d channels, %.3f s CPU\n", x,
+		       bench_workers[x].cpu, bench_workers[x].nchans,
+		       bench_workers[x].cputime_ns / 1e9);
+	}
+	if (json_file)
+		write_json(json_file);
+}
+
+static int bench_run(int seconds)
+{
+	struct sigaction act;
+	sigset_t block, old;
+	long ncpus;
+	int x;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if (bench_numworkers < 1)
+		bench_numworkers = 1;
+	if (bench_numworkers > bench_numchans)
+		bench_numworkers = bench_numchans;
+	blocksize = TICK_SAMPLES;
+
+	for (x = 0; x < bench_numchans; x++) {
+		if (bench_open(&bench_chans[x]))
+			return -1;
+	}
+
+	bench_workers = calloc(bench_numworkers, sizeof(*bench_workers));
+	if (!bench_workers)
+		return -1;
+	/* Deal the channels out to the workers round-robin */
+	for (x = 0; x < bench_numworkers; x++) {
+		bench_workers[x].cpu = x % ncpus;
+		bench_workers[x].chans = calloc(bench_numchans / bench_numworkers + 1,
+						sizeof(struct bench_chan *));
+		if (!bench_workers[x].chans)
+			return -1;
+	}
+	for (x = 0; x < bench_numchans; x++) {
+		struct bench_worker *w = &bench_workers[x % bench_numworkers];
+
+		w->chans[w->nchans++] = &bench_chans[x];
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = bench_stop_handler;
+	sigaction(SIGHUP, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGALRM, &act, NULL);
+
+	/* Only the main thread takes the signals */
+	sigemptyset(&block);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	for (x = 0; x < bench_numworkers; x++) {
+		if (pthread_create(&bench_workers[x].thread, NULL,
+				   bench_worker_run, &bench_workers[x])) {
+			fprintf(stderr, "Unable to create worker thread\n");
+			return -1;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	printf("Reading %d channels from %d threads, measuring read intervals...\n",
+	       bench_numchans, bench_numworkers);
+	if (seconds > 0)
+		alarm(seconds);
+	while (!bench_stop)
+		pause();
+	for (x = 0; x < bench_numworkers; x++)
+		pthread_join(bench_workers[x].thread, NULL);
+
+	bench_report();
+	return 0;
+}
+
 static void usage(char *argv0)
 {
 	char *c;
@@ -78,10 +541,16 @@ static void usage(char *argv0)
 	else
 		c++;
 	fprintf(stderr, 
-		"Usage: %s [-c COUNT] [-v]\n"
+		"Usage: %s [-c COUNT] [-v] [-H] [-j FILE] [-n NUM | -C CHANS] [-T THREADS]\n"
 		"    Valid options are:\n"
 		"  -c COUNT    Run just COUNT cycles (otherwise: forever).\n"
 		"  -v          More verbose output.\n"
+		"  -H          Histogram mode: record the interval between 1 ms reads.\n"
+		"  -j FILE     Histogram mode, and write the results as JSON to FILE\n"
+		"              ('-' for stdout) on exit.\n"
+		"  -n NUM      Benchmark mode: read NUM pseudo channels at once.\n"
+		"  -C CHANS    Benchmark mode: read the listed channels (e.g. 1-24,31).\n"
+		"  -T THREADS  Number of worker threads in benchmark mode (default: 1).\n"
 		"  -h          This help text.\n"
 	, c);
 }
@@ -94,6 +563,7 @@ int main(int argc, char *argv[])
 	int count = 0;
 	int seconds = 0;
 	int curarg = 1;
+	int numpseudo = 0;
 	char buf[8192];
 	float ms;
 	struct timeval start, now;
@@ -103,7 +573,7 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
-	while ((c = getopt(argc, argv, "c:hv")) != -1) {
+	while ((c = getopt(argc, argv, "c:hvHj:n:C:T:")) != -1) {
 		switch(c) {
 		case 'c':
 			seconds = atoi(optarg);
@@ -119,6 +589,25 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose++;
 			break;
+		case 'H':
+			histogram = 1;
+			break;
+		case 'j':
+			histogram = 1;
+			json_file = optarg;
+			break;
+		case 'n':
+			numpseudo = atoi(optarg);
+			break;
+		case 'C':
+			if (parse_chanlist(optarg)) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'T':
+			bench_numworkers = atoi(optarg);
+			break;
 		}
 	}
 	while (curarg < argc) {
@@ -128,7 +617,34 @@ int main(int argc, char *argv[])
 			seconds = atoi(argv[curarg + 1]);
 		curarg++;
 	}
-	printf("Opened pseudo dahdi interface, measuring accuracy...\n");
+	if (numpseudo > 0 && bench_numchans) {
+		fprintf(stderr, "-n and -C can't be used together\n");
+		usage(argv[0]);
+		exit(1);
+	}
+	if (numpseudo > 0) {
+		bench_chans = calloc(numpseudo, sizeof(*bench_chans));
+		if (!bench_chans) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		bench_numchans = numpseudo;
+	}
+	if (bench_numchans) {
+		close(fd);
+		exit(bench_run(seconds) ? 1 : 0);
+	}
+	if (histogram) {
+		blocksize = TICK_SAMPLES;
+		if (ioctl(fd, DAHDI_SET_BLOCKSIZE, &blocksize)) {
+			fprintf(stderr, "Unable to set block size to %d: %s\n",
+				blocksize, strerror(errno));
+			exit(1);
+		}
+		printf("Opened pseudo dahdi interface, measuring read intervals...\n");
+	} else {
+		printf("Opened pseudo dahdi interface, measuring accuracy...\n");
+	}
 	signal(SIGHUP, hup_handler);
 	signal(SIGINT, hup_handler);
 	signal(SIGALRM, hup_handler);
@@ -139,6 +655,22 @@ int main(int argc, char *argv[])
 	ms = 0; /* Makes the compiler happy */
 	if (seconds > 0)
 		alarm(seconds + 1); /* This will give 'seconds' cycles */
+	if (histogram) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &stats.start);
+		stats.last = stats.start;
+		for (;;) {
+			res = read(fd, buf, sizeof(buf));
+			clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+			if (res < 0) {
+				fprintf(stderr, "Failed to read from pseudo interface: %s\n", strerror(errno));
+				exit(1);
+			}
+			stats_record(&stats, timespec_diff_ns(&now, &stats.last), res);
+			stats.last = now;
+		}
+	}
 	for (;;) {
 		if (count == 0)
 			ms = 0;
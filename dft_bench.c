@@ -0,0 +1,221 @@
+/*
+ * dft_bench -- check and time the fxotune tone DFT
+ *
+ * A calibration sweep is simulated: the fxotune multi-tone is played into
+ * 72 echo paths of different gain and delay, with some noise, and the
+ * magnitude of every response is computed as calc_magnitude() does. Each
+ * tone_dft implementation must give the same magnitudes, bit for bit, as
+ * the old one frequency at a time DFT (and so pick the same setting);
+ * then the time per sweep is compared.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "tone_dft.h"
+
+#define SAMPLES		4000	/* as fxotune's calibration captures */
+#define SWEEP		72	/* echo settings tried per channel */
+
+/* The same tones as fxotune */
+static const int freqs[] = {697, 770, 941, 1209, 1336, 1633};
+#define FREQCOUNT	(sizeof(freqs) / sizeof(freqs[0]))
+
+static short responses[SWEEP][SAMPLES];
+static float want[SWEEP];
+static struct tone_dft dft;
+
+static volatile float sink;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: dft_bench [-n SWEEPS]\n");
+	fprintf(stderr, "        -n SWEEPS: sweeps timed per implementation (default: 10)\n");
+	exit(1);
+}
+
+/* The multi-tone, delayed by delay samples and scaled by gain, plus noise */
+static void fill_response(short *buf, double gain, int delay)
+{
+	double v;
+	int i, k;
+
+	for (i = 0; i < SAMPLES; i++) {
+		v = 0;
+		for (k = 0; k < FREQCOUNT; k++)
+			v += sin(((i - delay) * 2.0 * M_PI * freqs[k]) / 8000);
+		v = 16384.0 * gain * v / FREQCOUNT + (rand() % 201 - 100);
+		buf[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+	}
+}
+
+static float magnitude(float re, float im, int len)
+{
+	float real = re / (float) len;
+	float imaginary = -im / (float) len;
+
+	return sqrtf((real * real) + (imaginary * imaginary));
+}
+
+/* calc_magnitude() as it was */
+static float magnitude_direct(const short *buf, int len)
+{
+	float re, im;
+	float total = 0;
+	int k;
+
+	for (k = 0; k < FREQCOUNT; k++) {
+		tone_dft_direct(buf, len, freqs[k], &re, &im);
+		total += magnitude(re, im, len);
+	}
+	return total;
+}
+
+static float magnitude_batched(const short *buf, int len)
+{
+	float sums[TONE_DFT_MAX_FREQS * 2];
+	float total = 0;
+	int k;
+
+	tone_dft_run(&dft, buf, len, sums);
+	for (k = 0; k < FREQCOUNT; k++)
+		total += magnitude(sums[k * 2], sums[k * 2 + 1], len);
+	return total;
+}
+
+static int lowest(const float *mag)
+{
+	int best = 0;
+	int x;
+
+	for (x = 1; x < SWEEP; x++) {
+		if (mag[x] < mag[best])
+			best = x;
+	}
+	return best;
+}
+
+static int check(enum tone_dft_impl impl)
+{
+	float got[SWEEP];
+	float a, b;
+	int errors = 0;
+	int x, len;
+
+	for (x = 0; x < SWEEP; x++) {
+		got[x] = magnitude_batched(responses[x], SAMPLES);
+		if (memcmp(&got[x], &want[x], sizeof(float))) {
+			if (!errors++)
+				fprintf(stderr, "%s: response %d gives %.9g, expected %.9g\n",
+					tone_dft_impl_name(impl), x, got[x], want[x]);
+		}
+	}
+	if (lowest(got) != lowest(want)) {
+		fprintf(stderr, "%s: picks setting %d, expected %d\n",
+			tone_dft_impl_name(impl), lowest(got), lowest(want));
+		errors++;
+	}
+	/* Shorter buffers, as for the reference tone, and odd lengths */
+	for (len = 0; len <= 64; len++) {
+		a = magnitude_batched(responses[len], len);
+		b = magnitude_direct(responses[len], len);
+		if (memcmp(&a, &b, sizeof(float))) {
+			if (!errors++)
+				fprintf(stderr, "%s: mismatch at %d samples\n",
+					tone_dft_impl_name(impl), len);
+		}
+	}
+	return errors;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Milliseconds per sweep */
+static double time_sweep(float (*fn)(const short *, int), long sweeps)
+{
+	double start;
+	long n;
+	int x;
+
+	start = now();
+	for (n = 0; n < sweeps; n++) {
+		for (x = 0; x < SWEEP; x++)
+			sink += fn(responses[x], SAMPLES);
+	}
+	return (now() - start) * 1e3 / sweeps;
+}
+
+int main(int argc, char *argv[])
+{
+	double direct_ms, ms;
+	long sweeps = 10;
+	int impl;
+	int opt;
+	int x;
+	int failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			sweeps = atol(optarg);
+			if (sweeps < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (tone_dft_init(&dft, freqs, FREQCOUNT, SAMPLES)) {
+		fprintf(stderr, "Unable to allocate DFT tables\n");
+		exit(1);
+	}
+	srand(time(NULL));
+	for (x = 0; x < SWEEP; x++)
+		fill_response(responses[x], 0.02 + (rand() % 1000) / 2000.0, rand() % 40);
+	for (x = 0; x < SWEEP; x++)
+		want[x] = magnitude_direct(responses[x], SAMPLES);
+
+	printf("%-8s %8s %10s %8s\n", "dft", "exact", "ms/sweep", "speedup");
+	direct_ms = time_sweep(magnitude_direct, sweeps);
+	printf("%-8s %8s %10.2f %7.2fx\n", "direct", "-", direct_ms, 1.0);
+	for (impl = 0; impl < TONE_DFT_IMPL_COUNT; impl++) {
+		if (tone_dft_select(impl)) {
+			printf("%-8s (not supported by this CPU)\n", tone_dft_impl_name(impl));
+			continue;
+		}
+		if (check(impl)) {
+			printf("%-8s %8s\n", tone_dft_impl_name(impl), "FAILED");
+			failed = 1;
+			continue;
+		}
+		ms = time_sweep(magnitude_batched, sweeps);
+		printf("%-8s %8s %10.2f %7.2fx\n", tone_dft_impl_name(impl), "yes", ms,
+		       direct_ms / ms);
+	}
+	tone_dft_free(&dft);
+	return failed;
+}
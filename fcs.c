@@ -0,0 +1,102 @@
+/*
+ * fcs.c -- HDLC frame check sequences for the test tools
+ *
+ * Both CRCs are reflected, so table k gives the effect of a byte that
+ * still has k bytes to go through the register: t[k][i] is t[k-1][i]
+ * run through one more zero byte. With them, a group of eight bytes
+ * is eight independent lookups xored together.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include "fcs.h"
+
+#define FCS16_POLY	0x8408		/* x^16 + x^12 + x^5 + 1, reflected */
+#define FCS32_POLY	0xedb88320	/* CRC-32, reflected */
+
+static uint16_t fcs16_tab[8][256];
+static uint32_t fcs32_tab[8][256];
+
+void fcs_init(void)
+{
+	uint32_t c16, c32;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c16 = i;
+		c32 = i;
+		for (k = 0; k < 8; k++) {
+			c16 = (c16 & 1) ? (c16 >> 1) ^ FCS16_POLY : c16 >> 1;
+			c32 = (c32 & 1) ? (c32 >> 1) ^ FCS32_POLY : c32 >> 1;
+		}
+		fcs16_tab[0][i] = c16;
+		fcs32_tab[0][i] = c32;
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			c16 = fcs16_tab[k - 1][i];
+			fcs16_tab[k][i] = (c16 >> 8) ^ fcs16_tab[0][c16 & 0xff];
+			c32 = fcs32_tab[k - 1][i];
+			fcs32_tab[k][i] = (c32 >> 8) ^ fcs32_tab[0][c32 & 0xff];
+		}
+	}
+}
+
+uint16_t fcs16_bytewise(uint16_t fcs, const unsigned char *buf, int len)
+{
+	int x;
+
+	for (x = 0; x < len; x++)
+		fcs = (fcs >> 8) ^ fcs16_tab[0][(fcs ^ buf[x]) & 0xff];
+	return fcs;
+}
+
+uint32_t fcs32_bytewise(uint32_t fcs, const unsigned char *buf, int len)
+{
+	int x;
+
+	for (x = 0; x < len; x++)
+		fcs = (fcs >> 8) ^ fcs32_tab[0][(fcs ^ buf[x]) & 0xff];
+	return fcs;
+}
+
+uint16_t fcs16(uint16_t fcs, const unsigned char *buf, int len)
+{
+	uint32_t v;
+
+	for (; len >= 8; buf += 8, len -= 8) {
+		/* The register only overlaps the first two bytes */
+		v = fcs ^ (buf[0] | (buf[1] << 8));
+		fcs = fcs16_tab[7][v & 0xff] ^ fcs16_tab[6][v >> 8] ^
+			fcs16_tab[5][buf[2]] ^ fcs16_tab[4][buf[3]] ^
+			fcs16_tab[3][buf[4]] ^ fcs16_tab[2][buf[5]] ^
+			fcs16_tab[1][buf[6]] ^ fcs16_tab[0][buf[7]];
+	}
+	return fcs16_bytewise(fcs, buf, len);
+}
+
+uint32_t fcs32(uint32_t fcs, const unsigned char *buf, int len)
+{
+	uint32_t v;
+
+	for (; len >= 8; buf += 8, len -= 8) {
+		v = fcs ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+			   ((uint32_t)buf[3] << 24));
+		fcs = fcs32_tab[7][v & 0xff] ^ fcs32_tab[6][(v >> 8) & 0xff] ^
+			fcs32_tab[5][(v >> 16) & 0xff] ^ fcs32_tab[4][v >> 24] ^
+			fcs32_tab[3][buf[4]] ^ fcs32_tab[2][buf[5]] ^
+			fcs32_tab[1][buf[6]] ^ fcs32_tab[0][buf[7]];
+	}
+	return fcs32_bytewise(fcs, buf, len);
+}
@@ -0,0 +1,46 @@
+/*
+ * fcs.h -- HDLC frame check sequences for the test tools
+ *
+ * The 16 bit FCS of RFC 1662 (CRC-CCITT, as DAHDI computes for fcshdlc
+ * channels) and the 32 bit one (the CRC-32 of Ethernet), both sent least
+ * significant byte first. Call fcs_init() once before anything else.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef FCS_H
+#define FCS_H
+
+#include <stdint.h>
+
+#define FCS16_INIT	0xffff		/* Initial FCS value */
+#define FCS16_GOOD	0xf0b8		/* Good final FCS value */
+#define FCS32_INIT	0xffffffff
+#define FCS32_GOOD	0xdebb20e3
+
+void fcs_init(void);
+
+/*
+ * Add len bytes to a running FCS. Eight bytes are done at a time with
+ * eight tables (slicing-by-8); the result is the same as byte by byte.
+ * To send it, complement it: fcs ^= 0xffff (or 0xffffffff).
+ */
+uint16_t fcs16(uint16_t fcs, const unsigned char *buf, int len);
+uint32_t fcs32(uint32_t fcs, const unsigned char *buf, int len);
+
+/* One byte at a time, with a single table */
+uint16_t fcs16_bytewise(uint16_t fcs, const unsigned char *buf, int len);
+uint32_t fcs32_bytewise(uint32_t fcs, const unsigned char *buf, int len);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * fcs_bench -- check and time the HDLC FCS routines
+ *
+ * The slicing-by-8 FCS-16 and FCS-32 are checked against the standard
+ * check values and against the byte at a time versions (which the HDLC
+ * tools used before) for all lengths and alignments up to a few hundred
+ * bytes, then both are timed on frames of a given size.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fcs.h"
+
+#define CHECK_MAX	300	/* longest buffer compared */
+#define FRAME_MAX	65536
+
+static unsigned char frame[FRAME_MAX + 8];
+
+static volatile uint32_t sink;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fcs_bench [-s BYTES] [-n MBYTES]\n");
+	fprintf(stderr, "        -s BYTES: frame size (default: 260)\n");
+	fprintf(stderr, "        -n MBYTES: megabytes run through each routine (default: 256)\n");
+	exit(1);
+}
+
+static int check(void)
+{
+	static const unsigned char vector[] = "123456789";
+	uint16_t f16;
+	uint32_t f32;
+	int off, len;
+	int errors = 0;
+
+	/* The check values of CRC-16/X-25 and CRC-32 */
+	f16 = fcs16(FCS16_INIT, vector, 9) ^ 0xffff;
+	f32 = fcs32(FCS32_INIT, vector, 9) ^ 0xffffffff;
+	if (f16 != 0x906e || f32 != 0xcbf43926) {
+		fprintf(stderr, "Check values wrong: %04x %08x\n", f16, f32);
+		errors++;
+	}
+
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len <= CHECK_MAX; len++) {
+			if (fcs16(FCS16_INIT, frame + off, len) !=
+			    fcs16_bytewise(FCS16_INIT, frame + off, len)) {
+				if (!errors++)
+					fprintf(stderr, "fcs16 mismatch at %d bytes (offset %d)\n",
+						len, off);
+			}
+			if (fcs32(FCS32_INIT, frame + off, len) !=
+			    fcs32_bytewise(FCS32_INIT, frame + off, len)) {
+				if (!errors++)
+					fprintf(stderr, "fcs32 mismatch at %d bytes (offset %d)\n",
+						len, off);
+			}
+		}
+	}
+
+	/* A frame with its FCS appended gives the good FCS value */
+	f16 = fcs16(FCS16_INIT, frame, CHECK_MAX) ^ 0xffff;
+	frame[CHECK_MAX] = f16 & 0xff;
+	frame[CHECK_MAX + 1] = f16 >> 8;
+	if (fcs16(FCS16_INIT, frame, CHECK_MAX + 2) != FCS16_GOOD) {
+		fprintf(stderr, "fcs16 of a frame with its FCS is not good\n");
+		errors++;
+	}
+	f32 = fcs32(FCS32_INIT, frame, CHECK_MAX) ^ 0xffffffff;
+	frame[CHECK_MAX] = f32 & 0xff;
+	frame[CHECK_MAX + 1] = f32 >> 8;
+	frame[CHECK_MAX + 2] = f32 >> 16;
+	frame[CHECK_MAX + 3] = f32 >> 24;
+	if (fcs32(FCS32_INIT, frame, CHECK_MAX + 4) != FCS32_GOOD) {
+		fprintf(stderr, "fcs32 of a frame with its FCS is not good\n");
+		errors++;
+	}
+	return errors;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Megabytes per second */
+static double time_fcs16(uint16_t (*fn)(uint16_t, const unsigned char *, int),
+			 int size, long frames)
+{
+	double start;
+	long x;
+
+	start = now();
+	for (x = 0; x < frames; x++)
+		sink += fn(FCS16_INIT, frame, size);
+	return size * frames / (now() - start) / 1e6;
+}
+
+static double time_fcs32(uint32_t (*fn)(uint32_t, const unsigned char *, int),
+			 int size, long frames)
+{
+	double start;
+	long x;
+
+	start = now();
+	for (x = 0; x < frames; x++)
+		sink += fn(FCS32_INIT, frame, size);
+	return size * frames / (now() - start) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	double bytewise, sliced;
+	int size = 260;
+	long mbytes = 256;
+	long frames;
+	int opt;
+	int x;
+
+	while ((opt = getopt(argc, argv, "s:n:h")) != -1) {
+		switch (opt) {
+		case 's':
+			size = atoi(optarg);
+			if (size < 1 || size > FRAME_MAX) {
+				fprintf(stderr, "Frame size must be 1-%d\n", FRAME_MAX);
+				exit(1);
+			}
+			break;
+		case 'n':
+			mbytes = atol(optarg);
+			if (mbytes < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	fcs_init();
+	srand(time(NULL));
+	for (x = 0; x < sizeof(frame); x++)
+		frame[x] = rand();
+	if (check()) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	frames = mbytes * 1000000 / size;
+	if (frames < 1)
+		frames = 1;
+	printf("%-6s %8s %14s %14s %8s\n", "fcs", "bytes", "bytewise MB/s",
+	       "slice-8 MB/s", "speedup");
+	bytewise = time_fcs16(fcs16_bytewise, size, frames);
+	sliced = time_fcs16(fcs16, size, frames);
+	printf("%-6s %8d %14.1f %14.1f %7.2fx\n", "fcs16", size, bytewise, sliced,
+	       sliced / bytewise);
+	bytewise = time_fcs32(fcs32_bytewise, size, frames);
+	sliced = time_fcs32(fcs32, size, frames);
+	printf("%-6s %8d %14.1f %14.1f %7.2fx\n", "fcs32", size, bytewise, sliced,
+	       sliced / bytewise);
+	return 0;
+}
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -31,18 +32,28 @@
 #include <fcntl.h>
 #include <math.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include <dahdi/user.h>
 #include <dahdi/wctdm_user.h>
 
 #include "dahdi_tools_version.h"
 #include "fxotune.h"
+#include "tone_dft.h"
 
 #define TEST_DURATION 2000
 #define BUFFER_LENGTH (2 * TEST_DURATION)
 #define SKIP_SAMPLES 800
+#define COARSE_DURATION (TEST_DURATION / 4)	/* samples played for the short tests of -t 3 */
 #define SINE_SAMPLES 8000
 
+/* For -a: levels are the RMS of 16 bit linear samples, as from power_of() */
+#define QUIET_LEVEL 100		/* below this the line is clear */
+#define TONE_LEVEL 1000		/* above this there is a dial tone */
+#define QUIET_MS 500		/* how long the line must stay under QUIET_LEVEL */
+#define QUIET_TIMEOUT 10	/* seconds, past the dial delay, to wait for it */
+#define MAX_REDO 3		/* times a test is redone because the line got noisy */
+
 static float sintable[SINE_SAMPLES];
 
 static const float amplitude = 16384.0;
@@ -61,10 +72,10 @@ struct result_catalog {
 	struct wctdm_echo_coefs settings;
 };
 
-struct {
+struct top_results {
 	struct result_catalog results[MAX_RESULTS];
 	int numactive;
-}	topresults;
+};
 
 static char *usage =
 "Usage: fxotune [-v[vv] (-s | -i <options> | -d <options>)\n"
@@ -72,7 +83,7 @@ static char *usage =
 "	-s : set previously calibrated echo settings\n"
 "	-i : calibrate echo settings\n"
 "		options : [<dialstring>] [-t <calibtype>]\n"
-"		[-b <startdev>][-e <stopdev>]\n"
+"		[-b <startdev>][-e <stopdev>][-j <jobs>]\n"
 "		[-n <dialstring>][-l <delaytosilence>][-m <silencegoodfor>]\n"
 " 	-d : dump input and output waveforms to ./fxotune_dump.vals\n"
 "		options : [-b <device>][-w <waveform>]\n"
@@ -80,15 +91,20 @@ static char *usage =
 "	-v : more output (-vv, -vvv also)\n"
 "	-p : print the 5 best candidates for acim and coefficients settings\n"
 "	-x : Perform sin/cos functions using table lookup\n"
+"	-a : Listen to the line to know when it is clear, rather than\n"
+"	     waiting fixed times (-l) and resetting it every so often (-m)\n"
 "	-o <path> : Write the received raw 16-bit signed linear audio that is\n"
 "	            used in processing to the file specified by <path>\n"
 "	-c <config_file>\n"
 "\n"
 "		<calibtype>      - type of calibration\n"
-"		                   (default 2, old method 1)\n"
+"		                   (default 2, old method 1,\n"
+"		                   3 for a faster coarse to fine search)\n"
 "		<startdev>\n"
 "		<stopdev>        - defines a range of devices to test\n"
 "		                   (default: 1-252)\n"
+"		<jobs>           - number of devices to tune at the same time\n"
+"		                   (default 1)\n"
 "		<dialstring>     - string to dial to clear the line\n"
 "		                   (default 5)\n"
 "		<delaytosilence> - seconds to wait for line to clear (default 0)\n"
@@ -109,21 +125,31 @@ struct silence_info{
 	char *dialstr;
 	/** fd of device we are working with */
 	int device; 
+	/** its channel number, for debug lines */
+	int channo;
 	/** seconds we should wait after dialing the dialstring before we know for sure we'll have silence */
 	int initial_delay;
 	/** seconds after which a reset should occur */
 	int reset_after;
 	/** time of last reset */
 	struct timeval last_reset; 
+	/** with -a: 1 if the last test heard a clear line, -1 if not, 0 if it couldn't tell */
+	int line_state;
 };
 
-static short outbuf[TEST_DURATION];
 static int debug = 0;
 
 static FILE *debugoutfile = NULL;
 
+/** set with -j, when the debug lines of several modules are mixed */
+static int tag_lines = 0;
+
 static int use_table = 0;
 
+static int adaptive_silence = 0;
+
+static struct tone_dft dft;
+
 static int fxotune_read(int fd, void *buffer, int len)
 {
 	int res;
@@ -137,14 +163,126 @@ static int fxotune_read(int fd, void *buffer, int len)
 	return res;
 }
 
+static float power_of(void *prebuf, int bufsize, int short_format);
+
+static void tune_debug(FILE *f, int channo, char *fmt, ...) __attribute__ ((format(printf, 3, 4)));
+
+/**
+ * Prints a debug line about channel channo to stdout or to fxotune.vals.  With -j it
+ * says which channel it is about: "Module <channo>: " on stdout, "<channo>," in the file.
+ */
+static void tune_debug(FILE *f, int channo, char *fmt, ...)
+{
+	va_list ap;
+
+	flockfile(f);
+	if (tag_lines)
+		fprintf(f, f == debugoutfile ? "%d," : "Module %d: ", channo);
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	funlockfile(f);
+}
+
+static long elapsed_ms(const struct timeval *since)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec - since->tv_sec) * 1000L + (tv.tv_usec - since->tv_usec) / 1000L;
+}
+
+/**
+ * Reads one block of audio from the line (not written to the -o file)
+ *
+ * @return its level, as power_of(), or -1 on error
+ */
+static float line_level(int fd)
+{
+	short buf[TEST_DURATION];
+	int res, x;
+	int tries;
+
+	for (tries = 0; tries < 10; tries++) {
+		res = read(fd, buf, sizeof(buf));
+		if (res > 1)
+			return power_of(buf, res / 2, 1);
+		if (res < 0 && errno != ELAST)
+			break;
+		ioctl(fd, DAHDI_GETEVENT, &x);
+	}
+	fprintf(stderr, "Unable to read from fd %d: %s\n", fd, strerror(errno));
+	return -1;
+}
+
+/**
+ * Listens to the line until its level has stayed at or above threshold (tone != 0),
+ * or below it (tone == 0), for holdms milliseconds.
+ *
+ * @return 0 once it has, 1 if that did not happen within timeout seconds, -1 on error
+ */
+static int wait_for_level(struct silence_info *info, float threshold, int tone, long holdms, int timeout)
+{
+	struct timeval start, now, since;
+	int fd = info->device;
+	float level;
+	int holding = 0;
+	int x = DAHDI_FLUSH_READ;
+
+	/* Don't judge the line by what was buffered before */
+	if (ioctl(fd, DAHDI_FLUSH, &x)) {
+		fprintf(stderr, "Unable to flush I/O: %s\n", strerror(errno));
+		return -1;
+	}
+	gettimeofday(&start, NULL);
+	since = start;
+	while (elapsed_ms(&start) < timeout * 1000L) {
+		gettimeofday(&now, NULL);
+		level = line_level(fd);
+		if (level < 0)
+			return -1;
+		if (debug > 4)
+			tune_debug(stdout, info->channo, "Line level %0.0f\n", level);
+		if (tone ? level >= threshold : level < threshold) {
+			if (!holding)
+				since = now;
+			holding = 1;
+			if (elapsed_ms(&since) >= holdms)
+				return 0;
+		} else {
+			holding = 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Notes whether the line was clear in the part of a capture after the echo of the
+ * test signal, so that ensure_silence() knows whether it must reset the line before
+ * the next test.
+ *
+ * @return 1 if it was clear, 0 if not
+ */
+static int note_line_state(struct silence_info *info, const short *buf, int len)
+{
+	float level = power_of((void *)buf, len, 1);
+
+	info->line_state = level < QUIET_LEVEL ? 1 : -1;
+	if (debug > 4)
+		tune_debug(stdout, info->channo, "Line level after the test %0.0f\n", level);
+	return info->line_state > 0;
+}
+
 /**
  * Makes sure that the line is clear.
  * Right now, we do this by relying on the user to specify how long after dialing the
  * dialstring we can rely on the line being silent (before the telco complains about
  * the user not hitting the next digit).
  * 
- * A more robust way to do this would be to actually measure the sound levels on the line,
- * but that's a lot more complicated, and this should work.
+ * With -a the line is measured instead: we dial as soon as there is dial tone, start as
+ * soon as the line has gone quiet after that, and reset it only when a test has heard
+ * that it is no longer quiet (or after reset_after seconds, for tests that can't tell).
+ * The time spent on hook still has to be fixed, as the exchange gives nothing to hear.
  * 
  * @return 0 if succesful (no errors), 1 if unsuccesful
  */
@@ -153,6 +291,8 @@ static int ensure_silence(struct silence_info *info)
 	struct timeval tv;
 	long int elapsedms;
 	int x = DAHDI_ONHOOK;
+	int quiet;
+	int res;
 	struct dahdi_dialoperation dop;
 
 	gettimeofday(&tv, NULL);
@@ -165,14 +305,22 @@ static int ensure_silence(struct silence_info *info)
 		elapsedms = ((tv.tv_sec - info->last_reset.tv_sec) * 1000L + (tv.tv_usec - info->last_reset.tv_usec) / 1000L);
 	}
 	if (debug > 4) {
-		fprintf(stdout, "Reset line request received - elapsed ms = %li / reset after = %ld\n", elapsedms, info->reset_after * 1000L);
+		tune_debug(stdout, info->channo, "Reset line request received - elapsed ms = %li / reset after = %ld\n", elapsedms, info->reset_after * 1000L);
 	}
 
-	if (elapsedms > 0 && elapsedms < info->reset_after * 1000L)
+	if (adaptive_silence && info->line_state) {
+		/* The last test heard whether the line is still clear */
+		quiet = info->line_state > 0;
+		info->line_state = 0;
+		if (quiet)
+			return 0;
+		if (debug > 1)
+			tune_debug(stdout, info->channo, "Line is no longer quiet\n");
+	} else if (elapsedms > 0 && elapsedms < info->reset_after * 1000L)
 		return 0;
 	
 	if (debug > 1){
-		fprintf(stdout, "Resetting line\n");
+		tune_debug(stdout, info->channo, "Resetting line\n");
 	}
 	
 	/* do a line reset */
@@ -190,7 +338,15 @@ static int ensure_silence(struct silence_info *info)
 		fprintf(stderr, "Cannot bring fd %d off hook\n", info->device);
 		return -1;
 	}
-	sleep(2); /* Added to ensure that dial can actually takes place */
+	if (adaptive_silence) {
+		/* Dial as soon as there is dial tone */
+		res = wait_for_level(info, TONE_LEVEL, 1, 0, 2);
+		if (res < 0)
+			return -1;
+		if (res && debug > 1)
+			tune_debug(stdout, info->channo, "No dial tone heard, dialing anyway\n");
+	} else
+		sleep(2); /* Added to ensure that dial can actually takes place */
 
 	memset(&dop, 0, sizeof(dop));
 	dop.op = DAHDI_DIAL_OP_REPLACE;
@@ -202,8 +358,17 @@ static int ensure_silence(struct silence_info *info)
 		fprintf(stderr, "Unable to dial!\n");
 		return -1;
 	}
-	sleep(1); 
-	sleep(info->initial_delay);  
+	if (adaptive_silence) {
+		res = wait_for_level(info, QUIET_LEVEL, 0, QUIET_MS, 1 + info->initial_delay + QUIET_TIMEOUT);
+		if (res) {
+			if (res > 0)
+				fprintf(stderr, "Line did not go quiet after dialing\n");
+			return -1;
+		}
+	} else {
+		sleep(1); 
+		sleep(info->initial_delay);  
+	}
 	
 	
 	gettimeofday(&info->last_reset, NULL);
@@ -364,36 +529,18 @@ static float db_loss(float measured, float reference)
 	return 20 * (logf(measured/reference)/logf(10));
 }
 
-static void one_point_dft(const short *inbuf, int len, int frequency, float *real, float *imaginary)
-{
-	float myreal = 0, myimag = 0;
-	int i;
-
-	for (i = 0; i < len; i++) {
-		if (use_table) {
-			myreal += (float) inbuf[i] * cos_tbl(i*frequency, 8000);
-			myimag += (float) inbuf[i] * sin_tbl(i*frequency, 8000);
-		} else {
-			myreal += (float) inbuf[i] * cos((i * 2.0 * M_PI * frequency)/8000);
-			myimag += (float) inbuf[i] * sin((i * 2.0 * M_PI * frequency)/8000);
-		}
-	}
-
-	myimag *= -1;
-
-	*real = myreal / (float) len;
-	*imaginary = myimag / (float) len;
-}
-
-
+/* The DFT of every frequency in freqs[], in one pass over inbuf */
 static float calc_magnitude(short *inbuf, int insamps)
 {
+	float sums[TONE_DFT_MAX_FREQS * 2];
 	float real, imaginary, magnitude;
 	float totalmagnitude = 0;
 	int i;
 
+	tone_dft_run(&dft, inbuf, insamps, sums);
 	for (i = 0; i < freqcount; i++) {
-		one_point_dft(inbuf, insamps, freqs[i], &real, &imaginary);
+		real = sums[i * 2] / (float) insamps;
+		imaginary = -sums[i * 2 + 1] / (float) insamps;
 		magnitude = sqrtf((real * real) + (imaginary * imaginary));
 		totalmagnitude += magnitude;
 	}
@@ -401,6 +548,18 @@ static float calc_magnitude(short *inbuf, int insamps)
 	return totalmagnitude;
 }
 
+/* Twiddles from the sine table, for -x */
+static void init_dft_table(void)
+{
+	int i, k;
+
+	for (i = 0; i < dft.len; i++) {
+		for (k = 0; k < freqcount; k++)
+			tone_dft_set(&dft, i, k, cos_tbl(i * freqs[k], 8000),
+				     sin_tbl(i * freqs[k], 8000));
+	}
+}
+
 
 /**
  *  dumps input and output buffer contents for the echo test - used to see exactly what's going on
@@ -411,6 +570,7 @@ static int maptone(int whichdahdi, int freq, char *dialstr, int delayuntilsilenc
 	int res = 0, x = 0;
 	struct dahdi_bufferinfo bi;
 	short inbuf[TEST_DURATION]; /* changed from BUFFER_LENGTH - this buffer is for short values, so it should be allocated using the length of the test */
+	short outbuf[TEST_DURATION];
 	FILE *outfile = NULL;
 	int leadin = 50;
 	int trailout = 100;
@@ -516,9 +676,9 @@ retry:
 /**
  *  Initialize the data store for storing off best calculated results
  */
-static void init_topresults(void)
+static void init_topresults(struct top_results *top)
 {
-	topresults.numactive = 0;
+	top->numactive = 0;
 }
 
 
@@ -526,33 +686,35 @@ static void init_topresults(void)
  *  If this is a best result candidate, store in the top results data store
  * 		This is dependent on being the lowest echo value
  *
+ *  @param top - The top results data store
  *  @param tbleoffset - The offset into the echo_trys table used
  *  @param setting - Pointer to the settings used to achieve the fgiven value
  *  @param echo - The calculated echo return value (in dB)
  *  @param echo - The calculated magnitude of the response
  */
-static void set_topresults(int tbloffset, struct wctdm_echo_coefs *setting, float echo, float freqres)
+static void set_topresults(struct top_results *top, int tbloffset, struct wctdm_echo_coefs *setting, float echo, float freqres)
 {
 	int place;
 	int idx;
 
-	for ( place = 0; place < MAX_RESULTS && place < topresults.numactive; place++) {
-		if (echo < topresults.results[place].echo) {
+	for ( place = 0; place < MAX_RESULTS && place < top->numactive; place++) {
+		if (echo < top->results[place].echo) {
 			break;
 		}
 	}
 
 	if (place < MAX_RESULTS) {
-		/*  move results to the bottom */
-		for (idx = topresults.numactive-2; idx >= place; idx--) {
-			topresults.results[idx+1] = topresults.results[idx];
+		/*  move results to the bottom, dropping the last one if the list is full */
+		idx = (top->numactive < MAX_RESULTS) ? top->numactive - 1 : MAX_RESULTS - 2;
+		for (; idx >= place; idx--) {
+			top->results[idx+1] = top->results[idx];
 		}
-		topresults.results[place].idx = tbloffset;
-		topresults.results[place].settings = *setting;
-		topresults.results[place].echo = echo;
-		topresults.results[place].freqres = freqres;
-		if (MAX_RESULTS > topresults.numactive) {
-			topresults.numactive++;
+		top->results[place].idx = tbloffset;
+		top->results[place].settings = *setting;
+		top->results[place].echo = echo;
+		top->results[place].freqres = freqres;
+		if (MAX_RESULTS > top->numactive) {
+			top->numactive++;
 		}
 	}
 }
@@ -561,23 +723,182 @@ static void set_topresults(int tbloffset, struct wctdm_echo_coefs *setting, floa
 /**
  *  Prints the top results stored to stdout
  *
+ *  @param top - The top results data store
  *  @param header - Text that goes in the header of the response
  */
-static void print_topresults(char * header)
+static void print_topresults(struct top_results *top, char * header)
 {
 	int item;
 
-	fprintf(stdout, "Top %d results for %s\n", topresults.numactive, header);
-	for (item = 0; item < topresults.numactive; item++) {
+	/* Keep the list together when several channels are tuned at once */
+	flockfile(stdout);
+	fprintf(stdout, "Top %d results for %s\n", top->numactive, header);
+	for (item = 0; item < top->numactive; item++) {
 		fprintf(stdout, "Res #%d: index=%d, %3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d: magnitude = %0.0f, echo = %0.4f dB\n",
-				item+1, topresults.results[item].idx, topresults.results[item].settings.acim,
-				topresults.results[item].settings.coef1, topresults.results[item].settings.coef2,
-				topresults.results[item].settings.coef3, topresults.results[item].settings.coef4,
-				topresults.results[item].settings.coef5, topresults.results[item].settings.coef6,
-				topresults.results[item].settings.coef7, topresults.results[item].settings.coef8,
-				topresults.results[item].freqres, topresults.results[item].echo);
+				item+1, top->results[item].idx, top->results[item].settings.acim,
+				top->results[item].settings.coef1, top->results[item].settings.coef2,
+				top->results[item].settings.coef3, top->results[item].settings.coef4,
+				top->results[item].settings.coef5, top->results[item].settings.coef6,
+				top->results[item].settings.coef7, top->results[item].settings.coef8,
+				top->results[item].freqres, top->results[item].echo);
 		
 	}
+	funlockfile(stdout);
+}
+
+
+/**
+ *  Set the size of the channel's buffers, in samples
+ */
+static int set_buffers(int whichdahdi, int samples)
+{
+	struct dahdi_bufferinfo bi;
+
+	memset(&bi, 0, sizeof(bi));
+	if (ioctl(whichdahdi, DAHDI_GET_BUFINFO, &bi)) {
+		fprintf(stderr, "Unable to get buffer information!\n");
+		return -1;
+	}
+	bi.numbufs = 2;
+	bi.bufsize = samples;
+	bi.txbufpolicy = DAHDI_POLICY_IMMEDIATE;
+	bi.rxbufpolicy = DAHDI_POLICY_IMMEDIATE;
+	if (ioctl(whichdahdi, DAHDI_SET_BUFINFO, &bi)) {
+		fprintf(stderr, "Unable to set buffer information!\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ *  Get a channel ready for echo tests: linear audio, buffers of the given
+ *  size (in samples), off hook, and the silence settings to keep the line clear
+ */
+static int start_tests(int whichdahdi, int channo, int samples, struct silence_info *sinfo, char *dialstr, int delayuntilsilence, int silencegoodfor)
+{
+	int x;
+
+	/* Set echo settings */
+	if (ioctl(whichdahdi, WCTDM_SET_ECHOTUNE, &echo_trys[0])) {
+		fprintf(stderr, "Unable to set impedance on fd %d\n", whichdahdi);
+		return -1;
+	}
+
+	x = 1;
+	if (ioctl(whichdahdi, DAHDI_SETLINEAR, &x)) {
+		fprintf(stderr, "Unable to set channel to signed linear mode.\n");
+		return -1;
+	}
+
+	if (set_buffers(whichdahdi, samples))
+		return -1;
+	x = DAHDI_OFFHOOK;
+	if (ioctl(whichdahdi, DAHDI_HOOK, &x)) {
+		fprintf(stderr, "Cannot bring fd %d off hook", whichdahdi);
+		return -1;
+	}
+
+	/* Set up silence settings */
+	memset(sinfo, 0, sizeof(*sinfo));
+	sinfo->device = whichdahdi;
+	sinfo->channo = channo;
+	sinfo->dialstr = dialstr;
+	sinfo->initial_delay = delayuntilsilence;
+	sinfo->reset_after = silencegoodfor;
+	return 0;
+}
+
+
+/**
+ *  Play a waveform with the given echo coefficients and measure the response
+ *
+ *  @param sinfo - The silence settings of the line
+ *  @param coefs - The echo coefficients to try
+ *  @param outbuf - The waveform, outsamps samples long
+ *  @param inbuf - Room for twice as many samples, for the response
+ *  @param freq_result - Set to the magnitude of the response
+ *  @return -1 on error, 1 if the line was not quiet during the test (the
+ *          result is still set, but the test should be done again), 0 otherwise
+ */
+static int measure_echo(struct silence_info *sinfo, struct wctdm_echo_coefs *coefs, short *outbuf, int outsamps, short *inbuf, float *freq_result)
+{
+	int whichdahdi = sinfo->device;
+	int skip = outsamps > SKIP_SAMPLES * 2 ? SKIP_SAMPLES : outsamps / 2;
+	int quiet = 1;
+	int res, x;
+
+	/* ensure silence on the line */
+	if (ensure_silence(sinfo)){
+		fprintf(stderr, "Unable to get a clear outside line\n");
+		return -1;
+	}
+
+	if (ioctl(whichdahdi, WCTDM_SET_ECHOTUNE, coefs)) {
+		fprintf(stderr, "Unable to set echo coefficients on fd %d\n", whichdahdi);
+		return -1;
+	}
+
+	/* Flush buffers */
+	x = DAHDI_FLUSH_READ | DAHDI_FLUSH_WRITE | DAHDI_FLUSH_EVENT;
+	if (ioctl(whichdahdi, DAHDI_FLUSH, &x)) {
+		fprintf(stderr, "Unable to flush I/O: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* send data out on line */
+	res = write(whichdahdi, outbuf, outsamps * 2);
+	if (res != outsamps * 2) {
+		fprintf(stderr, "Could not write all data to line\n");
+		return -1;
+	}
+
+retry:
+	/* read return response */
+	res = fxotune_read(whichdahdi, inbuf, outsamps * 4);
+	if (res != outsamps * 4) {
+		int dummy;
+
+		ioctl(whichdahdi, DAHDI_GETEVENT, &dummy);
+		goto retry;
+	}
+
+	/* The second half is only the line, once the echo has died out */
+	if (adaptive_silence)
+		quiet = note_line_state(sinfo, inbuf + outsamps + skip, outsamps - skip);
+
+	*freq_result = calc_magnitude(inbuf, outsamps * 2);
+	return !quiet;
+}
+
+
+/**
+ *  Print the result of one test, and save it to the debug file
+ */
+static void print_try(int channo, int trys, float freq_result, float echo)
+{
+	char result[256];
+
+	snprintf(result, sizeof(result), "%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d,%f,%f", 
+				echo_trys[trys].acim, 
+				echo_trys[trys].coef1, 
+				echo_trys[trys].coef2, 
+				echo_trys[trys].coef3, 
+				echo_trys[trys].coef4, 
+				echo_trys[trys].coef5, 
+				echo_trys[trys].coef6, 
+				echo_trys[trys].coef7, 
+				echo_trys[trys].coef8, 
+				freq_result,
+				echo
+			);
+	
+	tune_debug(debugoutfile, channo, "%s\n", result);
+	tune_debug(stdout, channo, "%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d: magnitude = %0.0f, echo = %0.4f dB\n",
+			echo_trys[trys].acim, echo_trys[trys].coef1, echo_trys[trys].coef2,
+			echo_trys[trys].coef3, echo_trys[trys].coef4, echo_trys[trys].coef5,
+			echo_trys[trys].coef6, echo_trys[trys].coef7, echo_trys[trys].coef8,
+			freq_result, echo);
 }
 
 
@@ -609,23 +930,26 @@ static void print_topresults(char * header)
  * 		 http://www.silabs.com/Support%20Documents/TechnicalDocs/si3050-18-19.pdf
  * 		 
  */
-static int acim_tune2(int whichdahdi, int freq, char *dialstr, int delayuntilsilence, int silencegoodfor, struct wctdm_echo_coefs *coefs_out)
+static int acim_tune2(int whichdahdi, int channo, int freq, char *dialstr, int delayuntilsilence, int silencegoodfor, struct wctdm_echo_coefs *coefs_out)
 {
 	int i = 0;
-	int res = 0, x = 0;
+	int res = 0;
 	int lowesttry = -1;
 	float lowesttryresult = 999999999999.0;
 	float lowestecho = 999999999999.0;
-	struct dahdi_bufferinfo bi;
 	short inbuf[TEST_DURATION * 2];
+	short outbuf[TEST_DURATION];
+	struct top_results top;
+	char header[64];
 	struct silence_info sinfo;
 	int echo_trys_size = 72;
 	int trys = 0;
 	float waveform_power;
 	float freq_result;
 	float echo;
+	int redo = 0;
 
-	init_topresults();
+	init_topresults(&top);
 
 	if (debug && !debugoutfile) {
 		if (!(debugoutfile = fopen("fxotune.vals", "w"))) {
@@ -634,44 +958,8 @@ static int acim_tune2(int whichdahdi, int freq, char *dialstr, int delayuntilsil
 		}
 	}
 
-	/* Set echo settings */
-	if (ioctl(whichdahdi, WCTDM_SET_ECHOTUNE, &echo_trys[0])) {
-		fprintf(stderr, "Unable to set impedance on fd %d\n", whichdahdi);
+	if (start_tests(whichdahdi, channo, BUFFER_LENGTH, &sinfo, dialstr, delayuntilsilence, silencegoodfor))
 		return -1;
-	}
-
-	x = 1;
-	if (ioctl(whichdahdi, DAHDI_SETLINEAR, &x)) {
-		fprintf(stderr, "Unable to set channel to signed linear mode.\n");
-		return -1;
-	}
-
-	memset(&bi, 0, sizeof(bi));
-	if (ioctl(whichdahdi, DAHDI_GET_BUFINFO, &bi)) {
-		fprintf(stderr, "Unable to get buffer information!\n");
-		return -1;
-	}
-	bi.numbufs = 2;
-	bi.bufsize = BUFFER_LENGTH;
-	bi.txbufpolicy = DAHDI_POLICY_IMMEDIATE;
-	bi.rxbufpolicy = DAHDI_POLICY_IMMEDIATE;
-	if (ioctl(whichdahdi, DAHDI_SET_BUFINFO, &bi)) {
-		fprintf(stderr, "Unable to set buffer information!\n");
-		return -1;
-	}
-	x = DAHDI_OFFHOOK;
-	if (ioctl(whichdahdi, DAHDI_HOOK, &x)) {
-		fprintf(stderr, "Cannot bring fd %d off hook", whichdahdi);
-		return -1;
-	}
-
-
-	/* Set up silence settings */
-	memset(&sinfo, 0, sizeof(sinfo));
-	sinfo.device = whichdahdi;
-	sinfo.dialstr = dialstr;
-	sinfo.initial_delay = delayuntilsilence;
-	sinfo.reset_after = silencegoodfor;
 
 	/* Fill the output buffers */
 	for (i = 0; i < TEST_DURATION; i++)
@@ -683,43 +971,17 @@ static int acim_tune2(int whichdahdi, int freq, char *dialstr, int delayuntilsil
 	/* sweep through the various coefficient settings and see how our responses look */
 
 	for (trys = 0; trys < echo_trys_size; trys++){
-		
-		/* ensure silence on the line */
-		if (ensure_silence(&sinfo)){
-			fprintf(stderr, "Unable to get a clear outside line\n");
-			return -1;
-		}
-		
-		if (ioctl(whichdahdi, WCTDM_SET_ECHOTUNE, &echo_trys[trys])) {
-			fprintf(stderr, "Unable to set echo coefficients on fd %d\n", whichdahdi);
-			return -1;
-		}
-
-		/* Flush buffers */
-		x = DAHDI_FLUSH_READ | DAHDI_FLUSH_WRITE | DAHDI_FLUSH_EVENT;
-		if (ioctl(whichdahdi, DAHDI_FLUSH, &x)) {
-			fprintf(stderr, "Unable to flush I/O: %s\n", strerror(errno));
-			return -1;
-		}
-
-		/* send data out on line */
-		res = write(whichdahdi, outbuf, BUFFER_LENGTH);
-		if (res != BUFFER_LENGTH) {
-			fprintf(stderr, "Could not write all data to line\n");
+		res = measure_echo(&sinfo, &echo_trys[trys], outbuf, TEST_DURATION, inbuf, &freq_result);
+		if (res < 0)
 			return -1;
+		if (res > 0 && ++redo <= MAX_REDO) {
+			if (debug)
+				tune_debug(stdout, channo, "Line not quiet during test %d, trying it again\n", trys);
+			trys--;
+			continue;
 		}
+		redo = 0;
 
-retry:
-		/* read return response */
-		res = fxotune_read(whichdahdi, inbuf, BUFFER_LENGTH * 2);
-		if (res != BUFFER_LENGTH * 2) {
-			int dummy;
-
-			ioctl(whichdahdi, DAHDI_GETEVENT, &dummy);
-			goto retry;
-		}
-
-		freq_result = calc_magnitude(inbuf, TEST_DURATION * 2);
 		echo = db_loss(freq_result, waveform_power);
 		
 #if 0
@@ -736,41 +998,145 @@ retry:
 			lowesttryresult = freq_result;
 			lowestecho = echo;
 		}
-		if (debug) {
-			char result[256];
-			snprintf(result, sizeof(result), "%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d,%f,%f", 
-						echo_trys[trys].acim, 
-						echo_trys[trys].coef1, 
-						echo_trys[trys].coef2, 
-						echo_trys[trys].coef3, 
-						echo_trys[trys].coef4, 
-						echo_trys[trys].coef5, 
-						echo_trys[trys].coef6, 
-						echo_trys[trys].coef7, 
-						echo_trys[trys].coef8, 
-						freq_result,
-						echo
-					);
-			
-			fprintf(debugoutfile, "%s\n", result);
-			fprintf(stdout, "%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d,%3d: magnitude = %0.0f, echo = %0.4f dB\n",
-					echo_trys[trys].acim, echo_trys[trys].coef1, echo_trys[trys].coef2,
-					echo_trys[trys].coef3, echo_trys[trys].coef4, echo_trys[trys].coef5,
-					echo_trys[trys].coef6, echo_trys[trys].coef7, echo_trys[trys].coef8,
-					freq_result, echo);
-		}
+		if (debug)
+			print_try(channo, trys, freq_result, echo);
 
 		if (printbest) {
-			set_topresults(trys, &echo_trys[trys], echo, freq_result);
+			set_topresults(&top, trys, &echo_trys[trys], echo, freq_result);
 		}
 	}
 
 	if (debug > 0)
-		fprintf(stdout, "Config with lowest response = %d, magnitude = %0.0f, echo = %0.4f dB\n", lowesttry, lowesttryresult, lowestecho);
+		tune_debug(stdout, channo, "Config with lowest response = %d, magnitude = %0.0f, echo = %0.4f dB\n", lowesttry, lowesttryresult, lowestecho);
 
 	memcpy(coefs_out, &echo_trys[lowesttry], sizeof(struct wctdm_echo_coefs));
 	if (printbest) {
-		print_topresults("Acim2_tune Test");
+		snprintf(header, sizeof(header), "Acim2_tune Test on channel %d", channo);
+		print_topresults(&top, header);
+	}
+
+	return 0;
+}
+
+/**
+ * Perform calibration type 3 on the specified device
+ *
+ * The same search as type 2, done coarse to fine. Each distinct setting in echo_trys is
+ * first tried with a short burst of the multi-frequency waveform, which is enough to tell
+ * the settings that cancel well from those that don't. Only the MAX_RESULTS best of those
+ * are then measured again with the full length test of type 2, and the one with the lowest
+ * response is kept. Most of the tests are a quarter as long, so a channel is tuned in a
+ * fraction of the time.
+ */
+static int acim_tune3(int whichdahdi, int channo, char *dialstr, int delayuntilsilence, int silencegoodfor, struct wctdm_echo_coefs *coefs_out)
+{
+	int i = 0;
+	int res = 0;
+	int lowesttry = -1;
+	float lowesttryresult = 999999999999.0;
+	float lowestecho = 999999999999.0;
+	short inbuf[TEST_DURATION * 2];
+	short outbuf[TEST_DURATION];
+	struct top_results coarse;
+	struct top_results top;
+	char header[64];
+	struct silence_info sinfo;
+	int echo_trys_size = 72;
+	int trys = 0;
+	float coarse_power;
+	float waveform_power;
+	float freq_result;
+	float echo;
+	int redo = 0;
+
+	init_topresults(&coarse);
+	init_topresults(&top);
+
+	if (debug && !debugoutfile) {
+		if (!(debugoutfile = fopen("fxotune.vals", "w"))) {
+			fprintf(stdout, "Cannot create fxotune.vals\n");
+			return -1;
+		}
+	}
+
+	if (start_tests(whichdahdi, channo, COARSE_DURATION * 2, &sinfo, dialstr, delayuntilsilence, silencegoodfor))
+		return -1;
+
+	/* The short burst is the start of the same waveform */
+	for (i = 0; i < TEST_DURATION; i++)
+		outbuf[i] = genwaveform(i);
+	coarse_power = calc_magnitude(outbuf, COARSE_DURATION);
+	waveform_power = calc_magnitude(outbuf, TEST_DURATION);
+
+	/* rank every setting on a short test */
+	for (trys = 0; trys < echo_trys_size; trys++) {
+		/* some settings are in the table more than once */
+		for (i = 0; i < trys; i++) {
+			if (!memcmp(&echo_trys[i], &echo_trys[trys], sizeof(echo_trys[i])))
+				break;
+		}
+		if (i < trys)
+			continue;
+
+		res = measure_echo(&sinfo, &echo_trys[trys], outbuf, COARSE_DURATION, inbuf, &freq_result);
+		if (res < 0)
+			return -1;
+		if (res > 0 && ++redo <= MAX_REDO) {
+			if (debug)
+				tune_debug(stdout, channo, "Line not quiet during test %d, trying it again\n", trys);
+			trys--;
+			continue;
+		}
+		redo = 0;
+
+		echo = db_loss(freq_result, coarse_power);
+		if (debug > 1)
+			tune_debug(stdout, channo, "Coarse test %d: magnitude = %0.0f, echo = %0.4f dB\n", trys, freq_result, echo);
+		set_topresults(&coarse, trys, &echo_trys[trys], echo, freq_result);
+	}
+
+	/* then measure the best of them properly, in table order so that ties go as with type 2 */
+	if (set_buffers(whichdahdi, BUFFER_LENGTH))
+		return -1;
+	for (trys = 0; trys < echo_trys_size; trys++) {
+		for (i = 0; i < coarse.numactive; i++) {
+			if (coarse.results[i].idx == trys)
+				break;
+		}
+		if (i == coarse.numactive)
+			continue;
+
+		res = measure_echo(&sinfo, &echo_trys[trys], outbuf, TEST_DURATION, inbuf, &freq_result);
+		if (res < 0)
+			return -1;
+		if (res > 0 && ++redo <= MAX_REDO) {
+			if (debug)
+				tune_debug(stdout, channo, "Line not quiet during test %d, trying it again\n", trys);
+			trys--;
+			continue;
+		}
+		redo = 0;
+
+		echo = db_loss(freq_result, waveform_power);
+		if (freq_result < lowesttryresult){
+			lowesttry = trys;
+			lowesttryresult = freq_result;
+			lowestecho = echo;
+		}
+		if (debug)
+			print_try(channo, trys, freq_result, echo);
+		set_topresults(&top, trys, &echo_trys[trys], echo, freq_result);
+	}
+
+	if (debug > 0)
+		tune_debug(stdout, channo, "Config with lowest response = %d, magnitude = %0.0f, echo = %0.4f dB\n", lowesttry, lowesttryresult, lowestecho);
+
+	memcpy(coefs_out, &echo_trys[lowesttry], sizeof(struct wctdm_echo_coefs));
+	if (printbest) {
+		snprintf(header, sizeof(header), "Acim3_tune short tests on channel %d", channo);
+		print_topresults(&coarse, header);
+		snprintf(header, sizeof(header), "Acim3_tune Test on channel %d", channo);
+		print_topresults(&top, header);
 	}
 
 	return 0;
@@ -779,21 +1145,20 @@ retry:
 /**
  *  Perform calibration type 1 on the specified device.  Only tunes the line impedance.  Look for best response range 
  */
-static int acim_tune(int whichdahdi, char *dialstr, int delayuntilsilence, int silencegoodfor, struct wctdm_echo_coefs *coefs_out)
+static int acim_tune(int whichdahdi, int channo, char *dialstr, int delayuntilsilence, int silencegoodfor, struct wctdm_echo_coefs *coefs_out)
 {
 	int i = 0, freq = 0, acim = 0;
 	int res = 0, x = 0;
 	struct dahdi_bufferinfo bi;
 	struct wctdm_echo_coefs coefs;
 	short inbuf[TEST_DURATION]; /* changed from BUFFER_LENGTH - this buffer is for short values, so it should be allocated using the length of the test */
+	short outbuf[TEST_DURATION];
 	int lowest = 0;
-	FILE *outfile = NULL;
 	float acim_results[16];
 	struct silence_info sinfo;
 
-	if (debug) {
-		outfile = fopen("fxotune.vals", "w");
-		if (!outfile) {
+	if (debug && !debugoutfile) {
+		if (!(debugoutfile = fopen("fxotune.vals", "w"))) {
 			fprintf(stdout, "Cannot create fxotune.vals\n");
 			return -1;
 		}
@@ -802,6 +1167,7 @@ static int acim_tune(int whichdahdi, char *dialstr, int delayuntilsilence, int s
 	/* Set up silence settings */
 	memset(&sinfo, 0, sizeof(sinfo));
 	sinfo.device = whichdahdi;
+	sinfo.channo = channo;
 	sinfo.dialstr = dialstr;
 	sinfo.initial_delay = delayuntilsilence;
 	sinfo.reset_after = silencegoodfor;
@@ -882,14 +1248,17 @@ retry:
 			/* calculate power of response */
 			
 			freq_results[(freq/200)-1] = power_of(inbuf+SKIP_SAMPLES, TEST_DURATION-SKIP_SAMPLES, 1); /* changed from inbuf+SKIP_BYTES, BUFFER_LENGTH-SKIP_BYTES, 1 */
-			if (debug) fprintf(outfile, "%d,%d,%f\n", acim, freq, freq_results[(freq/200)-1]);
+			if (debug) tune_debug(debugoutfile, channo, "%d,%d,%f\n", acim, freq, freq_results[(freq/200)-1]);
 		}
 		acim_results[acim] = power_of(freq_results, 15, 0);
 	}
 
 	if (debug) {
+		/* Other jobs write to the same file */
+		flockfile(debugoutfile);
 		for (i = 0; i < 16; i++)
-			fprintf(outfile, "acim_results[%d] = %f\n", i, acim_results[i]);
+			tune_debug(debugoutfile, channo, "acim_results[%d] = %f\n", i, acim_results[i]);
+		funlockfile(debugoutfile);
 	}
 	/* Find out what the "best" impedance is for the line */
 	lowest = 0;
@@ -1094,6 +1463,71 @@ static int do_dump(int startdev, char* dialstr, int delayuntilsilence, int silen
 
 }	
 
+/* One channel of a calibration run */
+struct calib_result {
+	int present;		/* the channel could be opened */
+	int res;
+	struct wctdm_echo_coefs coefs;
+};
+
+/* A calibration run, shared by the threads tuning its channels */
+struct calib_run {
+	int startdev;
+	int enddev;
+	int calibtype;
+	char *dialstr;
+	int delayuntilsilence;
+	int silencegoodfor;
+	int jobs;
+	int next;		/* next channel to tune */
+	pthread_mutex_t lock;
+	struct calib_result *results;
+};
+
+static void calibrate_channel(struct calib_run *run, int devno)
+{
+	struct calib_result *result = &run->results[devno - run->startdev];
+	int fd;
+
+	fd = channel_open(devno);
+	if (fd < 0) {
+		return;
+	}
+	result->present = 1;
+
+	fprintf(stdout, "Tuning module %d\n", devno);
+
+	if (1 == run->calibtype)
+		result->res = acim_tune(fd, devno, run->dialstr, run->delayuntilsilence, run->silencegoodfor, &result->coefs);
+	else if (3 == run->calibtype)
+		result->res = acim_tune3(fd, devno, run->dialstr, run->delayuntilsilence, run->silencegoodfor, &result->coefs);
+	else
+		result->res = acim_tune2(fd, devno, -1, run->dialstr, run->delayuntilsilence, run->silencegoodfor, &result->coefs);
+
+	close(fd);
+
+	if (run->jobs > 1)
+		fprintf(stdout, "Module %d: %s\n", devno, result->res ? "Failure!" : "Done!");
+	else
+		fprintf(stdout, "%s\n", result->res ? "Failure!" : "Done!");
+}
+
+static void *calibrate_thread(void *data)
+{
+	struct calib_run *run = data;
+	int devno;
+
+	for (;;) {
+		pthread_mutex_lock(&run->lock);
+		devno = run->next++;
+		pthread_mutex_unlock(&run->lock);
+		if (devno > run->enddev)
+			break;
+		calibrate_channel(run, devno);
+	}
+	return NULL;
+}
+
 /**
  * Performs calibration on all specified devices
  * 
@@ -1101,23 +1535,29 @@ static int do_dump(int startdev, char* dialstr, int delayuntilsilence, int silen
  * @param enddev the last device to check
  * @param calibtype the type of calibration to perform.  1=old style (loops through individual frequencies
  * 			doesn't optimize echo coefficients.  2=new style (uses multi-tone and optimizes echo coefficients
- * 			and acim setting)
+ * 			and acim setting)  3=as 2, but a short test of every setting picks the few to test fully
  * @param configfilename the path of the file that the calibration results should be written to
  * @param dialstr the string that should be dialed to clear the dialtone from the line
  * @param delayuntilsilence the number of seconds to wait after dialing dialstr before starting the test
  * @param silencegoodfor the number of seconds that the test can run before having to reset the line again
  * 			(this is basically the amount of time it takes before the 'if you'd like to make a call...' message
  * 			kicks in after you dial dialstr
+ * @param jobs the number of devices tuned at the same time, each by its own thread.  The config file is
+ * 			written once all are done, in device order, as when they are tuned one after another.
  * 
  * @return 0 if successful, -1 for serious error such as device not available , > 0 indicates the number of channels
  */	
-static int do_calibrate(int startdev, int enddev, int calibtype, char* configfilename, char* dialstr, int delayuntilsilence, int silencegoodfor)
+static int do_calibrate(int startdev, int enddev, int calibtype, char* configfilename, char* dialstr, int delayuntilsilence, int silencegoodfor, int jobs)
 {
 	int problems = 0;
 	int res = 0;
-	int configfd, fd;
+	int configfd;
 	int devno = 0;
-	struct wctdm_echo_coefs coefs;
+	struct calib_run run;
+	struct calib_result *result;
+	pthread_t *threads = NULL;
+	int started = 0;
+	int i;
 	
 	configfd = open(configfile, O_CREAT|O_TRUNC|O_WRONLY, 0666);
 
@@ -1126,29 +1566,63 @@ static int do_calibrate(int startdev, int enddev, int calibtype, char* configfil
 		return -1;
 	}
 
+	memset(&run, 0, sizeof(run));
+	run.startdev = startdev;
+	run.enddev = enddev;
+	run.calibtype = calibtype;
+	run.dialstr = dialstr;
+	run.delayuntilsilence = delayuntilsilence;
+	run.silencegoodfor = silencegoodfor;
+	run.next = startdev;
+	pthread_mutex_init(&run.lock, NULL);
+	if (enddev >= startdev) {
+		run.results = calloc(enddev - startdev + 1, sizeof(*run.results));
+		if (!run.results) {
+			fprintf(stderr, "Out of memory\n");
+			close(configfd);
+			return -1;
+		}
+		if (jobs > enddev - startdev + 1)
+			jobs = enddev - startdev + 1;
+	}
+	run.jobs = jobs;
+	tag_lines = jobs > 1;
+
+	if (jobs > 1) {
+		/* Every thread would otherwise open (and truncate) it */
+		if (debug && !debugoutfile) {
+			if (!(debugoutfile = fopen("fxotune.vals", "w"))) {
+				fprintf(stdout, "Cannot create fxotune.vals\n");
+				close(configfd);
+				return -1;
+			}
+		}
+		/* This thread is one of the jobs */
+		threads = calloc(jobs - 1, sizeof(*threads));
+		for (i = 0; threads && i < jobs - 1; i++) {
+			if (pthread_create(&threads[i], NULL, calibrate_thread, &run))
+				break;
+			started++;
+		}
+		/* Whatever is left (all of it if no thread could start) is tuned here */
+		calibrate_thread(&run);
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	} else {
+		for (devno = startdev; devno <= enddev; devno++)
+			calibrate_channel(&run, devno);
+	}
+
 	for (devno = startdev; devno <= enddev; devno++) {
-		fd = channel_open(devno);
-		if (fd < 0) {
+		result = &run.results[devno - startdev];
+		if (!result->present) {
 			continue;
 		}
 
-		fprintf(stdout, "Tuning module %d\n", devno);
-		
-		if (1 == calibtype)
-			res = acim_tune(fd, dialstr, delayuntilsilence, silencegoodfor, &coefs);
-		else
-			res = acim_tune2(fd, -1, dialstr, delayuntilsilence, silencegoodfor, &coefs);
-
-		close(fd);
-		
-		if (res) {
-			fprintf(stdout, "Failure!\n");
+		if (result->res) {
 			problems++;
 		} else {
-			fprintf(stdout, "Done!\n");
-		}
-
-		if (res == 0) {
 			
 		/* Do output to file */
 			int len = 0;
@@ -1156,15 +1630,15 @@ static int do_calibrate(int startdev, int enddev, int calibtype, char* configfil
 
 			snprintf(output, sizeof(output), "%d=%d,%d,%d,%d,%d,%d,%d,%d,%d\n", 
 				devno,
-				coefs.acim, 
-				coefs.coef1, 
-				coefs.coef2, 
-				coefs.coef3, 
-				coefs.coef4, 
-				coefs.coef5, 
-				coefs.coef6, 
-				coefs.coef7, 
-				coefs.coef8
+				result->coefs.acim, 
+				result->coefs.coef1, 
+				result->coefs.coef2, 
+				result->coefs.coef3, 
+				result->coefs.coef4, 
+				result->coefs.coef5, 
+				result->coefs.coef6, 
+				result->coefs.coef7, 
+				result->coefs.coef8
 			);
 
 			if (debug)
@@ -1179,6 +1653,8 @@ static int do_calibrate(int startdev, int enddev, int calibtype, char* configfil
 		}
 	}
 
+	free(run.results);
+	pthread_mutex_destroy(&run.lock);
 	close(configfd);
 	
 	if (problems)
@@ -1196,6 +1672,7 @@ int main(int argc , char **argv)
 	int waveformtype = -1; /* -w multi-tone by default.  If > 0, single tone of specified frequency */
 	int delaytosilence = 0; /* -l */
 	int silencegoodfor = 18; /* -m */
+	int jobs = 1; /* -j */
 	char* dialstr = "5"; /* -n */
 	int res = 0;
 	int doset = 0; /* -s */
@@ -1242,6 +1719,11 @@ int main(int argc , char **argv)
 			case 't':
 				calibtype = moreargs ? atoi(argv[++i]) : calibtype;
 				break;
+			case 'j':
+				jobs = moreargs ? atoi(argv[++i]) : jobs;
+				if (jobs < 1)
+					jobs = 1;
+				break;
 			case 'w':
 				waveformtype = moreargs ? atoi(argv[++i]) : waveformtype;
 				break;
@@ -1260,6 +1742,9 @@ int main(int argc , char **argv)
 			case 'x':
 				use_table = 1;
 				break;
+			case 'a':
+				adaptive_silence = 1;
+				break;
 			case 'v':
 				debug = strlen(argv[i])-1;
 				break;
@@ -1293,19 +1778,31 @@ int main(int argc , char **argv)
 		fprintf(stdout, "\tstartdev=%d\n", startdev);
 		fprintf(stdout, "\tstopdev=%d\n", stopdev);	
 		fprintf(stdout, "\tcalibtype=%d\n", calibtype);	
+		fprintf(stdout, "\tjobs=%d\n", jobs);
 		fprintf(stdout, "\twaveformtype=%d\n", waveformtype);	
 		fprintf(stdout, "\tdelaytosilence=%d\n", delaytosilence);	
 		fprintf(stdout, "\tsilencegoodfor=%d\n", silencegoodfor);	
+		fprintf(stdout, "\tadaptive silence=%d\n", adaptive_silence);
 		fprintf(stdout, "\tdialstr=%s\n", dialstr);	
 		fprintf(stdout, "\tdebug=%d\n", debug);	
 	}
 
+	tone_dft_kernels_init();
+	if (tone_dft_init(&dft, freqs, freqcount, BUFFER_LENGTH)) {
+		fprintf(stderr, "Unable to allocate DFT tables\n");
+		return -1;
+	}
 	if(use_table) {
 		init_sinetable();
+		init_dft_table();
 	}
 	
 	if (docalibrate){
-		res = do_calibrate(startdev, stopdev, calibtype, configfile, dialstr, delaytosilence, silencegoodfor);
+		if (jobs > 1 && audio_dump_fd != -1) {
+			fprintf(stdout, "-o can't be used with -j: the audio of several devices would be mixed\n");
+			return -1;
+		}
+		res = do_calibrate(startdev, stopdev, calibtype, configfile, dialstr, delaytosilence, silencegoodfor, jobs);
 		if (!res)
 			return do_set(configfile, dev_range, startdev, stopdev);
 		else
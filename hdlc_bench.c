@@ -0,0 +1,363 @@
+/*
+ * hdlc_bench -- check and time HDLC framing without hardware
+ *
+ * A corpus of frames (pseudo-random lengths as in hdlcgen, each with its
+ * FCS-16) is encoded and decoded in memory, both with fasthdlc a byte at
+ * a time and with the word at a time stuffing in hdlc_bits.c. Every
+ * combination of encoder and decoder is checked to give back the corpus
+ * before anything is timed.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define FAST_HDLC_NEED_TABLES
+#include <dahdi/fasthdlc.h>
+
+#include "fcs.h"
+#include "hdlc_bits.h"
+
+#define FRAME_MAX	(256 + 4 + 2)	/* longest frame, with its FCS */
+#define CORPUS_BYTES	(256 * 1024)
+
+enum corpus_kind {
+	CORPUS_RANDOM,
+	CORPUS_ONES,		/* all 0xff: a stuffed bit every five */
+	CORPUS_ZEROS,		/* nothing to stuff */
+};
+
+static const char *kind_names[] = {
+	[CORPUS_RANDOM] = "random",
+	[CORPUS_ONES] = "ones",
+	[CORPUS_ZEROS] = "zeros",
+};
+
+struct corpus {
+	unsigned char *data;	/* the frames, back to back */
+	int *lens;
+	int frames;
+	int bytes;
+};
+
+/* Where a decoder is in the corpus it should give back */
+struct verify {
+	const struct corpus *c;
+	int frame;
+	int pos;
+	int errors;
+};
+
+static struct corpus corpus;
+static unsigned char *line;
+static int line_max;
+static unsigned char decbuf[FRAME_MAX * 2];
+static int timing;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: hdlc_bench [-n MBYTES]\n");
+	fprintf(stderr, "        -n MBYTES: megabytes run through each routine (default: 64)\n");
+	exit(1);
+}
+
+static void corpus_fill(struct corpus *c, enum corpus_kind kind)
+{
+	unsigned int seed = 1;
+	unsigned int fcs;
+	unsigned char *p;
+	int cnt, x;
+
+	c->frames = 0;
+	c->bytes = 0;
+	srand(seed);
+	for (;;) {
+		cnt = (rand() % 256) + 4;
+		if (c->bytes + cnt + 2 > CORPUS_BYTES)
+			break;
+		p = c->data + c->bytes;
+		for (x = 0; x < cnt; x++) {
+			switch (kind) {
+			case CORPUS_RANDOM:
+				p[x] = rand();
+				break;
+			case CORPUS_ONES:
+				p[x] = 0xff;
+				break;
+			case CORPUS_ZEROS:
+				p[x] = 0;
+				break;
+			}
+		}
+		fcs = fcs16(FCS16_INIT, p, cnt) ^ 0xffff;
+		p[cnt] = fcs & 0xff;
+		p[cnt + 1] = fcs >> 8;
+		c->lens[c->frames++] = cnt + 2;
+		c->bytes += cnt + 2;
+	}
+}
+
+static void verify_init(struct verify *v, const struct corpus *c)
+{
+	memset(v, 0, sizeof(*v));
+	v->c = c;
+}
+
+static void verify_frame(void *arg, const unsigned char *buf, int len)
+{
+	struct verify *v = arg;
+	const struct corpus *c = v->c;
+
+	if (timing) {
+		v->frame++;
+		return;
+	}
+	if (v->frame >= c->frames) {
+		if (!v->errors++)
+			fprintf(stderr, "Extra frame of %d bytes\n", len);
+		return;
+	}
+	if (len != c->lens[v->frame] || memcmp(buf, c->data + v->pos, len) ||
+	    fcs16(FCS16_INIT, buf, len) != FCS16_GOOD) {
+		if (!v->errors++)
+			fprintf(stderr, "Frame %d differs (%d bytes, expected %d)\n",
+				v->frame, len, c->lens[v->frame]);
+	}
+	v->pos += c->lens[v->frame];
+	v->frame++;
+}
+
+static int verify_done(struct verify *v, const char *what)
+{
+	if (v->frame != v->c->frames) {
+		if (!v->errors++)
+			fprintf(stderr, "%s: got %d frames, expected %d\n",
+				what, v->frame, v->c->frames);
+	} else if (v->errors) {
+		fprintf(stderr, "%s: %d errors\n", what, v->errors);
+	}
+	return v->errors;
+}
+
+static int encode_fasthdlc(const struct corpus *c, unsigned char *out)
+{
+	struct fasthdlc_state transmitter;
+	const unsigned char *p = c->data;
+	int hdlccnt = 0;
+	int f, x;
+
+	fasthdlc_init(&transmitter, FASTHDLC_MODE_64);
+	for (f = 0; f < c->frames; f++) {
+		fasthdlc_tx_frame(&transmitter);
+		while (transmitter.bits >= 8)
+			out[hdlccnt++] = fasthdlc_tx_run(&transmitter);
+		for (x = 0; x < c->lens[f]; x++) {
+			fasthdlc_tx_load(&transmitter, p[x]);
+			while (transmitter.bits >= 8)
+				out[hdlccnt++] = fasthdlc_tx_run(&transmitter);
+		}
+		p += c->lens[f];
+	}
+	fasthdlc_tx_frame(&transmitter);
+	while (transmitter.bits >= 8)
+		out[hdlccnt++] = fasthdlc_tx_run(&transmitter);
+	/* The rest goes out padded with a flag */
+	if (transmitter.bits)
+		out[hdlccnt++] = fasthdlc_tx_run(&transmitter);
+	return hdlccnt;
+}
+
+static int encode_word(const struct corpus *c, unsigned char *out)
+{
+	struct hdlc_enc enc;
+	const unsigned char *p = c->data;
+	int f;
+
+	hdlc_enc_init(&enc, out, line_max);
+	for (f = 0; f < c->frames; f++) {
+		hdlc_enc_flag(&enc);
+		hdlc_enc_data(&enc, p, c->lens[f]);
+		p += c->lens[f];
+	}
+	hdlc_enc_flag(&enc);
+	if (enc.overflow) {
+		fprintf(stderr, "Line buffer too small\n");
+		exit(1);
+	}
+	return hdlc_enc_finish(&enc);
+}
+
+static void decode_fasthdlc(const unsigned char *in, int len, struct verify *v)
+{
+	struct fasthdlc_state receiver;
+	int hdlccnt = 0;
+	int inframe = 0;
+	int res, x;
+
+	fasthdlc_init(&receiver, FASTHDLC_MODE_64);
+	for (x = 0; x < len; x++) {
+		if (fasthdlc_rx_load(&receiver, in[x])) {
+			fprintf(stderr, "Unable to feed receiver :(\n");
+			exit(1);
+		}
+		while (!((res = fasthdlc_rx_run(&receiver)) & RETURN_EMPTY_FLAG)) {
+			if (res & RETURN_COMPLETE_FLAG) {
+				if (hdlccnt)
+					verify_frame(v, decbuf, hdlccnt);
+				hdlccnt = 0;
+				inframe = 1;
+			} else if (res & RETURN_DISCARD_FLAG) {
+				if (inframe && hdlccnt)
+					v->errors++;
+				hdlccnt = 0;
+				inframe = 0;
+			} else if (hdlccnt < sizeof(decbuf)) {
+				decbuf[hdlccnt++] = res;
+			} else {
+				v->errors++;
+				hdlccnt = 0;
+			}
+		}
+	}
+}
+
+static void decode_word(const unsigned char *in, int len, struct verify *v)
+{
+	v->errors += hdlc_decode(in, len, decbuf, sizeof(decbuf), verify_frame, v);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Both encoders, and each line through both decoders */
+static int check(void)
+{
+	static const char *enc_names[] = { "fasthdlc", "word" };
+	struct verify v;
+	int len, e;
+	int errors = 0;
+	char what[64];
+
+	for (e = 0; e < 2; e++) {
+		len = e ? encode_word(&corpus, line) : encode_fasthdlc(&corpus, line);
+		verify_init(&v, &corpus);
+		decode_fasthdlc(line, len, &v);
+		snprintf(what, sizeof(what), "%s encode, fasthdlc decode", enc_names[e]);
+		errors += verify_done(&v, what);
+		verify_init(&v, &corpus);
+		decode_word(line, len, &v);
+		snprintf(what, sizeof(what), "%s encode, word decode", enc_names[e]);
+		errors += verify_done(&v, what);
+	}
+	return errors;
+}
+
+static void report(const char *kind, const char *what, double secs, long passes)
+{
+	double bytes = (double)corpus.bytes * passes;
+
+	printf("%-7s %-16s %10.1f %10.2f\n", kind, what, bytes / secs / 1e6,
+	       secs * 1e9 / bytes);
+}
+
+static void bench(const char *kind, long passes)
+{
+	struct verify v;
+	double start;
+	long x;
+	int len = 0;
+
+	timing = 1;
+	start = now();
+	for (x = 0; x < passes; x++)
+		len = encode_fasthdlc(&corpus, line);
+	report(kind, "fasthdlc encode", now() - start, passes);
+	start = now();
+	for (x = 0; x < passes; x++) {
+		verify_init(&v, &corpus);
+		decode_fasthdlc(line, len, &v);
+	}
+	report(kind, "fasthdlc decode", now() - start, passes);
+
+	start = now();
+	for (x = 0; x < passes; x++)
+		len = encode_word(&corpus, line);
+	report(kind, "word encode", now() - start, passes);
+	start = now();
+	for (x = 0; x < passes; x++) {
+		verify_init(&v, &corpus);
+		decode_word(line, len, &v);
+	}
+	report(kind, "word decode", now() - start, passes);
+	timing = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long mbytes = 64;
+	long passes;
+	int kind;
+	int opt;
+	int failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			mbytes = atol(optarg);
+			if (mbytes < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	fasthdlc_precalc();
+	fcs_init();
+	hdlc_bits_init();
+
+	/* Worst case stuffing is one bit in five, plus the flags */
+	line_max = CORPUS_BYTES * 6 / 5 + (CORPUS_BYTES / 6 + 2) * 2 + 16;
+	corpus.data = malloc(CORPUS_BYTES);
+	corpus.lens = malloc(sizeof(*corpus.lens) * (CORPUS_BYTES / 6 + 1));
+	line = malloc(line_max);
+	if (!corpus.data || !corpus.lens || !line) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	printf("%-7s %-16s %10s %10s\n", "corpus", "", "MB/s", "ns/byte");
+	for (kind = 0; kind < sizeof(kind_names) / sizeof(kind_names[0]); kind++) {
+		corpus_fill(&corpus, kind);
+		if (check()) {
+			fprintf(stderr, "%s corpus: round trip FAILED\n", kind_names[kind]);
+			failed = 1;
+			continue;
+		}
+		passes = mbytes * 1000000 / corpus.bytes;
+		if (passes < 1)
+			passes = 1;
+		bench(kind_names[kind], passes);
+	}
+	return failed;
+}
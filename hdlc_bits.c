@@ -0,0 +1,273 @@
+/*
+ * hdlc_bits.c -- HDLC bit stuffing and unstuffing a word at a time
+ *
+ * Bits are kept in line order, the first one in bit 63 of a word. For
+ * such a word w, w & w>>1 & w>>2 & w>>3 & w>>4 has a bit set at the end
+ * of every run of five ones, and the highest one is the first run: the
+ * bits up to it are copied at once, and only there does anything happen
+ * (a zero is stuffed, or removed, or a flag or abort is seen).
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <string.h>
+
+#include "hdlc_bits.h"
+
+#define HDLC_FLAG	0x7e
+
+/* Data bytes go least significant bit first: reverse them into line order */
+static unsigned char rev8[256];
+
+void hdlc_bits_init(void)
+{
+	int i, x;
+
+	for (i = 0; i < 256; i++) {
+		rev8[i] = 0;
+		for (x = 0; x < 8; x++) {
+			if (i & (1 << x))
+				rev8[i] |= 0x80 >> x;
+		}
+	}
+}
+
+/* Ends of runs of five ones */
+static inline uint64_t run_ends(uint64_t w)
+{
+	return w & (w >> 1) & (w >> 2) & (w >> 3) & (w >> 4);
+}
+
+/* The first n bits of w, the others cleared */
+static inline uint64_t top_bits(uint64_t w, int n)
+{
+	return n >= 64 ? w : w & ~(~0ULL >> n);
+}
+
+void hdlc_enc_init(struct hdlc_enc *enc, unsigned char *out, int max)
+{
+	memset(enc, 0, sizeof(*enc));
+	enc->out = out;
+	enc->max = max;
+}
+
+/* Append the first n bits of w (the rest must be zero), n <= 56 */
+static inline void enc_put(struct hdlc_enc *enc, uint64_t w, int n)
+{
+	enc->acc |= w >> enc->nacc;
+	enc->nacc += n;
+	while (enc->nacc >= 8) {
+		if (enc->len < enc->max)
+			enc->out[enc->len++] = enc->acc >> 56;
+		else
+			enc->overflow = 1;
+		enc->acc <<= 8;
+		enc->nacc -= 8;
+	}
+}
+
+void hdlc_enc_flag(struct hdlc_enc *enc)
+{
+	enc_put(enc, (uint64_t)HDLC_FLAG << 56, 8);
+	enc->ones = 0;
+}
+
+void hdlc_enc_data(struct hdlc_enc *enc, const unsigned char *buf, int len)
+{
+	uint64_t w, m, seg;
+	int v, n, t, x;
+
+	while (len > 0) {
+		/* Up to 7 bytes, so a stuffed bit still fits */
+		v = len < 7 ? len : 7;
+		w = 0;
+		for (x = 0; x < v; x++)
+			w |= (uint64_t)rev8[buf[x]] << (56 - x * 8);
+		buf += v;
+		len -= v;
+		v *= 8;
+
+		while (v > 0) {
+			m = run_ends(w);
+			/* A run that started with the ones already sent */
+			if (enc->ones) {
+				n = 5 - enc->ones;
+				if (v >= n && !(~w >> (64 - n)))
+					m |= 1ULL << (64 - n);
+			}
+			if (!m) {
+				enc_put(enc, w, v);
+				seg = w >> (64 - v);
+				t = __builtin_ctzll(~seg);
+				enc->ones = (t >= v) ? enc->ones + v : t;
+				break;
+			}
+			/* Up to the first run, then the stuffed zero */
+			n = 64 - (63 - __builtin_clzll(m));
+			enc_put(enc, top_bits(w, n), n);
+			enc_put(enc, 0, 1);
+			enc->ones = 0;
+			w <<= n;
+			v -= n;
+		}
+	}
+}
+
+int hdlc_enc_finish(struct hdlc_enc *enc)
+{
+	if (enc->nacc)
+		enc_put(enc, 0, 8 - enc->nacc);
+	return enc->len;
+}
+
+/* 64 line bits starting at bit pos, zeros past the end */
+static inline uint64_t get_bits(const unsigned char *in, int len, long pos)
+{
+	long b = pos >> 3;
+	int sh = pos & 7;
+	uint64_t w = 0;
+	int x;
+
+	if (b + 9 <= len) {
+		for (x = 0; x < 8; x++)
+			w = (w << 8) | in[b + x];
+		if (sh)
+			w = (w << sh) | (in[b + 8] >> (8 - sh));
+		return w;
+	}
+	for (x = 0; x < 9; x++) {
+		uint64_t byte = (b + x < len) ? in[b + x] : 0;
+		int shift = 56 - x * 8 + sh;
+
+		if (shift >= 0)
+			w |= byte << shift;
+		else
+			w |= byte >> -shift;
+	}
+	return w;
+}
+
+struct dec_frame {
+	unsigned char *buf;
+	int max;
+	int len;		/* whole bytes so far */
+	uint64_t acc;		/* data bits not yet a byte, first in bit 63 */
+	int nacc;
+	int inframe;
+	int toolong;
+};
+
+/* Append the first n bits of w, n <= 32 */
+static inline void dec_put(struct dec_frame *f, uint64_t w, int n)
+{
+	f->acc |= top_bits(w, n) >> f->nacc;
+	f->nacc += n;
+	while (f->nacc >= 8) {
+		if (f->len < f->max)
+			f->buf[f->len++] = rev8[f->acc >> 56];
+		else
+			f->toolong = 1;
+		f->acc <<= 8;
+		f->nacc -= 8;
+	}
+}
+
+int hdlc_decode(const unsigned char *in, int len, unsigned char *buf, int max,
+		void (*frame)(void *arg, const unsigned char *buf, int len), void *arg)
+{
+	struct dec_frame f;
+	long total = (long)len * 8;
+	long p = 0;		/* next line bit to look at */
+	long s, t, end, bits;
+	uint64_t w, m, decided, next;
+	int v, n, errors = 0;
+
+	memset(&f, 0, sizeof(f));
+	f.buf = buf;
+	f.max = max;
+	while (p < total) {
+		/* Start 4 bits back, to see runs that began before p */
+		s = p >= 4 ? p - 4 : 0;
+		w = get_bits(in, len, s);
+		v = total - s < 64 ? total - s : 64;
+		/* Runs that ended before p are done */
+		m = run_ends(w) & (~0ULL >> (p - s));
+		/* Deciding on a run needs the two bits after it */
+		decided = (v >= 3) ? m & ~(~0ULL >> (v - 2)) : 0;
+		if (!decided) {
+			/* Take all bits up to the first undecided run */
+			if (m)
+				end = s + __builtin_clzll(m) - 1;
+			else
+				end = s + v - 1;
+			n = end - p + 1;
+			if (n <= 0)
+				break;
+			if (f.inframe) {
+				w <<= p - s;
+				if (n > 32) {
+					dec_put(&f, w, 32);
+					w <<= 32;
+					dec_put(&f, w, n - 32);
+				} else {
+					dec_put(&f, w, n);
+				}
+			}
+			p = end + 1;
+			continue;
+		}
+		/* The first run of five ones ends at line bit t, bit n of w */
+		n = 63 - __builtin_clzll(decided);
+		t = s + 63 - n;
+		next = w << (63 - n + 1);
+		if (f.inframe) {
+			w <<= p - s;
+			bits = t - p + 1;
+			if (bits > 32) {
+				dec_put(&f, w, 32);
+				w <<= 32;
+				dec_put(&f, w, bits - 32);
+			} else {
+				dec_put(&f, w, bits);
+			}
+		}
+		if (!(next >> 63)) {
+			/* A stuffed zero */
+			p = t + 2;
+		} else if (!(next >> 62 & 1)) {
+			/* A flag: its 0 and five ones went in as data */
+			if (f.inframe) {
+				bits = (long)f.len * 8 + f.nacc - 6;
+				if (f.toolong || (bits > 0 && bits % 8)) {
+					errors++;
+				} else if (bits > 0) {
+					frame(arg, buf, bits / 8);
+				}
+			}
+			f.inframe = 1;
+			f.len = 0;
+			f.acc = 0;
+			f.nacc = 0;
+			f.toolong = 0;
+			p = t + 3;
+		} else {
+			/* Seven ones: an abort, or the line is idle */
+			if (f.inframe && (f.len || f.nacc > 6))
+				errors++;
+			f.inframe = 0;
+			p = t + 3;
+		}
+	}
+	return errors;
+}
@@ -0,0 +1,58 @@
+/*
+ * hdlc_bits.h -- HDLC bit stuffing and unstuffing a word at a time
+ *
+ * Works on the same line format as fasthdlc: data bytes go least
+ * significant bit first, and each line byte is sent most significant bit
+ * first. Rather than going through the bits (or table entries) one byte
+ * at a time, a 64 bit window is searched for runs of five ones, and the
+ * bits between them are copied in one go. Call hdlc_bits_init() once
+ * before anything else.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef HDLC_BITS_H
+#define HDLC_BITS_H
+
+#include <stdint.h>
+
+struct hdlc_enc {
+	unsigned char *out;
+	int len;		/* bytes written to out */
+	int max;
+	int overflow;		/* out was too small */
+	uint64_t acc;		/* bits not written yet, first in bit 63 */
+	int nacc;
+	int ones;		/* ones at the end of what was sent */
+};
+
+void hdlc_bits_init(void);
+
+void hdlc_enc_init(struct hdlc_enc *enc, unsigned char *out, int max);
+void hdlc_enc_flag(struct hdlc_enc *enc);
+/* Frame data, stuffed; the caller adds the FCS and the flags */
+void hdlc_enc_data(struct hdlc_enc *enc, const unsigned char *buf, int len);
+/* Pad the last line byte with zeros; returns the bytes written */
+int hdlc_enc_finish(struct hdlc_enc *enc);
+
+/*
+ * Decode a whole buffer of line bytes, calling frame() for each frame
+ * between two flags (with its FCS, which is not checked). Frames that
+ * are aborted, too long for the buffer or not a whole number of bytes
+ * are dropped and counted in the return value.
+ */
+int hdlc_decode(const unsigned char *in, int len, unsigned char *buf, int max,
+		void (*frame)(void *arg, const unsigned char *buf, int len), void *arg);
+
+#endif
@@ -36,6 +36,7 @@
 #include <dahdi/fasthdlc.h>
 
 #include "dahdi_tools_version.h"
+#include "fcs.h"
 
 #define RANDOM "/dev/urandom"			/* Not genuinely random */
 /* #define RANDOM "/dev/random" */		/* Quite genuinely random */
@@ -66,9 +67,11 @@ int main(int argc, char *argv[])
 	int hdlccnt;
 	int x;
 	int flags;
+	unsigned int fcs;
 	struct fasthdlc_state transmitter;
 	
 	fasthdlc_precalc();
+	fcs_init();
 	
 	fasthdlc_init(&transmitter, FASTHDLC_MODE_64);
 	
@@ -105,7 +108,11 @@ int main(int argc, char *argv[])
 		fasthdlc_tx_frame(&transmitter);
 		if (transmitter.bits >= 8)
 			outbuf[hdlccnt++] = fasthdlc_tx_run(&transmitter);
-		for (x=0;x<cnt;x++) {
+		/* The frame check sequence follows the data, low byte first */
+		fcs = fcs16(FCS16_INIT, buf, cnt) ^ 0xffff;
+		buf[cnt] = fcs & 0xff;
+		buf[cnt + 1] = fcs >> 8;
+		for (x=0;x<cnt + 2;x++) {
 			res = fasthdlc_tx_load(&transmitter, buf[x]);
 			if (res < 0) {
 				fprintf(stderr, "Unable to load byte :(\n");
@@ -36,13 +36,17 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
 #include <dahdi/user.h>
 
 #define FAST_HDLC_NEED_TABLES
 #include <dahdi/fasthdlc.h>
 
 #include "bittest.h"
-
+#include "fcs.h"
+#include "timing_hist.h"
 
 #include "dahdi_tools_version.h"
 
@@ -51,47 +55,7 @@
 
 static int hdlcmode = 0;
 static int bri_delay = 0;
-
-
-static unsigned short fcstab[256] =
-{
-	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
-
-#define PPP_INITFCS	0xffff	/* Initial FCS value */
-#define PPP_GOODFCS	0xf0b8	/* Good final FCS value */
-#define PPP_FCS(fcs, c)	(((fcs) >> 8) ^ fcstab[((fcs) ^ (c)) & 0xff])
+static int fcs32mode = 0;
 
 void print_packet(unsigned char *buf, int len)
 {
@@ -110,29 +74,33 @@ void send_packet(unsigned char *buf, int len)
 	int x;
 	unsigned char outbuf[BLOCK_SIZE];
 	int pos=0;
-	unsigned int fcs = PPP_INITFCS;
+	int fcslen;
+	uint32_t fcs;
 	if (hdlcmode)
 		write(fd, buf, len + 2);
 	else {
+		if (fcs32mode) {
+			fcs = fcs32(FCS32_INIT, buf, len) ^ 0xffffffff;
+			fcslen = 4;
+		} else {
+			fcs = fcs16(FCS16_INIT, buf, len) ^ 0xffff;
+			fcslen = 2;
+		}
 		for (x=0;x<len;x++) {
 			if (fasthdlc_tx_load(&fs, buf[x]))
 				printf("Load error\n");
-			fcs = PPP_FCS(fcs, buf[x]);
 			outbuf[pos++] = fasthdlc_tx_run(&fs);
 			if (fs.bits > 7)
 				outbuf[pos++] = fasthdlc_tx_run(&fs);
 		}
-		fcs ^= 0xffff;
-		if (fasthdlc_tx_load(&fs, (fcs & 0xff)))
-			fprintf(stderr, "Load error (fcs1)\n");
-		outbuf[pos++] = fasthdlc_tx_run(&fs);
-		if (fs.bits > 7)
-			outbuf[pos++] = fasthdlc_tx_run(&fs);
-		if (fasthdlc_tx_load(&fs, ((fcs >> 8) & 0xff)))
-			fprintf(stderr, "Load error (fcs2)\n");
-		outbuf[pos++] = fasthdlc_tx_run(&fs);
-		if (fs.bits > 7)
+		/* The FCS goes least significant byte first */
+		for (x=0;x<fcslen;x++) {
+			if (fasthdlc_tx_load(&fs, (fcs >> (x * 8)) & 0xff))
+				fprintf(stderr, "Load error (fcs%d)\n", x + 1);
 			outbuf[pos++] = fasthdlc_tx_run(&fs);
+			if (fs.bits > 7)
+				outbuf[pos++] = fasthdlc_tx_run(&fs);
+		}
 		if (fasthdlc_tx_frame(&fs))
 			fprintf(stderr, "Frame error\n");
 		if (fs.bits > 7)
@@ -143,6 +111,439 @@ void send_packet(unsigned char *buf, int len)
 	}
 }
 
+/*
+ * Load mode (-c): every listed channel sends numbered, timestamped frames
+ * through the kernel HDLC path, and gets them back over a loopback. Each
+ * channel runs on its own, through non-blocking I/O and a single epoll
+ * loop, so loss and one-way latency are measured per channel.
+ */
+#define LOAD_MAGIC	0x4853		/* "HS" */
+#define LOAD_HEADER	16		/* magic, channel, sequence, send time */
+#define LOAD_DRAIN	1000000000ULL	/* ns to wait for the last frames */
+#define MAX_EVENTS	64
+
+struct load_chan {
+	int fd;
+	int channo;
+	uint32_t tx_seq;
+	uint32_t rx_next;
+	uint64_t next_send;	/* ns, with a frame rate */
+	unsigned long long tx_frames;
+	unsigned long long tx_bytes;
+	unsigned long long tx_blocked;	/* writes refused, all buffers full */
+	unsigned long long rx_frames;
+	unsigned long long rx_bytes;
+	unsigned long long lost;
+	unsigned long long late;	/* came after a later frame */
+	unsigned long long bad;		/* short, foreign or corrupted frames */
+	unsigned long badfcs;
+	unsigned long aborts;
+	unsigned long overruns;
+	unsigned long events;
+	struct timing_hist latency;
+};
+
+static struct load_chan *load_chans;
+static int load_numchans;
+static int load_min = 50;
+static int load_max = 50;
+static int load_rate;		/* frames/s per channel; 0: as fast as possible */
+static int load_numbufs = 4;
+static volatile int load_run = 1;
+
+static void load_stop(int sig)
+{
+	load_run = 0;
+}
+
+static uint64_t load_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int add_load_chans(int start, int finish)
+{
+	int chan;
+
+	load_chans = realloc(load_chans, (load_numchans + finish - start + 1) * sizeof(*load_chans));
+	if (!load_chans) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (chan = start; chan <= finish; chan++) {
+		memset(&load_chans[load_numchans], 0, sizeof(*load_chans));
+		load_chans[load_numchans++].channo = chan;
+	}
+	return 0;
+}
+
+/* Parse a channel list such as "1-23,25-47" */
+static int parse_chanlist(const char *list)
+{
+	char *copy, *tok, *saveptr;
+	int start, finish;
+	int res = 0;
+
+	copy = strdup(list);
+	if (!copy)
+		return -1;
+	for (tok = strtok_r(copy, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (sscanf(tok, "%d-%d", &start, &finish) == 2) {
+			/* range */
+		} else if (sscanf(tok, "%d", &start) == 1) {
+			finish = start;
+		} else {
+			fprintf(stderr, "Bad channel list item '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		if (start < 1 || finish < start) {
+			fprintf(stderr, "Bad channel range '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		if ((res = add_load_chans(start, finish)))
+			break;
+	}
+	free(copy);
+	return res;
+}
+
+/* Frame size: "SIZE", or "MIN-MAX" for sizes spread evenly between */
+static int parse_sizes(const char *arg)
+{
+	if (sscanf(arg, "%d-%d", &load_min, &load_max) != 2) {
+		if (sscanf(arg, "%d", &load_min) != 1)
+			return -1;
+		load_max = load_min;
+	}
+	if (load_min < LOAD_HEADER || load_max < load_min ||
+	    load_max > BLOCK_SIZE - 2) {
+		fprintf(stderr, "Frame sizes must be %d-%d bytes\n",
+			LOAD_HEADER, BLOCK_SIZE - 2);
+		return -1;
+	}
+	return 0;
+}
+
+static void put_le(unsigned char *p, uint64_t val, int bytes)
+{
+	int x;
+
+	for (x = 0; x < bytes; x++)
+		p[x] = val >> (x * 8);
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+	uint64_t val = 0;
+	int x;
+
+	for (x = bytes - 1; x >= 0; x--)
+		val = (val << 8) | p[x];
+	return val;
+}
+
+static void load_event(struct load_chan *lc)
+{
+	int x;
+
+	if (ioctl(lc->fd, DAHDI_GETEVENT, &x) || !x)
+		return;
+	switch (x) {
+	case DAHDI_EVENT_BADFCS:
+		lc->badfcs++;
+		break;
+	case DAHDI_EVENT_ABORT:
+		lc->aborts++;
+		break;
+	case DAHDI_EVENT_OVERRUN:
+		lc->overruns++;
+		break;
+	default:
+		lc->events++;
+	}
+}
+
+/* Returns -1 if the channel can't take the frame now */
+static int load_send(struct load_chan *lc)
+{
+	unsigned char frame[BLOCK_SIZE];
+	int len, x, res;
+
+	len = load_min + (load_max > load_min ? rand() % (load_max - load_min + 1) : 0);
+	put_le(frame, LOAD_MAGIC, 2);
+	put_le(frame + 2, lc->channo, 2);
+	put_le(frame + 4, lc->tx_seq, 4);
+	put_le(frame + 8, load_now(), 8);
+	for (x = LOAD_HEADER; x < len; x++)
+		frame[x] = lc->tx_seq + x;
+	/* Room for the FCS, which DAHDI fills in */
+	res = write(lc->fd, frame, len + 2);
+	if (res < 0) {
+		if (errno == ELAST)
+			load_event(lc);
+		else
+			lc->tx_blocked++;
+		return -1;
+	}
+	lc->tx_seq++;
+	lc->tx_frames++;
+	lc->tx_bytes += len;
+	return 0;
+}
+
+static int load_check(struct load_chan *lc, const unsigned char *frame, int len)
+{
+	int x;
+
+	if (len < LOAD_HEADER || get_le(frame, 2) != LOAD_MAGIC ||
+	    get_le(frame + 2, 2) != lc->channo)
+		return -1;
+	for (x = LOAD_HEADER; x < len; x++) {
+		if (frame[x] != (unsigned char)(frame[4] + x))
+			return -1;
+	}
+	return 0;
+}
+
+static void load_recv(struct load_chan *lc)
+{
+	unsigned char frame[BLOCK_SIZE];
+	uint32_t seq;
+	uint64_t sent, now;
+	int res;
+
+	for (;;) {
+		res = read(lc->fd, frame, sizeof(frame));
+		if (res < 0) {
+			if (errno == ELAST) {
+				load_event(lc);
+				continue;
+			}
+			return;
+		}
+		now = load_now();
+		/* Leave out the FCS */
+		res -= 2;
+		if (load_check(lc, frame, res)) {
+			lc->bad++;
+			continue;
+		}
+		lc->rx_frames++;
+		lc->rx_bytes += res;
+		seq = get_le(frame + 4, 4);
+		sent = get_le(frame + 8, 8);
+		if (now > sent)
+			hist_add(&lc->latency, now - sent);
+		if ((int32_t)(seq - lc->rx_next) >= 0) {
+			lc->lost += seq - lc->rx_next;
+			lc->rx_next = seq + 1;
+		} else {
+			/* Counted as lost when a later one came */
+			lc->late++;
+			if (lc->lost)
+				lc->lost--;
+		}
+	}
+}
+
+static int load_open(struct load_chan *lc)
+{
+	struct dahdi_params tp;
+	struct dahdi_bufferinfo bi;
+	int bs = BLOCK_SIZE;
+	int x;
+
+	lc->fd = open("/dev/dahdi/channel", O_RDWR | O_NONBLOCK, 0600);
+	if (lc->fd < 0) {
+		perror("/dev/dahdi/channel");
+		return -1;
+	}
+	if (ioctl(lc->fd, DAHDI_SPECIFY, &lc->channo)) {
+		fprintf(stderr, "Unable to open channel %d: %s\n", lc->channo, strerror(errno));
+		return -1;
+	}
+	if (ioctl(lc->fd, DAHDI_SET_BLOCKSIZE, &bs)) {
+		fprintf(stderr, "Unable to set block size to %d: %s\n", bs, strerror(errno));
+		return -1;
+	}
+	if (ioctl(lc->fd, DAHDI_GET_PARAMS, &tp)) {
+		fprintf(stderr, "Unable to get channel parameters\n");
+		return -1;
+	}
+	if ((tp.sigtype & DAHDI_SIG_HDLCFCS) != DAHDI_SIG_HDLCFCS) {
+		fprintf(stderr, "Channel %d is not in HDLC (FCS) mode\n", lc->channo);
+		return -1;
+	}
+	if (ioctl(lc->fd, DAHDI_GET_BUFINFO, &bi)) {
+		fprintf(stderr, "Unable to get buf info: %s\n", strerror(errno));
+		return -1;
+	}
+	bi.txbufpolicy = DAHDI_POLICY_IMMEDIATE;
+	bi.rxbufpolicy = DAHDI_POLICY_IMMEDIATE;
+	bi.numbufs = load_numbufs;
+	if (ioctl(lc->fd, DAHDI_SET_BUFINFO, &bi)) {
+		fprintf(stderr, "Unable to set buf info: %s\n", strerror(errno));
+		return -1;
+	}
+	x = DAHDI_FLUSH_ALL;
+	ioctl(lc->fd, DAHDI_FLUSH, &x);
+	ioctl(lc->fd, DAHDI_GETEVENT, &x);
+	return 0;
+}
+
+static void load_report_line(const char *label, const struct load_chan *lc)
+{
+	const struct timing_hist *h = &lc->latency;
+
+	printf("%-8s %10llu %10llu %8llu %6llu %6llu %6lu %6lu %6lu %8llu %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+	       label, lc->tx_frames, lc->rx_frames, lc->lost, lc->late, lc->bad,
+	       lc->badfcs, lc->aborts, lc->overruns, lc->tx_blocked,
+	       hist_percentile(h, 50) / 1e6, hist_percentile(h, 90) / 1e6,
+	       hist_percentile(h, 99) / 1e6, hist_percentile(h, 99.9) / 1e6,
+	       h->max / 1e6);
+}
+
+static int load_test(int duration)
+{
+	static struct load_chan total;
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct load_chan *lc;
+	uint64_t start, now, end, interval = 0, next;
+	double secs = 0;
+	int draining = 0;
+	int epfd, timeout;
+	int i, n;
+
+	epfd = epoll_create(load_numchans);
+	if (epfd < 0) {
+		perror("epoll_create");
+		return -1;
+	}
+	if (load_rate)
+		interval = 1000000000ULL / load_rate;
+	for (i = 0; i < load_numchans; i++) {
+		lc = &load_chans[i];
+		if (load_open(lc))
+			return -1;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLPRI | (load_rate ? 0 : EPOLLOUT);
+		ev.data.u32 = i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, lc->fd, &ev)) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	signal(SIGINT, load_stop);
+	printf("Loading %d channels with %d", load_numchans, load_min);
+	if (load_max > load_min)
+		printf("-%d", load_max);
+	printf(" byte frames, ");
+	if (load_rate)
+		printf("%d per second each", load_rate);
+	else
+		printf("as fast as they go");
+	printf(", for %d seconds\n", duration);
+
+	start = load_now();
+	end = start + duration * 1000000000ULL;
+	/* Spread the channels over the first interval */
+	for (i = 0; i < load_numchans; i++)
+		load_chans[i].next_send = start + interval * i / load_numchans;
+	for (;;) {
+		now = load_now();
+		if (!draining && (!load_run || now >= end)) {
+			/* Stop sending; wait a bit for what is on its way */
+			draining = 1;
+			secs = (now - start) / 1e9;
+			end = now + LOAD_DRAIN;
+			for (i = 0; i < load_numchans && !load_rate; i++) {
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN | EPOLLPRI;
+				ev.data.u32 = i;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, load_chans[i].fd, &ev);
+			}
+		} else if (draining && now >= end) {
+			break;
+		}
+		timeout = 100;
+		if (!draining && load_rate) {
+			next = end;
+			for (i = 0; i < load_numchans; i++) {
+				lc = &load_chans[i];
+				/* Don't make up for more than a second of backlog */
+				if (now > lc->next_send && now - lc->next_send > 1000000000ULL)
+					lc->next_send = now;
+				while (lc->next_send <= now && !load_send(lc))
+					lc->next_send += interval;
+				if (lc->next_send < next)
+					next = lc->next_send;
+			}
+			if (next > now)
+				timeout = (next - now + 999999) / 1000000;
+			else
+				timeout = 1;
+			if (timeout > 100)
+				timeout = 100;
+		}
+		n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			lc = &load_chans[events[i].data.u32];
+			if (events[i].events & EPOLLPRI)
+				load_event(lc);
+			if ((events[i].events & EPOLLOUT) && !draining)
+				while (!load_send(lc))
+					;
+			if (events[i].events & EPOLLIN)
+				load_recv(lc);
+		}
+	}
+
+	printf("%-8s %10s %10s %8s %6s %6s %6s %6s %6s %8s %8s %8s %8s %8s %8s\n",
+	       "", "tx frames", "rx frames", "lost", "late", "bad", "badfcs",
+	       "abort", "ovrrun", "blocked", "p50 ms", "p90 ms", "p99 ms",
+	       "p99.9 ms", "max ms");
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < load_numchans; i++) {
+		char label[16];
+
+		lc = &load_chans[i];
+		/* Whatever has not come back by now is lost */
+		lc->lost += lc->tx_seq - lc->rx_next;
+		snprintf(label, sizeof(label), "chan %d", lc->channo);
+		load_report_line(label, lc);
+		total.tx_frames += lc->tx_frames;
+		total.tx_bytes += lc->tx_bytes;
+		total.tx_blocked += lc->tx_blocked;
+		total.rx_frames += lc->rx_frames;
+		total.rx_bytes += lc->rx_bytes;
+		total.lost += lc->lost;
+		total.late += lc->late;
+		total.bad += lc->bad;
+		total.badfcs += lc->badfcs;
+		total.aborts += lc->aborts;
+		total.overruns += lc->overruns;
+		hist_merge(&total.latency, &lc->latency);
+		close(lc->fd);
+	}
+	load_report_line("total", &total);
+	if (secs > 0)
+		printf("%.1f kbit/s of frames sent, %.1f kbit/s received, over %.1f seconds\n",
+		       total.tx_bytes * 8 / secs / 1000, total.rx_bytes * 8 / secs / 1000, secs);
+	close(epfd);
+	return (total.lost || total.bad || total.badfcs || total.aborts) ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int res, ch, x;
@@ -152,15 +553,42 @@ int main(int argc, char *argv[])
 	unsigned char c=0;
 	unsigned char outbuf[BLOCK_SIZE];
 
-	while((ch = getopt(argc, argv, "b")) != -1) {
+	int duration = 10;
+
+	while((ch = getopt(argc, argv, "b3c:s:r:t:n:")) != -1) {
 		switch(ch) {
 			case 'b': bri_delay = 300000; break;
+			case '3': fcs32mode = 1; break;
+			case 'c':
+				if (parse_chanlist(optarg))
+					exit(1);
+				break;
+			case 's':
+				if (parse_sizes(optarg))
+					exit(1);
+				break;
+			case 'r': load_rate = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'n': load_numbufs = atoi(optarg); break;
 			case '?': exit(1);
 		}
 	}
 
+	if (load_numchans) {
+		srand(time(NULL));
+		res = load_test(duration);
+		exit(res < 0 ? 2 : res);
+	}
+
 	if (argc - optind != 1) {
-		fprintf(stderr, "Usage: %s [-b] <DAHDI device>\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-b] [-3] <DAHDI device>\n", argv[0]);
+		fprintf(stderr, "       %s -c <channels> [-s SIZE|MIN-MAX] [-r RATE] [-t SECS] [-n BUFS]\n", argv[0]);
+		fprintf(stderr, "   -3: 32 bit FCS (clear channels only)\n");
+		fprintf(stderr, "   -c: load test HDLC channels such as 1-23,25-47, each looped back\n");
+		fprintf(stderr, "   -s: frame size, or range of sizes (default 50)\n");
+		fprintf(stderr, "   -r: frames per second per channel (default: as fast as possible)\n");
+		fprintf(stderr, "   -t: seconds to send for (default 10)\n");
+		fprintf(stderr, "   -n: kernel buffers per channel (default 4)\n");
 		exit(1);
 	}
 	fd = open(argv[optind], O_RDWR, 0600);
@@ -186,6 +614,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Not in a reasonable mode\n");
 		exit(1);
 	}
+	if (hdlcmode && fcs32mode) {
+		fprintf(stderr, "DAHDI adds a 16 bit FCS in HDLC mode\n");
+		exit(1);
+	}
 	res = ioctl(fd, DAHDI_GET_BUFINFO, &bi);
 	if (!res) {
 		bi.txbufpolicy = DAHDI_POLICY_IMMEDIATE;
@@ -203,10 +635,11 @@ int main(int argc, char *argv[])
 	ioctl(fd, DAHDI_GETEVENT);
 	fasthdlc_precalc();
 	fasthdlc_init(&fs, FASTHDLC_MODE_64);
+	fcs_init();
 #if 0
 	print_packet(outbuf, res);
-	printf("FCS is %x, PPP_GOODFCS is %x\n",
-	fcs,PPP_GOODFCS);
+	printf("FCS is %x, FCS16_GOOD is %x\n",
+	fcs,FCS16_GOOD);
 #endif
 	for(;;) {
 		if (c < 1)
@@ -36,6 +36,7 @@
 #include <dahdi/fasthdlc.h>
 
 #include "dahdi_tools_version.h"
+#include "fcs.h"
 
 int myread(int fd, unsigned char *buf, int len)
 {
@@ -83,6 +84,7 @@ int main(int argc, char *argv[])
 	struct fasthdlc_state receiver;
 	
 	fasthdlc_precalc();
+	fcs_init();
 	
 	fasthdlc_init(&receiver, FASTHDLC_MODE_64);
 	
@@ -108,6 +110,12 @@ int main(int argc, char *argv[])
 			continue;
 		if (res & RETURN_COMPLETE_FLAG) {
 			if (hdlccnt) {
+				if (hdlccnt < 2 || fcs16(FCS16_INIT, decbuf, hdlccnt) != FCS16_GOOD) {
+					fprintf(stderr, "Bad FCS on message of length %d\n", hdlccnt);
+					exit(1);
+				}
+				/* Leave out the frame check sequence */
+				hdlccnt -= 2;
 				if (argc > 1)
 					printf("Got message of length %d\n", hdlccnt);
 				res = myread(datain, actual, hdlccnt);
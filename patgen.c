@@ -36,7 +36,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include "bittest.h"
+#include "pattern.h"
 
 #include <dahdi/user.h>
 #include "dahdi_tools_version.h"
@@ -49,9 +49,10 @@ char			*prog_name;
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: %s <dahdi_chan>\n", prog_name);
+	fprintf(stderr, "Usage: %s [-p PATTERN] <dahdi_chan>\n", prog_name);
 	fprintf(stderr, "   e.g.: %s /dev/dahdi/55\n", prog_name);
-	fprintf(stderr, "         %s 455\n", prog_name);
+	fprintf(stderr, "         %s -p prbs15 455\n", prog_name);
+	fprintf(stderr, "   -p PATTERN: count (default), prbs15 or prbs23\n");
 	exit(1);
 }
 
@@ -113,21 +114,37 @@ int channel_open(const char *name, int *bs)
 int main(int argc, char *argv[])
 {
 	int fd;
-	int res, res1, x;
+	int res, res1;
 	int bs = BLOCK_SIZE;
-	unsigned char c=0;
 	unsigned char outbuf[BLOCK_SIZE];
+	enum pattern_type pattern = PATTERN_COUNT;
+	struct pattern_gen gen;
+	int opt;
 
 	prog_name = argv[0];
 
-	if (argc < 2) {
+	while ((opt = getopt(argc, argv, "p:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (pattern_parse(optarg, &pattern)) {
+				fprintf(stderr, "Unknown pattern '%s'\n", optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc) {
 		usage();
 	}
 
-	fd = channel_open(argv[1], &bs);
+	fd = channel_open(argv[optind], &bs);
 	if (fd < 0)
 		exit(1);
 
+	pattern_gen_init(&gen, pattern);
 	ioctl(fd, DAHDI_GETEVENT);
 #if 0
 	print_packet(outbuf, res);
@@ -136,10 +153,7 @@ int main(int argc, char *argv[])
 #endif
 	for(;;) {
 		res = bs;
-		for (x=0;x<bs;x++) {
-			outbuf[x] = c;
-			c = bit_next(c);
-		}
+		pattern_fill(&gen, outbuf, bs);
 		res1 = write(fd, outbuf, res);
 		if (res1 < res) {
 			int e;
@@ -26,11 +26,11 @@
  */
 
 /*
- *	This test sends a set of incrementing byte values out the specified
- * dadhi device.  The device is then read back and the read back characters
- * are verified that they increment as well.
- * 	If there is a break in the incrementing pattern, an error is flagged 
- * and the comparison starts at the last value read. 
+ *	This test sends a test pattern (incrementing byte values, or a PRBS
+ * with -p) out the specified dadhi device.  The device is then read back
+ * and the read back characters are verified to follow the same pattern.
+ * 	Each corrupted byte is flagged as an error with its bit errors; if
+ * the pattern is lost (a slip), that is flagged and it is found again.
  */
 
 #include <stdio.h>
@@ -43,9 +43,12 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
 
 #include <dahdi/user.h>
 #include "dahdi_tools_version.h"
+#include "pattern.h"
 
 #define BLOCK_SIZE	2039
 #define DEVICE	"/dev/dahdi/channel"
@@ -89,13 +92,20 @@ static void show_error_context(unsigned char *buf, int offset, int bufsize)
 static void usage(const char * progname)
 {
 	printf("%s: Pattern loop test\n", progname);
-	printf("Usage:  %s <dahdi device> [-t <secs>] [-r <count>] [-b <count>] [-vh?] \n", progname);
+	printf("Usage:  %s <dahdi device> [-t <secs>] [-r <count>] [-b <count>] [-p <pattern>] [-F <format>] [-o <file>] [-vh?] \n", progname);
+	printf("        %s <-c <channels> | -S <span>>... [-t <secs>] [-r <secs>] [-s <count>] [-p <pattern>] [-F <format>] [-o <file>] [-v]\n", progname);
 	printf("\t-? - Print this usage summary\n");
 	printf("\t-t <secs> - # of seconds for the test to run\n");
 	printf("\t-r <count> - # of test loops to run before a summary is printed\n");
 	printf("\t-s <count> - # of writes to skip before testing for results\n");
 	printf("\t-v - Verbosity (repetitive v's add to the verbosity level e.g. -vvvv)\n");
 	printf("\t-b <# buffer bytes> - # of bytes to display from buffers on each pass\n");
+	printf("\t-p <pattern> - count (default), prbs15 or prbs23\n");
+	printf("\t-F <csv|json> - write ES/SES/UAS/BER statistics every second\n");
+	printf("\t-o <file> - write the statistics to a file rather than stdout\n");
+	printf("\t-c <channels> - test all channels in a list such as 1-23,25-47 at once\n");
+	printf("\t-S <span> - test all channels of a span at once; may be repeated\n");
+	printf("\t   With -c or -S, -r gives the seconds between reports (per channel with -v)\n");
 	printf("\n\t Also accepts old style usage:\n\t  %s <device name> [<timeout in secs>]\n", progname);
 }
 
@@ -145,6 +155,376 @@ int channel_open(const char *name, int *bs)
 	return fd;
 }
 
+/*
+ * Multi-channel mode: every channel runs its own loop through
+ * non-blocking I/O and a single epoll loop. The pattern checker counts
+ * the bit errors of corrupted bytes, and tells them apart from a slip,
+ * which makes it lose and find sync again.
+ */
+#define MAX_EVENTS	64
+
+struct loop_chan {
+	int fd;
+	int channo;
+	int spanno;
+	int skip;		/* reads to throw away before checking */
+	struct pattern_gen gen;
+	struct pattern_check chk;
+	struct pattern_stats stats;
+	unsigned char out[BLOCK_SIZE];
+	int out_len;		/* bytes of out not written yet */
+	/* counters */
+	unsigned long long tx_bytes;
+	unsigned long long rx_bytes;
+	unsigned long events;
+};
+
+static enum pattern_type loop_pattern = PATTERN_COUNT;
+static enum pattern_format loop_format = PATTERN_FORMAT_NONE;
+static FILE *loop_out;
+static struct loop_chan *loop_chans;
+static int loop_numchans;
+static volatile int loop_run = 1;
+
+static void loop_stop(int sig)
+{
+	loop_run = 0;
+}
+
+static int add_loop_chans(int start, int finish)
+{
+	int chan;
+
+	loop_chans = realloc(loop_chans, (loop_numchans + finish - start + 1) * sizeof(*loop_chans));
+	if (!loop_chans) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (chan = start; chan <= finish; chan++) {
+		memset(&loop_chans[loop_numchans], 0, sizeof(*loop_chans));
+		loop_chans[loop_numchans++].channo = chan;
+	}
+	return 0;
+}
+
+/* Parse a channel list such as "1-23,25-47" */
+static int parse_chanlist(const char *list)
+{
+	char *copy, *tok, *saveptr;
+	int start, finish;
+	int res = 0;
+
+	copy = strdup(list);
+	if (!copy)
+		return -1;
+	for (tok = strtok_r(copy, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (sscanf(tok, "%d-%d", &start, &finish) == 2) {
+			/* range */
+		} else if (sscanf(tok, "%d", &start) == 1) {
+			finish = start;
+		} else {
+			fprintf(stderr, "Bad channel list item '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		if (start < 1 || finish < start) {
+			fprintf(stderr, "Bad channel range '%s'\n", tok);
+			res = -1;
+			break;
+		}
+		if ((res = add_loop_chans(start, finish)))
+			break;
+	}
+	free(copy);
+	return res;
+}
+
+static int get_basechan(unsigned int spanno)
+{
+	int res;
+	int basechan;
+	char filename[256];
+	FILE *fp;
+
+	snprintf(filename, sizeof(filename),
+		 "/sys/bus/dahdi_spans/devices/span-%u/basechan", spanno);
+	fp = fopen(filename, "r");
+	if (NULL == fp) {
+		return -1;
+	}
+	res = fscanf(fp, "%d", &basechan);
+	fclose(fp);
+	if (EOF == res) {
+		return -1;
+	}
+	return basechan;
+}
+
+/* Add all the channels of a span */
+static int add_span(int spanno)
+{
+	struct dahdi_spaninfo s;
+	struct dahdi_spaninfo prev;
+	int basechan;
+	int fd;
+	int x;
+
+	fd = open("/dev/dahdi/ctl", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/dahdi/ctl");
+		return -1;
+	}
+	memset(&s, 0, sizeof(s));
+	s.spanno = spanno;
+	if (ioctl(fd, DAHDI_SPANSTAT, &s)) {
+		fprintf(stderr, "Unable to get span %d: %s\n", spanno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	basechan = get_basechan(spanno);
+	if (basechan < 0) {
+		/* Older kernels: spans are numbered consecutively */
+		basechan = 1;
+		for (x = 1; x < spanno; x++) {
+			memset(&prev, 0, sizeof(prev));
+			prev.spanno = x;
+			if (!ioctl(fd, DAHDI_SPANSTAT, &prev))
+				basechan += prev.totalchans;
+		}
+	}
+	close(fd);
+	if (s.totalchans < 1) {
+		fprintf(stderr, "Span %d has no channels\n", spanno);
+		return -1;
+	}
+	return add_loop_chans(basechan, basechan + s.totalchans - 1);
+}
+
+static void loop_event(struct loop_chan *lc)
+{
+	int x;
+
+	if (ioctl(lc->fd, DAHDI_GETEVENT, &x) == 0 && x)
+		lc->events++;
+}
+
+static void loop_write(struct loop_chan *lc, int bs)
+{
+	int res;
+
+	/* What a short write left over goes first, so the pattern goes on */
+	if (!lc->out_len) {
+		pattern_fill(&lc->gen, lc->out, bs);
+		lc->out_len = bs;
+	}
+	res = write(lc->fd, lc->out + bs - lc->out_len, lc->out_len);
+	if (res < 0) {
+		if (errno == ELAST)
+			loop_event(lc);
+		return;
+	}
+	lc->out_len -= res;
+	lc->tx_bytes += res;
+}
+
+static void loop_read(struct loop_chan *lc, int bs)
+{
+	unsigned char inbuf[BLOCK_SIZE];
+	int res;
+
+	res = read(lc->fd, inbuf, bs);
+	if (res < 0) {
+		if (errno == ELAST)
+			loop_event(lc);
+		return;
+	}
+	if (lc->skip) {
+		lc->skip--;
+		return;
+	}
+	pattern_check_buf(&lc->chk, inbuf, res);
+	lc->rx_bytes += res;
+}
+
+/* The BER only counts the bytes checked while in sync */
+static void loop_report_line(const char *label, unsigned long long rx_bytes,
+			     const struct pattern_check *chk,
+			     unsigned long events, double secs)
+{
+	printf("%-10s %12llu %9.1f %10llu %10llu %7llu %7lu %10.3e\n",
+	       label, rx_bytes, secs > 0 ? rx_bytes * 8 / secs / 1000 : 0.0,
+	       (unsigned long long)chk->bit_errors,
+	       (unsigned long long)chk->errored_bytes,
+	       (unsigned long long)chk->resyncs, events,
+	       chk->bytes ? (double)chk->bit_errors / (chk->bytes * 8) : 0.0);
+}
+
+/* Per channel lines (with -v), then one line per span */
+static unsigned long long loop_report(int verbose, double secs)
+{
+	struct loop_chan *lc;
+	struct pattern_check sum;
+	unsigned long long rx, total_errors = 0;
+	unsigned long events;
+	char label[32];
+	int i, j, spanno;
+
+	printf("%-10s %12s %9s %10s %10s %7s %7s %10s\n", "", "rx bytes", "kbit/s",
+	       "bit errs", "err bytes", "resyncs", "events", "BER");
+	for (i = 0; i < loop_numchans; i++) {
+		lc = &loop_chans[i];
+		total_errors += lc->chk.bit_errors + lc->chk.resyncs;
+		if (!lc->chk.locked && !lc->chk.bytes)
+			total_errors++;	/* never found the pattern */
+		if (!verbose)
+			continue;
+		snprintf(label, sizeof(label), "chan %d", lc->channo);
+		loop_report_line(label, lc->rx_bytes, &lc->chk, lc->events, secs);
+	}
+	for (i = 0; i < loop_numchans; i++) {
+		spanno = loop_chans[i].spanno;
+		/* each span once, at its first channel */
+		for (j = 0; j < i; j++) {
+			if (loop_chans[j].spanno == spanno)
+				break;
+		}
+		if (j < i)
+			continue;
+		memset(&sum, 0, sizeof(sum));
+		rx = 0;
+		events = 0;
+		for (j = i; j < loop_numchans; j++) {
+			lc = &loop_chans[j];
+			if (lc->spanno != spanno)
+				continue;
+			rx += lc->rx_bytes;
+			sum.bytes += lc->chk.bytes;
+			sum.bit_errors += lc->chk.bit_errors;
+			sum.errored_bytes += lc->chk.errored_bytes;
+			sum.resyncs += lc->chk.resyncs;
+			events += lc->events;
+		}
+		snprintf(label, sizeof(label), "span %d", spanno);
+		loop_report_line(label, rx, &sum, events, secs);
+	}
+	return total_errors;
+}
+
+/* Close a second on every channel */
+static void loop_second(void)
+{
+	struct loop_chan *lc;
+	time_t t = time(NULL);
+	int i;
+
+	for (i = 0; i < loop_numchans; i++) {
+		lc = &loop_chans[i];
+		/* The skipped reads are not part of the test */
+		if (lc->skip) {
+			pattern_stats_init(&lc->stats, &lc->chk);
+			continue;
+		}
+		pattern_stats_second(&lc->stats, &lc->chk);
+		if (loop_format != PATTERN_FORMAT_NONE)
+			pattern_stats_print(loop_out, loop_format, t, lc->channo, &lc->stats);
+	}
+}
+
+static int loop_multi(int bs, int skipcount, int timeout, int report_secs, int verbose)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct dahdi_params tp;
+	struct loop_chan *lc;
+	struct timespec start, now, last_report;
+	time_t next_second;
+	char name[16];
+	double secs;
+	int epfd;
+	int i, n;
+
+	epfd = epoll_create(loop_numchans);
+	if (epfd < 0) {
+		perror("epoll_create");
+		return -1;
+	}
+	for (i = 0; i < loop_numchans; i++) {
+		lc = &loop_chans[i];
+		snprintf(name, sizeof(name), "%d", lc->channo);
+		lc->fd = channel_open(name, &bs);
+		if (lc->fd < 0)
+			return -1;
+		memset(&tp, 0, sizeof(tp));
+		if (ioctl(lc->fd, DAHDI_GET_PARAMS, &tp) == 0)
+			lc->spanno = tp.spanno;
+		ioctl(lc->fd, DAHDI_GETEVENT);
+		n = DAHDI_FLUSH_ALL;
+		if (ioctl(lc->fd, DAHDI_FLUSH, &n) == -1) {
+			perror("DAHDI_FLUSH");
+			return -1;
+		}
+		fcntl(lc->fd, F_SETFL, fcntl(lc->fd, F_GETFL) | O_NONBLOCK);
+		lc->skip = skipcount;
+		pattern_gen_init(&lc->gen, loop_pattern);
+		pattern_check_init(&lc->chk, loop_pattern);
+		pattern_stats_init(&lc->stats, &lc->chk);
+		lc->out_len = 0;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLPRI;
+		ev.data.u32 = i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, lc->fd, &ev)) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	signal(SIGINT, loop_stop);
+	printf("Testing %d channels", loop_numchans);
+	if (timeout)
+		printf(" for %d seconds", timeout);
+	printf("\n");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_report = start;
+	next_second = start.tv_sec + 1;
+	pattern_stats_header(loop_out, loop_format);
+	while (loop_run) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			lc = &loop_chans[events[i].data.u32];
+			if (events[i].events & EPOLLPRI)
+				loop_event(lc);
+			if (events[i].events & EPOLLOUT)
+				loop_write(lc, bs);
+			if (events[i].events & EPOLLIN)
+				loop_read(lc, bs);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9;
+		while (now.tv_sec >= next_second) {
+			loop_second();
+			next_second++;
+		}
+		if (timeout && secs >= timeout)
+			break;
+		if (report_secs && now.tv_sec - last_report.tv_sec >= report_secs) {
+			last_report = now;
+			loop_report(verbose, secs);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Test ran %.1f seconds on %d channels\n", secs, loop_numchans);
+	for (i = 0; i < loop_numchans; i++)
+		close(loop_chans[i].fd);
+	close(epfd);
+	return loop_report(1, secs) ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int fd;
@@ -152,10 +532,12 @@ int main(int argc, char *argv[])
 	int i;
 	int bs = BLOCK_SIZE;
 	int skipcount = 10;
-	unsigned char c=0,c1=0;
+	unsigned char c;
 	unsigned char inbuf[BLOCK_SIZE];
 	unsigned char outbuf[BLOCK_SIZE];
-	int setup=0;
+	struct pattern_gen gen;
+	struct pattern_check chk;
+	int biterrs, locked=0;
 	unsigned long bytes=0;
 	int timeout=0;
 	int loop_errorcount;
@@ -167,11 +549,16 @@ int main(int argc, char *argv[])
 	char * device;
 	int opt;
 	int oldstyle_cmdline = 1;
+	const char *outname = NULL;
+	struct pattern_stats stats;
+	struct dahdi_params tp;
+	struct timespec now;
+	time_t next_second;
 	unsigned int event_count = 0;
 	time_t start_time = 0;
 
 	/* Parse the command line arguments */
-	while((opt = getopt(argc, argv, "b:s:t:r:v?h")) != -1) {
+	while((opt = getopt(argc, argv, "b:s:t:r:c:S:p:F:o:v?h")) != -1) {
 		switch(opt) {
 		case 'h':
 		case '?':
@@ -201,8 +588,49 @@ int main(int argc, char *argv[])
 			verbose++;
 			oldstyle_cmdline = 0;
 			break;
+		case 'c':
+			if (parse_chanlist(optarg))
+				exit(1);
+			break;
+		case 'S':
+			if (add_span(strtoul(optarg, NULL, 10)))
+				exit(1);
+			break;
+		case 'p':
+			if (pattern_parse(optarg, &loop_pattern)) {
+				fprintf(stderr, "Unknown pattern '%s'\n", optarg);
+				exit(1);
+			}
+			oldstyle_cmdline = 0;
+			break;
+		case 'F':
+			if (pattern_format_parse(optarg, &loop_format)) {
+				fprintf(stderr, "Unknown format '%s'\n", optarg);
+				exit(1);
+			}
+			oldstyle_cmdline = 0;
+			break;
+		case 'o':
+			outname = optarg;
+			oldstyle_cmdline = 0;
+			break;
+		}
+	}
+
+	loop_out = stdout;
+	if (outname) {
+		loop_out = fopen(outname, "a");
+		if (!loop_out) {
+			perror(outname);
+			exit(1);
 		}
 	}
+	setvbuf(loop_out, NULL, _IOLBF, 0);
+
+	if (loop_numchans) {
+		res = loop_multi(bs, skipcount, timeout, reportloops, verbose);
+		exit(res < 0 ? 255 : res);
+	}
 
 	/* If no device was specified */
 	if(NULL == argv[optind]) {
@@ -231,6 +659,15 @@ int main(int argc, char *argv[])
 		exit(255);
 	}
 
+	pattern_gen_init(&gen, loop_pattern);
+	pattern_check_init(&chk, loop_pattern);
+	pattern_stats_init(&stats, &chk);
+	pattern_stats_header(loop_out, loop_format);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next_second = now.tv_sec + 1;
+	memset(&tp, 0, sizeof(tp));
+	ioctl(fd, DAHDI_GET_PARAMS, &tp);
+
 	/* Mark time if program has a specified timeout */
 	if(0 < timeout){
 		start_time = time(NULL);
@@ -241,9 +678,7 @@ int main(int argc, char *argv[])
 	for(;;) {
 		/* Prep the data and write it out to dahdi device */
 		res = bs;
-		for (x = 0; x < bs; x++) {
-			outbuf[x] = c1++;
-		}
+		pattern_fill(&gen, outbuf, bs);
 
 write_again:
 		res = write(fd,outbuf,bs);
@@ -267,6 +702,8 @@ write_again:
 			skipcount--;
 			if (!skipcount) {
 				printf("Going for it...\n");
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				next_second = now.tv_sec + 1;
 			}
 			i = 1;
 			ioctl(fd,DAHDI_BUFFER_EVENTS, &i);
@@ -281,20 +718,30 @@ read_again:
 			printf("Event: %d\n", x);
 			goto read_again;
 		}
-		/* If first time through, set byte that is used to test further bytes */
-		if (!setup) {
-			c = inbuf[0];
-			setup++;
-		}
 		/* Test the packet read back for data pattern */
 		loop_errorcount = 0;
 		for (x = 0; x < bs; x++)  {
+			biterrs = pattern_check_byte(&chk, inbuf[x], &c);
+			/* Until in sync, or while finding it again after a slip */
+			if (biterrs == PATTERN_HUNTING) {
+				if (locked) {
+					total_errorcount++;
+					loop_errorcount++;
+					if (oldstyle_cmdline || 1 <= verbose)
+						printf("Lost %s sync, %ld bytes since last error.\n",
+							pattern_name(loop_pattern), bytes);
+					locked = 0;
+					bytes = 0;
+				}
+				continue;
+			}
+			locked = 1;
 			/* if error */
-			if (inbuf[x] != c) {
+			if (biterrs) {
 				total_errorcount++;
 				loop_errorcount++;
 				if (oldstyle_cmdline) {
-					printf("(Error %ld): Unexpected result, %d != %d, %ld bytes since last error.\n", total_errorcount, inbuf[x],c, bytes);
+					printf("(Error %ld): Unexpected result, %d != %d (%d bit errors), %ld bytes since last error.\n", total_errorcount, inbuf[x], c, biterrs, bytes);
 				} else {
 					if (1 <= verbose) {
 						printf("Error %ld (loop %ld, offset %d, error %d): Unexpected result, Read: 0x%02x, Expected 0x%02x.\n",
@@ -309,11 +756,8 @@ read_again:
 						show_error_context(inbuf, x, bs);
 					}
 				}
-				/* Reset the expected data to what was just read.  so test can resynch on skipped data */
-				c = inbuf[x];
 				bytes=0;  /* Reset the count from the last encountered error */
 			}
-			c++;
 			bytes++;
 		}
 		/* If the user wants to see some of each buffer transaction */
@@ -324,6 +768,14 @@ read_again:
 			print_packet(outbuf, 64);
 		}
 		
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (now.tv_sec >= next_second) {
+			pattern_stats_second(&stats, &chk);
+			if (loop_format != PATTERN_FORMAT_NONE)
+				pattern_stats_print(loop_out, loop_format, time(NULL), tp.channo, &stats);
+			next_second++;
+		}
+
 		currentloop++;
 		/* Update stats if the user has specified it */
 		if (0 < reportloops && 0 == (currentloop % reportloops)) {
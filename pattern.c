@@ -0,0 +1,301 @@
+/*
+ * pattern.c -- test patterns for patgen, pattest and patlooptest
+ *
+ * The PRBS generators step a whole byte at a time: with the newest bit
+ * kept in bit 0 of the state, the next 8 bits of b[k] = b[k-a] ^ b[k-n]
+ * only depend on bits already in the state (a >= 8), so a byte is two
+ * shifts and an xor. The same state can be loaded straight from the
+ * received bytes, which is what makes finding sync quick.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "pattern.h"
+
+static const struct pattern_info {
+	const char *name;
+	int bits;		/* register length n */
+	int shift_a;		/* a - 8 */
+	int shift_b;		/* n - 8 */
+	unsigned char invert;
+	int seed_bytes;		/* received bytes that fill the register */
+} patterns[] = {
+	[PATTERN_COUNT] = { "count", 8, 0, 0, 0x00, 1 },
+	[PATTERN_PRBS15] = { "prbs15", 15, 6, 7, 0xff, 2 },
+	[PATTERN_PRBS23] = { "prbs23", 23, 10, 15, 0xff, 3 },
+};
+
+#define NUM_PATTERNS	(sizeof(patterns) / sizeof(patterns[0]))
+
+int pattern_parse(const char *name, enum pattern_type *type)
+{
+	int i;
+
+	for (i = 0; i < NUM_PATTERNS; i++) {
+		if (!strcasecmp(name, patterns[i].name)) {
+			*type = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *pattern_name(enum pattern_type type)
+{
+	return patterns[type].name;
+}
+
+static inline unsigned char gen_next(struct pattern_gen *gen)
+{
+	const struct pattern_info *p = &patterns[gen->type];
+	uint32_t s = gen->state;
+	unsigned char out;
+
+	if (gen->type == PATTERN_COUNT) {
+		out = s + 1;
+		gen->state = out;
+		return out;
+	}
+	out = (s >> p->shift_a) ^ (s >> p->shift_b);
+	gen->state = ((s << 8) | out) & ((1 << p->bits) - 1);
+	return out ^ p->invert;
+}
+
+/* Shift a received byte into the register, as if we had generated it */
+static inline void gen_load(struct pattern_gen *gen, unsigned char byte)
+{
+	const struct pattern_info *p = &patterns[gen->type];
+
+	if (gen->type == PATTERN_COUNT)
+		gen->state = byte;
+	else
+		gen->state = ((gen->state << 8) | (byte ^ p->invert)) & ((1 << p->bits) - 1);
+}
+
+void pattern_gen_init(struct pattern_gen *gen, enum pattern_type type)
+{
+	gen->type = type;
+	/* The counter starts at 0; a PRBS register must not be all zeros */
+	gen->state = (type == PATTERN_COUNT) ? 0xff : (1 << patterns[type].bits) - 1;
+}
+
+void pattern_fill(struct pattern_gen *gen, unsigned char *buf, int len)
+{
+	int x;
+
+	for (x = 0; x < len; x++)
+		buf[x] = gen_next(gen);
+}
+
+void pattern_check_init(struct pattern_check *chk, enum pattern_type type)
+{
+	memset(chk, 0, sizeof(*chk));
+	pattern_gen_init(&chk->gen, type);
+}
+
+int pattern_check_byte(struct pattern_check *chk, unsigned char byte, unsigned char *expected)
+{
+	int seed = patterns[chk->gen.type].seed_bytes;
+	struct pattern_gen predict;
+	unsigned char exp;
+	int errs, errbytes;
+	int x;
+
+	if (!chk->locked) {
+		if (chk->hunt_bytes < seed) {
+			exp = byte;
+			chk->hunt_bytes++;
+		} else {
+			predict = chk->gen;
+			exp = gen_next(&predict);
+			/* A miss still leaves a full register to predict from */
+			chk->hunt_bytes = (exp == byte) ? chk->hunt_bytes + 1 : seed;
+		}
+		gen_load(&chk->gen, byte);
+		if (chk->hunt_bytes >= seed + PATTERN_VERIFY) {
+			chk->locked = 1;
+			chk->win_bytes = 0;
+			chk->win_pos = 0;
+		}
+		if (expected)
+			*expected = exp;
+		return PATTERN_HUNTING;
+	}
+
+	exp = gen_next(&chk->gen);
+	if (expected)
+		*expected = exp;
+	errs = __builtin_popcount(exp ^ byte);
+	chk->bytes++;
+	if (errs) {
+		chk->bit_errors += errs;
+		chk->errored_bytes++;
+	}
+	chk->win_errs[chk->win_pos] = errs;
+	chk->win_pos = (chk->win_pos + 1) % PATTERN_WINDOW;
+	if (chk->win_bytes < PATTERN_WINDOW)
+		chk->win_bytes++;
+
+	for (x = 0, errbytes = 0; x < chk->win_bytes; x++) {
+		if (chk->win_errs[x])
+			errbytes++;
+	}
+	if (errbytes >= PATTERN_WINDOW / 2) {
+		/* Lost sync: these errors were the slip, not the line */
+		for (x = 0; x < chk->win_bytes; x++) {
+			chk->bit_errors -= chk->win_errs[x];
+			if (chk->win_errs[x])
+				chk->errored_bytes--;
+		}
+		chk->bytes -= chk->win_bytes;
+		chk->resyncs++;
+		chk->locked = 0;
+		chk->hunt_bytes = 1;
+		gen_load(&chk->gen, byte);
+		return PATTERN_HUNTING;
+	}
+	return errs;
+}
+
+void pattern_check_buf(struct pattern_check *chk, const unsigned char *buf, int len)
+{
+	int x;
+
+	for (x = 0; x < len; x++)
+		pattern_check_byte(chk, buf[x], NULL);
+}
+
+void pattern_stats_init(struct pattern_stats *st, const struct pattern_check *chk)
+{
+	memset(st, 0, sizeof(*st));
+	st->last = *chk;
+	st->available = 1;
+}
+
+/*
+ * Losing sync takes back the window, which may reach into the last
+ * second: a counter can then be below where that second left it. A
+ * closed second can't be revised, so such a second counts nothing and
+ * the next one counts from where the counter is now.
+ */
+static uint64_t counter_delta(uint64_t now, uint64_t last)
+{
+	return now < last ? 0 : now - last;
+}
+
+void pattern_stats_second(struct pattern_stats *st, const struct pattern_check *chk)
+{
+	st->bytes = counter_delta(chk->bytes, st->last.bytes);
+	st->bit_errors = counter_delta(chk->bit_errors, st->last.bit_errors);
+	st->errored_bytes = counter_delta(chk->errored_bytes, st->last.errored_bytes);
+	st->resyncs = counter_delta(chk->resyncs, st->last.resyncs);
+	st->insync = st->last.locked && chk->locked && !st->resyncs && st->bytes;
+	st->last = *chk;
+	st->seconds++;
+
+	st->ses = !st->insync ||
+		(double)st->bit_errors / (st->bytes * 8) >= PATTERN_SES_BER;
+	st->es = st->ses || st->bit_errors;
+
+	if (st->available) {
+		if (!st->ses) {
+			st->run = 0;
+			st->run_es = 0;
+		} else if (++st->run == PATTERN_UAS_SECONDS) {
+			/* Unavailable since the first of these */
+			st->total_es -= st->run_es;
+			st->total_ses -= st->run_es;
+			st->total_uas += PATTERN_UAS_SECONDS;
+			st->available = 0;
+			st->unavailable = 1;
+			st->run = 0;
+			st->run_es = 0;
+			return;
+		} else {
+			st->run_es++;
+		}
+		st->total_es += st->es;
+		st->total_ses += st->ses;
+		st->unavailable = 0;
+		return;
+	}
+
+	if (st->ses) {
+		st->run = 0;
+		st->run_es = 0;
+	} else {
+		st->run_es += st->es;
+		if (++st->run == PATTERN_UAS_SECONDS) {
+			/* Available again since the first of these */
+			st->total_uas -= PATTERN_UAS_SECONDS - 1;
+			st->total_es += st->run_es;
+			st->available = 1;
+			st->unavailable = 0;
+			st->run = 0;
+			st->run_es = 0;
+			return;
+		}
+	}
+	st->total_uas++;
+	st->unavailable = 1;
+}
+
+int pattern_format_parse(const char *name, enum pattern_format *fmt)
+{
+	if (!strcasecmp(name, "csv"))
+		*fmt = PATTERN_FORMAT_CSV;
+	else if (!strcasecmp(name, "json"))
+		*fmt = PATTERN_FORMAT_JSON;
+	else
+		return -1;
+	return 0;
+}
+
+void pattern_stats_header(FILE *f, enum pattern_format fmt)
+{
+	if (fmt != PATTERN_FORMAT_CSV)
+		return;
+	fprintf(f, "time,chan,bytes,bit_errors,errored_bytes,resyncs,insync,"
+		"es,ses,uas,total_seconds,total_es,total_ses,total_uas,ber\n");
+}
+
+void pattern_stats_print(FILE *f, enum pattern_format fmt, time_t t, int chan,
+			 const struct pattern_stats *st)
+{
+	unsigned long long bytes = st->bytes, bits = st->bit_errors;
+	unsigned long long ebytes = st->errored_bytes, resyncs = st->resyncs;
+	unsigned long long secs = st->seconds, es = st->total_es;
+	unsigned long long ses = st->total_ses, uas = st->total_uas;
+	double ber;
+
+	/* BER over everything checked in sync so far */
+	ber = st->last.bytes ? (double)st->last.bit_errors / (st->last.bytes * 8) : 0.0;
+	if (fmt == PATTERN_FORMAT_JSON)
+		fprintf(f, "{\"time\": %ld, \"chan\": %d, \"bytes\": %llu, "
+			"\"bit_errors\": %llu, \"errored_bytes\": %llu, "
+			"\"resyncs\": %llu, \"insync\": %d, \"es\": %d, "
+			"\"ses\": %d, \"uas\": %d, \"total_seconds\": %llu, "
+			"\"total_es\": %llu, \"total_ses\": %llu, "
+			"\"total_uas\": %llu, \"ber\": %.3e}\n",
+			(long)t, chan, bytes, bits, ebytes, resyncs, st->insync,
+			st->es, st->ses, st->unavailable, secs, es, ses, uas, ber);
+	else
+		fprintf(f, "%ld,%d,%llu,%llu,%llu,%llu,%d,%d,%d,%d,%llu,%llu,%llu,%llu,%.3e\n",
+			(long)t, chan, bytes, bits, ebytes, resyncs, st->insync,
+			st->es, st->ses, st->unavailable, secs, es, ses, uas, ber);
+}
@@ -0,0 +1,130 @@
+/*
+ * pattern.h -- test patterns for patgen, pattest and patlooptest
+ *
+ * Besides the original incrementing byte counter, the ITU-T O.150
+ * pseudo-random sequences 2^15-1 and 2^23-1 are supported, so the
+ * tools can be used against standard BER test sets. Bits go on the line
+ * most significant bit first.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+enum pattern_type {
+	PATTERN_COUNT,		/* 0, 1, 2, ... 255, 0, ... */
+	PATTERN_PRBS15,		/* O.150 2^15-1: x^15 + x^14 + 1, inverted */
+	PATTERN_PRBS23,		/* O.150 2^23-1: x^23 + x^18 + 1, inverted */
+};
+
+struct pattern_gen {
+	enum pattern_type type;
+	uint32_t state;
+};
+
+/*
+ * The checker hunts for sync by loading its generator from the received
+ * bytes, and locks once the next PATTERN_VERIFY bytes are predicted
+ * right. While locked it runs its own generator, so each bit error is
+ * counted once. If half of the last PATTERN_WINDOW bytes are wrong, sync
+ * is lost (a slip, or a different pattern): the errors of those bytes
+ * are taken back and the checker hunts again.
+ */
+#define PATTERN_VERIFY	8
+#define PATTERN_WINDOW	16
+
+struct pattern_check {
+	struct pattern_gen gen;
+	int locked;
+	int hunt_bytes;		/* bytes matched (or loaded) while hunting */
+	int win_bytes;		/* bytes in the window, up to PATTERN_WINDOW */
+	int win_pos;
+	unsigned char win_errs[PATTERN_WINDOW];	/* bit errors per byte */
+	/* totals over the locked periods */
+	uint64_t bytes;
+	uint64_t bit_errors;
+	uint64_t errored_bytes;
+	uint64_t resyncs;	/* sync lost after having been locked */
+};
+
+#define PATTERN_HUNTING	(-1)
+
+int pattern_parse(const char *name, enum pattern_type *type);
+const char *pattern_name(enum pattern_type type);
+
+void pattern_gen_init(struct pattern_gen *gen, enum pattern_type type);
+void pattern_fill(struct pattern_gen *gen, unsigned char *buf, int len);
+
+void pattern_check_init(struct pattern_check *chk, enum pattern_type type);
+/*
+ * Check one received byte. Returns its number of bit errors, or
+ * PATTERN_HUNTING if not in sync. The expected value goes to *expected.
+ */
+int pattern_check_byte(struct pattern_check *chk, unsigned char byte, unsigned char *expected);
+void pattern_check_buf(struct pattern_check *chk, const unsigned char *buf, int len);
+
+/*
+ * G.826 style accounting, one second at a time. A second is severely
+ * errored (SES) if it has a bit error ratio of at least PATTERN_SES_BER,
+ * or was not in sync all along; errored (ES) if it has any error. Ten
+ * SES in a row start unavailable time, ten non-SES in a row end it, and
+ * those ten seconds are moved to or from the totals retroactively.
+ */
+#define PATTERN_SES_BER		1e-3
+#define PATTERN_UAS_SECONDS	10
+
+struct pattern_stats {
+	struct pattern_check last;	/* checker at the end of the last second */
+	/* the last second */
+	uint64_t bytes;
+	uint64_t bit_errors;
+	uint64_t errored_bytes;
+	uint64_t resyncs;
+	int insync;
+	int es;
+	int ses;
+	int unavailable;
+	/* totals */
+	uint64_t seconds;
+	uint64_t total_es;
+	uint64_t total_ses;
+	uint64_t total_uas;
+	/* availability */
+	int available;
+	int run;		/* seconds in a row that go against it */
+	int run_es;		/* of those, counted as ES */
+};
+
+enum pattern_format {
+	PATTERN_FORMAT_NONE,
+	PATTERN_FORMAT_CSV,
+	PATTERN_FORMAT_JSON,
+};
+
+void pattern_stats_init(struct pattern_stats *st, const struct pattern_check *chk);
+/* Close a second: account what chk counted since the last call */
+void pattern_stats_second(struct pattern_stats *st, const struct pattern_check *chk);
+
+int pattern_format_parse(const char *name, enum pattern_format *fmt);
+/* The CSV header; nothing for JSON, which has one object per line */
+void pattern_stats_header(FILE *f, enum pattern_format fmt);
+void pattern_stats_print(FILE *f, enum pattern_format fmt, time_t t, int chan,
+			 const struct pattern_stats *st);
+
+#endif
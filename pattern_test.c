@@ -0,0 +1,119 @@
+/*
+ * pattern_test -- checks for the pattern checker and its statistics
+ *
+ * Run by "make check". Sync is slipped a few bytes after a second has
+ * been closed, so that the bytes and errors taken back were partly
+ * counted in that second: no second may then count more than was
+ * received, and a real error after the slip must still make its second
+ * errored.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pattern.h"
+
+static int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static struct pattern_gen tx;
+static struct pattern_check chk;
+static struct pattern_stats st;
+/* Send len bytes of the pattern, xor'ed with flip */
+static void send(int len, unsigned char flip)
+{
+	unsigned char byte;
+
+	while (len-- > 0) {
+		pattern_fill(&tx, &byte, 1);
+		pattern_check_byte(&chk, byte ^ flip, NULL);
+	}
+}
+
+/* Close a second that received at most len bytes */
+static void second(uint64_t len)
+{
+	pattern_stats_second(&st, &chk);
+	CHECK(st.bytes <= len);
+	CHECK(st.bit_errors <= st.bytes * 8);
+	CHECK(st.errored_bytes <= st.bytes);
+}
+
+static void test_slip(enum pattern_type type)
+{
+	pattern_gen_init(&tx, type);
+	pattern_check_init(&chk, type);
+
+	send(100, 0);
+	CHECK(chk.locked);
+	pattern_stats_init(&st, &chk);
+
+	/* A second ending with two errored bytes */
+	send(1000, 0);
+	send(1, 0x01);
+	send(3, 0);
+	send(1, 0x80);
+	send(2, 0);
+	second(1007);
+	CHECK(st.insync && st.es && !st.ses);
+	CHECK(st.bit_errors == 2 && st.errored_bytes == 2);
+
+	/* Slip 3 bytes into the next one: the window reaches back over both */
+	send(3, 0);
+	send(PATTERN_WINDOW / 2, 0xff);
+	CHECK(!chk.locked);
+	second(3 + PATTERN_WINDOW / 2);
+	CHECK(!st.insync && st.ses);
+	CHECK(!st.bytes && !st.bit_errors && !st.errored_bytes);
+
+	/* Back in sync, but not all along */
+	send(1000, 0);
+	CHECK(chk.locked);
+	second(1000);
+	CHECK(!st.insync && st.ses && !st.bit_errors);
+
+	/* A real error after the slip: what was taken back is not owed */
+	send(500, 0);
+	send(1, 0x10);
+	send(499, 0);
+	second(1000);
+	CHECK(st.insync && st.bytes == 1000);
+	CHECK(st.bit_errors == 1 && st.errored_bytes == 1);
+	CHECK(st.es && !st.ses);
+
+	send(1000, 0);
+	second(1000);
+	CHECK(st.insync && st.bytes == 1000 && !st.es);
+}
+
+int main(void)
+{
+	test_slip(PATTERN_COUNT);
+	test_slip(PATTERN_PRBS15);
+	test_slip(PATTERN_PRBS23);
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		exit(1);
+	}
+	return 0;
+}
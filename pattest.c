@@ -36,7 +36,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include "bittest.h"
+#include <signal.h>
+#include <time.h>
+#include "pattern.h"
 
 #include <dahdi/user.h>
 #include "dahdi_tools_version.h"
@@ -45,15 +47,25 @@
 #define DEVICE	  "/dev/dahdi/channel"
 
 char			*prog_name;
+static volatile int	stop;
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: %s <dahdi_chan>\n", prog_name);
+	fprintf(stderr, "Usage: %s [-p PATTERN] [-F csv|json [-o FILE]] [-q] <dahdi_chan>\n", prog_name);
 	fprintf(stderr, "   e.g.: %s /dev/dahdi/55\n", prog_name);
-	fprintf(stderr, "         %s 455\n", prog_name);
+	fprintf(stderr, "         %s -p prbs15 -F csv -o link.csv 455\n", prog_name);
+	fprintf(stderr, "   -p PATTERN: count (default), prbs15 or prbs23\n");
+	fprintf(stderr, "   -F FORMAT: write per second statistics (ES, SES, UAS, BER) as csv or json\n");
+	fprintf(stderr, "   -o FILE: write the statistics to FILE instead of stdout\n");
+	fprintf(stderr, "   -q: don't report each byte in error (implied by -F without -o)\n");
 	exit(1);
 }
 
+static void stop_test(int sig)
+{
+	stop = 1;
+}
+
 void print_packet(unsigned char *buf, int len)
 {
 	int x;
@@ -114,24 +126,91 @@ int main(int argc, char *argv[])
 	int fd;
 	int res, x;
 	int bs = BLOCK_SIZE;
-	unsigned char c=0;
+	unsigned char c;
 	unsigned char outbuf[BLOCK_SIZE];
-	int setup=0;
 	int errors=0;
 	int bytes=0;
+	int biterrs, locked=0;
+	enum pattern_type pattern = PATTERN_COUNT;
+	struct pattern_check chk;
+	struct pattern_stats stats;
+	enum pattern_format format = PATTERN_FORMAT_NONE;
+	struct dahdi_params tp;
+	struct timespec now;
+	time_t next_second;
+	const char *outname = NULL;
+	FILE *out = stdout;
+	int quiet = 0;
+	int chan = 0;
+	int opt;
 
 	prog_name = argv[0];
 
-	if (argc < 2) {
+	while ((opt = getopt(argc, argv, "p:F:o:qh")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (pattern_parse(optarg, &pattern)) {
+				fprintf(stderr, "Unknown pattern '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'F':
+			if (pattern_format_parse(optarg, &format)) {
+				fprintf(stderr, "Unknown format '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'o':
+			outname = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc) {
 		usage();
 	}
 
-	fd = channel_open(argv[1], &bs);
+	if (format != PATTERN_FORMAT_NONE) {
+		if (outname) {
+			out = fopen(outname, "a");
+			if (!out) {
+				perror(outname);
+				exit(1);
+			}
+		} else {
+			quiet = 1;
+		}
+		setvbuf(out, NULL, _IOLBF, 0);
+	}
+
+	fd = channel_open(argv[optind], &bs);
 	if (fd < 0)
 		exit(1);
+	if (!ioctl(fd, DAHDI_GET_PARAMS, &tp))
+		chan = tp.channo;
 
+	signal(SIGINT, stop_test);
+	signal(SIGTERM, stop_test);
+	pattern_check_init(&chk, pattern);
+	pattern_stats_init(&stats, &chk);
+	pattern_stats_header(out, format);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next_second = now.tv_sec + 1;
 	ioctl(fd, DAHDI_GETEVENT);
-	for(;;) {
+	while (!stop) {
+		/* A long wait for data closes several seconds, all but one empty */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (now.tv_sec >= next_second) {
+			pattern_stats_second(&stats, &chk);
+			if (format != PATTERN_FORMAT_NONE)
+				pattern_stats_print(out, format, time(NULL), chan, &stats);
+			next_second++;
+		}
 		res = bs;
 		res = read(fd, outbuf, res);
 		if (res < bs) {
@@ -143,9 +222,9 @@ int main(int argc, char *argv[])
 				perror("DAHDI_GETEVENT");
 				exit(1);
 			}
-			if (e == DAHDI_EVENT_NOALARM)
+			if (e == DAHDI_EVENT_NOALARM && !quiet)
 				printf("ALARMS CLEARED\n");
-			if (e == DAHDI_EVENT_ALARM)
+			if (e == DAHDI_EVENT_ALARM && !quiet)
 			{
 				zi.spanno = 0;
 				res = ioctl(fd,DAHDI_SPANSTAT,&zi);
@@ -158,22 +237,42 @@ int main(int argc, char *argv[])
 			}
 			continue;
 		}
-		if (!setup) {
-			c = outbuf[0];
-			setup++;
-		}
 		for (x=0;x<bs;x++)  {
-			if (outbuf[x] != c) {
-				printf("(Error %d): Unexpected result, %d != %d, %d bytes since last error.\n", ++errors, outbuf[x], c, bytes); 
-				c = outbuf[x];
+			biterrs = pattern_check_byte(&chk, outbuf[x], &c);
+			if (biterrs == PATTERN_HUNTING) {
+				if (locked && !quiet)
+					printf("Lost %s sync, %d bytes since last error.\n", pattern_name(pattern), bytes);
+				locked = 0;
+				continue;
+			}
+			if (!locked) {
+				if (!quiet)
+					printf("In %s sync.\n", pattern_name(pattern));
+				locked = 1;
+				bytes = 0;
+			}
+			if (biterrs) {
+				++errors;
+				if (!quiet)
+					printf("(Error %d): Unexpected result, %d != %d (%d bit errors), %d bytes since last error.\n", errors, outbuf[x], c, biterrs, bytes); 
 				bytes=0;
 			}
-			c = bit_next(c);
 			bytes++;
 		}
 #if 0
 		printf("(%d) Wrote %d bytes\n", packets++, res);
 #endif
 	}
-	
+
+	fprintf(stderr, "%llu seconds: %llu errored, %llu severely errored, "
+		"%llu unavailable; %llu bit errors in %llu bytes (BER %.3e)\n",
+		(unsigned long long)stats.seconds,
+		(unsigned long long)stats.total_es,
+		(unsigned long long)stats.total_ses,
+		(unsigned long long)stats.total_uas,
+		(unsigned long long)chk.bit_errors, (unsigned long long)chk.bytes,
+		chk.bytes ? (double)chk.bit_errors / (chk.bytes * 8) : 0.0);
+	if (out != stdout)
+		fclose(out);
+	return chk.bit_errors || chk.resyncs ? 1 : 0;
 }
@@ -0,0 +1,191 @@
+/*
+ * pcm_bench -- check and time the dahdi_monitor audio kernels
+ *
+ * Every implementation of pcm_level() and pcm_interleave() this CPU can
+ * run is first compared with the scalar one on random audio (including
+ * -32768 and 32767) of all lengths and alignments up to a few blocks,
+ * then timed on blocks of the size dahdi_monitor reads.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "pcm_kernels.h"
+
+#define CHECK_MAX	512	/* longest buffer compared */
+#define CHECK_ROUNDS	20
+
+static int16_t left[CHECK_MAX + 16];
+static int16_t right[CHECK_MAX + 16];
+static int16_t ref[2 * CHECK_MAX];
+static int16_t out[2 * CHECK_MAX];
+
+static volatile uint64_t sink;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: pcm_bench [-s SAMPLES] [-n BLOCKS]\n");
+	fprintf(stderr, "        -s SAMPLES: samples per block (default: %d, as dahdi_monitor)\n",
+		PCM_BLOCK_SAMPLES);
+	fprintf(stderr, "        -n BLOCKS: blocks timed per kernel (default: 1000000)\n");
+	exit(1);
+}
+
+static void fill_random(int16_t *buf, int cnt)
+{
+	int x;
+
+	for (x = 0; x < cnt; x++) {
+		switch (rand() % 16) {
+		case 0:
+			buf[x] = -32768;
+			break;
+		case 1:
+			buf[x] = 32767;
+			break;
+		default:
+			buf[x] = rand();
+		}
+	}
+}
+
+/* Compare the selected implementation with the scalar one */
+static int check(enum pcm_impl impl)
+{
+	struct pcm_level want, got;
+	int round, off, cnt;
+	int errors = 0;
+
+	for (round = 0; round < CHECK_ROUNDS; round++) {
+		fill_random(left, CHECK_MAX + 16);
+		fill_random(right, CHECK_MAX + 16);
+		for (off = 0; off < 16; off++) {
+			for (cnt = 0; cnt <= CHECK_MAX; cnt++) {
+				pcm_kernels_select(PCM_IMPL_SCALAR);
+				pcm_level(left + off, cnt, &want);
+				pcm_interleave(ref, left + off, right, cnt);
+				pcm_kernels_select(impl);
+				pcm_level(left + off, cnt, &got);
+				memset(out, 0, sizeof(out));
+				pcm_interleave(out, left + off, right, cnt);
+				if (memcmp(&want, &got, sizeof(want))) {
+					if (!errors++)
+						fprintf(stderr, "%s: level mismatch at %d samples (offset %d)\n",
+							pcm_impl_name(impl), cnt, off);
+				}
+				if (memcmp(ref, out, cnt * 2 * sizeof(int16_t))) {
+					if (!errors++)
+						fprintf(stderr, "%s: interleave mismatch at %d samples (offset %d)\n",
+							pcm_impl_name(impl), cnt, off);
+				}
+			}
+		}
+	}
+	return errors;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_level(int samples, long blocks)
+{
+	struct pcm_level lvl;
+	double start;
+	long x;
+
+	start = now();
+	for (x = 0; x < blocks; x++) {
+		pcm_level(left, samples, &lvl);
+		sink += lvl.sum;
+	}
+	return (now() - start) * 1e9 / blocks;
+}
+
+static double time_interleave(int samples, long blocks)
+{
+	double start;
+	long x;
+
+	start = now();
+	for (x = 0; x < blocks; x++) {
+		pcm_interleave(out, left, right, samples);
+		sink += out[x % (2 * samples)];
+	}
+	return (now() - start) * 1e9 / blocks;
+}
+
+int main(int argc, char *argv[])
+{
+	double level_ns[PCM_IMPL_COUNT];
+	double interleave_ns[PCM_IMPL_COUNT];
+	int samples = PCM_BLOCK_SAMPLES;
+	long blocks = 1000000;
+	int impl;
+	int opt;
+	int failed = 0;
+
+	while ((opt = getopt(argc, argv, "s:n:h")) != -1) {
+		switch (opt) {
+		case 's':
+			samples = atoi(optarg);
+			if (samples < 1 || samples > CHECK_MAX) {
+				fprintf(stderr, "Samples must be 1-%d\n", CHECK_MAX);
+				exit(1);
+			}
+			break;
+		case 'n':
+			blocks = atol(optarg);
+			if (blocks < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	srand(time(NULL));
+	printf("%-8s %8s %14s %8s %14s %8s\n", "kernel", "exact",
+	       "level ns/blk", "speedup", "ilv ns/blk", "speedup");
+	for (impl = 0; impl < PCM_IMPL_COUNT; impl++) {
+		if (pcm_kernels_select(impl)) {
+			printf("%-8s (not supported by this CPU)\n", pcm_impl_name(impl));
+			continue;
+		}
+		if (impl != PCM_IMPL_SCALAR && check(impl)) {
+			printf("%-8s %8s\n", pcm_impl_name(impl), "FAILED");
+			failed = 1;
+			continue;
+		}
+		pcm_kernels_select(impl);
+		fill_random(left, samples);
+		fill_random(right, samples);
+		level_ns[impl] = time_level(samples, blocks);
+		interleave_ns[impl] = time_interleave(samples, blocks);
+		printf("%-8s %8s %14.1f %7.2fx %14.1f %7.2fx\n", pcm_impl_name(impl),
+		       "yes", level_ns[impl], level_ns[PCM_IMPL_SCALAR] / level_ns[impl],
+		       interleave_ns[impl],
+		       interleave_ns[PCM_IMPL_SCALAR] / interleave_ns[impl]);
+	}
+	return failed;
+}
@@ -0,0 +1,277 @@
+/*
+ * pcm_kernels.c -- level meter and interleaving of 16 bit linear audio
+ *
+ * The SIMD versions only use instructions of the extension they are named
+ * after, and are compiled with a target attribute so the rest of the
+ * program still runs on any CPU of the architecture.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "pcm_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCM_X86
+#include <immintrin.h>
+#endif
+
+static void level_scalar(const int16_t *buf, int cnt, struct pcm_level *lvl)
+{
+	uint32_t sum = 0;
+	uint32_t peak = 0;
+	uint64_t sumsq = 0;
+	uint32_t a;
+	int x;
+
+	for (x = 0; x < cnt; x++) {
+		a = abs(buf[x]);
+		sum += a;
+		if (a > peak)
+			peak = a;
+		sumsq += a * a;
+	}
+	lvl->sum = sum;
+	lvl->peak = peak;
+	lvl->sumsq = sumsq;
+}
+
+static void interleave_scalar(int16_t *dst, const int16_t *left,
+			      const int16_t *right, int cnt)
+{
+	int x;
+
+	for (x = 0; x < cnt; x++) {
+		dst[x * 2] = left[x];
+		dst[x * 2 + 1] = right[x];
+	}
+}
+
+#ifdef PCM_X86
+
+/*
+ * The absolute value is taken in 16 bits: |-32768| wraps to 0x8000, which
+ * is still right when read as unsigned, so it is widened with zeros. The
+ * peak comes from the signed minimum and maximum, as SSE2 has no unsigned
+ * 16 bit max. pmaddwd of a sample pair gives at most 2^31, which is also
+ * exact as unsigned, before it is widened to 64 bits.
+ */
+__attribute__((target("sse2")))
+static void level_sse2(const int16_t *buf, int cnt, struct pcm_level *lvl)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero, sumsq = zero;
+	__m128i vmax = zero, vmin = zero;
+	__m128i v, sign, a, sq;
+	uint32_t s32[4];
+	uint64_t s64[2];
+	int16_t m16[8];
+	int peak = 0;
+	int x;
+
+	for (x = 0; x + 8 <= cnt; x += 8) {
+		v = _mm_loadu_si128((const __m128i *)(buf + x));
+		vmax = _mm_max_epi16(vmax, v);
+		vmin = _mm_min_epi16(vmin, v);
+		sign = _mm_srai_epi16(v, 15);
+		a = _mm_sub_epi16(_mm_xor_si128(v, sign), sign);
+		sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(a, zero));
+		sum = _mm_add_epi32(sum, _mm_unpackhi_epi16(a, zero));
+		sq = _mm_madd_epi16(v, v);
+		sumsq = _mm_add_epi64(sumsq, _mm_unpacklo_epi32(sq, zero));
+		sumsq = _mm_add_epi64(sumsq, _mm_unpackhi_epi32(sq, zero));
+	}
+	_mm_storeu_si128((__m128i *)s32, sum);
+	_mm_storeu_si128((__m128i *)s64, sumsq);
+	lvl->sum = s32[0] + s32[1] + s32[2] + s32[3];
+	lvl->sumsq = s64[0] + s64[1];
+
+	_mm_storeu_si128((__m128i *)m16, vmax);
+	for (x = 0; x < 8; x++) {
+		if (m16[x] > peak)
+			peak = m16[x];
+	}
+	/* Negate the minimums as int, so -32768 becomes 32768 */
+	_mm_storeu_si128((__m128i *)m16, vmin);
+	for (x = 0; x < 8; x++) {
+		if (-m16[x] > peak)
+			peak = -m16[x];
+	}
+	lvl->peak = peak;
+
+	if (cnt & 7) {
+		struct pcm_level tail;
+
+		level_scalar(buf + (cnt & ~7), cnt & 7, &tail);
+		lvl->sum += tail.sum;
+		lvl->sumsq += tail.sumsq;
+		if (tail.peak > lvl->peak)
+			lvl->peak = tail.peak;
+	}
+}
+
+__attribute__((target("sse2")))
+static void interleave_sse2(int16_t *dst, const int16_t *left,
+			    const int16_t *right, int cnt)
+{
+	__m128i l, r;
+	int x;
+
+	for (x = 0; x + 8 <= cnt; x += 8) {
+		l = _mm_loadu_si128((const __m128i *)(left + x));
+		r = _mm_loadu_si128((const __m128i *)(right + x));
+		_mm_storeu_si128((__m128i *)(dst + x * 2), _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i *)(dst + x * 2 + 8), _mm_unpackhi_epi16(l, r));
+	}
+	interleave_scalar(dst + x * 2, left + x, right + x, cnt - x);
+}
+
+__attribute__((target("avx2")))
+static void level_avx2(const int16_t *buf, int cnt, struct pcm_level *lvl)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sum = zero, sumsq = zero;
+	__m256i vmax = zero, vmin = zero;
+	__m256i v, a, sq;
+	uint32_t s32[8];
+	uint64_t s64[4];
+	int16_t m16[16];
+	int peak = 0;
+	int x;
+
+	for (x = 0; x + 16 <= cnt; x += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + x));
+		vmax = _mm256_max_epi16(vmax, v);
+		vmin = _mm256_min_epi16(vmin, v);
+		/* vpabsw also gives 0x8000 for -32768 */
+		a = _mm256_abs_epi16(v);
+		sum = _mm256_add_epi32(sum, _mm256_unpacklo_epi16(a, zero));
+		sum = _mm256_add_epi32(sum, _mm256_unpackhi_epi16(a, zero));
+		sq = _mm256_madd_epi16(v, v);
+		sumsq = _mm256_add_epi64(sumsq, _mm256_unpacklo_epi32(sq, zero));
+		sumsq = _mm256_add_epi64(sumsq, _mm256_unpackhi_epi32(sq, zero));
+	}
+	_mm256_storeu_si256((__m256i *)s32, sum);
+	_mm256_storeu_si256((__m256i *)s64, sumsq);
+	lvl->sum = s32[0] + s32[1] + s32[2] + s32[3] +
+		s32[4] + s32[5] + s32[6] + s32[7];
+	lvl->sumsq = s64[0] + s64[1] + s64[2] + s64[3];
+
+	_mm256_storeu_si256((__m256i *)m16, vmax);
+	for (x = 0; x < 16; x++) {
+		if (m16[x] > peak)
+			peak = m16[x];
+	}
+	_mm256_storeu_si256((__m256i *)m16, vmin);
+	for (x = 0; x < 16; x++) {
+		if (-m16[x] > peak)
+			peak = -m16[x];
+	}
+	lvl->peak = peak;
+
+	if (cnt & 15) {
+		struct pcm_level tail;
+
+		level_scalar(buf + (cnt & ~15), cnt & 15, &tail);
+		lvl->sum += tail.sum;
+		lvl->sumsq += tail.sumsq;
+		if (tail.peak > lvl->peak)
+			lvl->peak = tail.peak;
+	}
+}
+
+__attribute__((target("avx2")))
+static void interleave_avx2(int16_t *dst, const int16_t *left,
+			    const int16_t *right, int cnt)
+{
+	__m256i l, r, lo, hi;
+	int x;
+
+	for (x = 0; x + 16 <= cnt; x += 16) {
+		l = _mm256_loadu_si256((const __m256i *)(left + x));
+		r = _mm256_loadu_si256((const __m256i *)(right + x));
+		/* unpack works within 128 bit lanes; put the halves back in order */
+		lo = _mm256_unpacklo_epi16(l, r);
+		hi = _mm256_unpackhi_epi16(l, r);
+		_mm256_storeu_si256((__m256i *)(dst + x * 2),
+				    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + x * 2 + 16),
+				    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	interleave_scalar(dst + x * 2, left + x, right + x, cnt - x);
+}
+
+#endif /* PCM_X86 */
+
+void (*pcm_level)(const int16_t *buf, int cnt, struct pcm_level *lvl) = level_scalar;
+void (*pcm_interleave)(int16_t *dst, const int16_t *left,
+		       const int16_t *right, int cnt) = interleave_scalar;
+
+int pcm_kernels_select(enum pcm_impl impl)
+{
+	switch (impl) {
+	case PCM_IMPL_SCALAR:
+		pcm_level = level_scalar;
+		pcm_interleave = interleave_scalar;
+		return 0;
+#ifdef PCM_X86
+	case PCM_IMPL_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		pcm_level = level_sse2;
+		pcm_interleave = interleave_sse2;
+		return 0;
+	case PCM_IMPL_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		pcm_level = level_avx2;
+		pcm_interleave = interleave_avx2;
+		return 0;
+#endif
+	default:
+		return -1;
+	}
+}
+
+void pcm_kernels_init(void)
+{
+	int impl;
+
+	for (impl = PCM_IMPL_COUNT - 1; impl > PCM_IMPL_SCALAR; impl--) {
+		if (!pcm_kernels_select(impl))
+			return;
+	}
+	pcm_kernels_select(PCM_IMPL_SCALAR);
+}
+
+const char *pcm_impl_name(enum pcm_impl impl)
+{
+	switch (impl) {
+	case PCM_IMPL_SCALAR:
+		return "scalar";
+	case PCM_IMPL_SSE2:
+		return "sse2";
+	case PCM_IMPL_AVX2:
+		return "avx2";
+	default:
+		return "unknown";
+	}
+}
+
+double pcm_level_rms(const struct pcm_level *lvl, int cnt)
+{
+	return cnt ? sqrt((double)lvl->sumsq / cnt) : 0.0;
+}
@@ -0,0 +1,60 @@
+/*
+ * pcm_kernels.h -- level meter and interleaving of 16 bit linear audio
+ *
+ * Every kernel has a plain C version and, on x86, SSE2 and AVX2 versions
+ * picked at run time by pcm_kernels_init(). All versions give bit-exact
+ * results; pcm_bench checks that and measures them.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef PCM_KERNELS_H
+#define PCM_KERNELS_H
+
+#include <stdint.h>
+
+/* Samples dahdi_monitor reads from a channel at a time (30 ms) */
+#define PCM_BLOCK_SAMPLES	240
+
+enum pcm_impl {
+	PCM_IMPL_SCALAR,
+	PCM_IMPL_SSE2,
+	PCM_IMPL_AVX2,
+	PCM_IMPL_COUNT,
+};
+
+struct pcm_level {
+	uint32_t sum;		/*!< sum of the absolute sample values */
+	uint32_t peak;		/*!< largest absolute sample value */
+	uint64_t sumsq;		/*!< sum of the squared sample values */
+};
+
+/* Level of cnt samples; cnt must be below 65536 so sum cannot overflow */
+extern void (*pcm_level)(const int16_t *buf, int cnt, struct pcm_level *lvl);
+
+/* dst[2*i] = left[i], dst[2*i+1] = right[i] for cnt samples */
+extern void (*pcm_interleave)(int16_t *dst, const int16_t *left,
+			      const int16_t *right, int cnt);
+
+/* Use the best implementation this CPU supports */
+void pcm_kernels_init(void);
+
+/* Force an implementation; returns -1 if this CPU can't run it */
+int pcm_kernels_select(enum pcm_impl impl);
+
+const char *pcm_impl_name(enum pcm_impl impl);
+
+double pcm_level_rms(const struct pcm_level *lvl, int cnt);
+
+#endif
@@ -25,26 +25,552 @@
  * this program for more details.
  */
 
+#define _GNU_SOURCE	/* for pthread_setaffinity_np() */
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <errno.h>
 
 #include <dahdi/user.h>
 #include "dahdi_tools_version.h"
+#include "timing_hist.h"
+
+#define SAMPLE_NS	125000ULL	/* One sample at 8000 Hz */
+#define DEFAULT_SAMPLES	160		/* 20 ms, what Asterisk normally uses */
+#define MAX_INTERVALS	16
+
+/*
+ * Benchmark mode: many timers, possibly with different intervals, are
+ * waited on with epoll by a few worker threads. Every expiry is measured
+ * against its deadline. A timer first fires on a DAHDI tick, not an
+ * interval after it was configured, so deadlines count from its first
+ * wakeup. The DAHDI clock also drifts against CLOCK_MONOTONIC: every
+ * second, its interval is measured again from the first wakeup to the
+ * quickest one of that second.
+ *
+ * Latency is how late each wakeup is on the schedule set by the first
+ * wakeup. Jitter is how late it is once the deadlines count from the
+ * quickest wakeup of the last second (or from any wakeup that came before
+ * its deadline): that absorbs any delay every wakeup has in common, and
+ * leaves how much the wakeups vary.
+ */
+#define PERIOD_NS	1000000000ULL
+
+struct bench_timer {
+	int fd;
+	int samples;
+	uint64_t interval_ns;
+	int started;
+	struct timespec first;	/* First wakeup */
+	double tick_ns;		/* The interval as measured */
+	struct timespec anchor;	/* Wakeup the deadlines count from */
+	uint64_t anchor_expiry;	/* and its expiry */
+	uint64_t expiries;	/* Expiries seen (or skipped) since the first */
+	uint64_t period_end;	/* Expiry that ends this second */
+	uint64_t quickest;	/* Lowest latency in this second */
+	struct timespec quickest_at;
+	uint64_t quickest_expiry;
+	uint64_t missed;	/* Expiries that passed without a wakeup */
+	uint64_t early;		/* Wakeups before the deadline (clock drift) */
+	struct timing_hist latency;	/* ns after the first wakeup's schedule */
+	struct timing_hist jitter;	/* ns after the re-anchored deadline */
+};
+
+/* What the timers of one run saw, all together */
+struct bench_result {
+	int ntimers;
+	struct timing_hist latency;
+	struct timing_hist jitter;
+	uint64_t missed;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	int cpu;
+	int ntimers;
+	struct bench_timer **timers;
+};
+
+static int verbose;
+static const char *json_file;
+static int intervals[MAX_INTERVALS];
+static int numintervals;
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t interrupted;
+
+static void stop_handler(int sig)
+{
+	stop = 1;
+	if (sig != SIGALRM)
+		interrupted = 1;
+}
+
+static int open_timer(struct bench_timer *t, int samples)
+{
+	memset(t, 0, sizeof(*t));
+	t->fd = open("/dev/dahdi/timer", O_RDWR);
+	if (t->fd < 0) {
+		fprintf(stderr, "Unable to open timer: %s\n", strerror(errno));
+		return -1;
+	}
+	t->samples = samples;
+	t->interval_ns = samples * SAMPLE_NS;
+	if (ioctl(t->fd, DAHDI_TIMERCONFIG, &samples)) {
+		fprintf(stderr, "Unable to set timer: %s\n", strerror(errno));
+		close(t->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void start_period(struct bench_timer *t)
+{
+	t->period_end = t->expiries + PERIOD_NS / t->interval_ns;
+	t->quickest = UINT64_MAX;
+}
+
+static void timer_expired(struct bench_timer *t, const struct timespec *now)
+{
+	uint64_t elapsed;
+	uint64_t deadline;
+	uint64_t late;
+	uint64_t skipped;
+	double scheduled;
+
+	if (!t->started) {
+		t->started = 1;
+		t->first = t->anchor = *now;
+		t->tick_ns = t->interval_ns;
+		start_period(t);
+		return;
+	}
+	t->expiries++;
+	scheduled = t->expiries * t->tick_ns;
+	elapsed = timespec_diff_ns(now, &t->first);
+	hist_add(&t->latency, elapsed > scheduled ? elapsed - scheduled : 0);
+
+	elapsed = timespec_diff_ns(now, &t->anchor);
+	deadline = (t->expiries - t->anchor_expiry) * t->tick_ns;
+	if (elapsed < deadline) {
+		t->early++;
+		hist_add(&t->jitter, 0);
+		t->anchor = *now;
+		t->anchor_expiry = t->expiries;
+		return;
+	}
+	late = elapsed - deadline;
+	hist_add(&t->jitter, late);
+	/* All pending expiries were acked at once: skip the ones we slept through */
+	if (late >= t->tick_ns) {
+		skipped = late / t->tick_ns;
+		t->missed += skipped;
+		t->expiries += skipped;
+	} else if (late < t->quickest) {
+		t->quickest = late;
+		t->quickest_at = *now;
+		t->quickest_expiry = t->expiries;
+	}
+	if (t->expiries >= t->period_end) {
+		if (t->quickest != UINT64_MAX) {
+			t->tick_ns = (double)timespec_diff_ns(&t->quickest_at, &t->first) /
+				t->quickest_expiry;
+			t->anchor = t->quickest_at;
+			t->anchor_expiry = t->quickest_expiry;
+		}
+		start_period(t);
+	}
+}
+
+static void *worker_run(void *data)
+{
+	struct bench_worker *w = data;
+	struct epoll_event ev;
+	struct epoll_event *events;
+	struct timespec now;
+	cpu_set_t cpus;
+	int epfd;
+	int x, n;
+	int ack;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		fprintf(stderr, "Unable to pin worker to CPU %d\n", w->cpu);
+
+	epfd = epoll_create1(0);
+	events = calloc(w->ntimers, sizeof(*events));
+	if (epfd < 0 || !events) {
+		fprintf(stderr, "Unable to set up epoll: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (x = 0; x < w->ntimers; x++) {
+		/* Timer expiry is signalled as an exception (POLLPRI) */
+		ev.events = EPOLLPRI;
+		ev.data.ptr = w->timers[x];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->timers[x]->fd, &ev)) {
+			fprintf(stderr, "Unable to poll timer: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	while (!stop) {
+		n = epoll_wait(epfd, events, w->ntimers, 100);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		for (x = 0; x < n; x++) {
+			struct bench_timer *t = events[x].data.ptr;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ack = -1;
+			if (ioctl(t->fd, DAHDI_TIMERACK, &ack)) {
+				fprintf(stderr, "Unable to ack timer: %s\n", strerror(errno));
+				exit(1);
+			}
+			timer_expired(t, &now);
+		}
+	}
+	close(epfd);
+	free(events);
+	return NULL;
+}
+
+/* Run 'ntimers' timers for 'seconds' and merge what they saw into 'total' */
+static int bench_step(int ntimers, int nthreads, int seconds,
+		      struct bench_result *total)
+{
+	struct bench_timer *timers;
+	struct bench_worker *workers;
+	sigset_t block, old;
+	long ncpus;
+	int x;
+	int res = 0;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if (nthreads > ntimers)
+		nthreads = ntimers;
+	timers = calloc(ntimers, sizeof(*timers));
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!timers || !workers) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (x = 0; x < nthreads; x++) {
+		workers[x].cpu = x % ncpus;
+		workers[x].timers = calloc(ntimers / nthreads + 1,
+					   sizeof(struct bench_timer *));
+		if (!workers[x].timers) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	for (x = 0; x < ntimers; x++) {
+		struct bench_worker *w = &workers[x % nthreads];
+
+		if (open_timer(&timers[x], intervals[x % numintervals])) {
+			ntimers = x;
+			res = -1;
+			goto cleanup;
+		}
+		w->timers[w->ntimers++] = &timers[x];
+	}
+
+	stop = 0;
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	for (x = 0; x < nthreads; x++) {
+		if (pthread_create(&workers[x].thread, NULL, worker_run, &workers[x])) {
+			fprintf(stderr, "Unable to create worker thread\n");
+			exit(1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	alarm(seconds);
+	while (!stop)
+		pause();
+	alarm(0);
+	for (x = 0; x < nthreads; x++)
+		pthread_join(workers[x].thread, NULL);
+
+	for (x = 0; x < ntimers; x++) {
+		struct bench_timer *t = &timers[x];
+
+		if (verbose > 1) {
+			printf("  Timer %d (%d samples): %llu expiries, latency p99 %.3f ms, max %.3f ms, jitter p99 %.3f ms, max %.3f ms, %llu missed, %llu early\n",
+			       x + 1, t->samples,
+			       (unsigned long long)t->latency.count,
+			       hist_percentile(&t->latency, 99.0) / 1e6,
+			       t->latency.max / 1e6,
+			       hist_percentile(&t->jitter, 99.0) / 1e6,
+			       t->jitter.max / 1e6,
+			       (unsigned long long)t->missed,
+			       (unsigned long long)t->early);
+		}
+		hist_merge(&total->latency, &t->latency);
+		hist_merge(&total->jitter, &t->jitter);
+		total->missed += t->missed;
+	}
+
+cleanup:
+	for (x = 0; x < ntimers; x++)
+		close(timers[x].fd);
+	for (x = 0; x < nthreads; x++)
+		free(workers[x].timers);
+	free(workers);
+	free(timers);
+	return res;
+}
+
+static void print_header(void)
+{
+	printf("%18s %-29s   %s\n", "", "Latency (ms)", "Jitter (ms)");
+	printf("%7s %10s %9s %9s %9s   %9s %9s %9s %8s\n", "Timers", "Expiries",
+	       "p50", "p99", "Max", "p50", "p99", "Max", "Missed");
+}
+
+static void print_row(const struct bench_result *r)
+{
+	const struct timing_hist *l = &r->latency;
+	const struct timing_hist *j = &r->jitter;
+
+	printf("%7d %10llu %9.3f %9.3f %9.3f   %9.3f %9.3f %9.3f %8llu\n",
+	       r->ntimers, (unsigned long long)l->count,
+	       hist_percentile(l, 50.0) / 1e6, hist_percentile(l, 99.0) / 1e6,
+	       l->max / 1e6,
+	       hist_percentile(j, 50.0) / 1e6, hist_percentile(j, 99.0) / 1e6,
+	       j->max / 1e6, (unsigned long long)r->missed);
+	fflush(stdout);
+}
+
+static void write_json_hist(FILE *fp, const char *indent, const char *name,
+			    const struct timing_hist *h)
+{
+	char inner[16];
+
+	snprintf(inner, sizeof(inner), "%s\t", indent);
+	fprintf(fp, "%s\"%s_ns\": {\n", indent, name);
+	fprintf(fp, "%s\t\"mean\": %.1f,\n", indent, hist_mean(h));
+	fprintf(fp, "%s\t\"p50\": %llu,\n", indent, (unsigned long long)hist_percentile(h, 50.0));
+	fprintf(fp, "%s\t\"p99\": %llu,\n", indent, (unsigned long long)hist_percentile(h, 99.0));
+	fprintf(fp, "%s\t\"p99_9\": %llu,\n", indent, (unsigned long long)hist_percentile(h, 99.9));
+	fprintf(fp, "%s\t\"max\": %llu,\n", indent, (unsigned long long)h->max);
+	/* Only the populated buckets, as [highest value in ns, count] */
+	fprintf(fp, "%s\t\"histogram\": ", indent);
+	hist_print_json(fp, h, inner);
+	fprintf(fp, "\n%s}", indent);
+}
+
+static void write_json(const char *name, const struct bench_result *runs,
+		       int nruns, int nthreads, int seconds)
+{
+	FILE *fp;
+	int x;
+
+	if (!strcmp(name, "-")) {
+		fp = stdout;
+	} else if (!(fp = fopen(name, "w"))) {
+		fprintf(stderr, "Unable to open '%s': %s\n", name, strerror(errno));
+		return;
+	}
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"threads\": %d,\n", nthreads);
+	fprintf(fp, "\t\"seconds\": %d,\n", seconds);
+	fprintf(fp, "\t\"intervals\": [");
+	for (x = 0; x < numintervals; x++)
+		fprintf(fp, "%s%d", x ? ", " : "", intervals[x]);
+	fprintf(fp, "],\n");
+	fprintf(fp, "\t\"runs\": [");
+	for (x = 0; x < nruns; x++) {
+		fprintf(fp, "%s\n\t\t{\n", x ? "," : "");
+		fprintf(fp, "\t\t\t\"timers\": %d,\n", runs[x].ntimers);
+		fprintf(fp, "\t\t\t\"expiries\": %llu,\n",
+			(unsigned long long)runs[x].latency.count);
+		fprintf(fp, "\t\t\t\"missed\": %llu,\n",
+			(unsigned long long)runs[x].missed);
+		write_json_hist(fp, "\t\t\t", "latency", &runs[x].latency);
+		fprintf(fp, ",\n");
+		write_json_hist(fp, "\t\t\t", "jitter", &runs[x].jitter);
+		fprintf(fp, "\n\t\t}");
+	}
+	fprintf(fp, "\n\t]\n}\n");
+	if (fp != stdout)
+		fclose(fp);
+}
+
+static int bench_run(int ntimers, int nthreads, int seconds, int scaling)
+{
+	struct bench_result *runs;
+	struct bench_result *total;
+	struct sigaction act;
+	int nruns = 0;
+	int maxruns = 1;
+	int step;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = stop_handler;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGALRM, &act, NULL);
+
+	/* The scaling curve doubles the number of timers up to 'ntimers' */
+	for (step = 1; scaling && step < ntimers; step *= 2)
+		maxruns++;
+	runs = calloc(maxruns, sizeof(*runs));
+	if (!runs) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	printf("Measuring wakeup latency of up to %d timers from %d threads, %d seconds per run...\n",
+	       ntimers, nthreads, seconds);
+	print_header();
+	for (step = scaling ? 1 : ntimers; ; step = (step * 2 < ntimers) ? step * 2 : ntimers) {
+		total = &runs[nruns];
+		total->ntimers = step;
+		if (bench_step(step, nthreads, seconds, total)) {
+			free(runs);
+			return -1;
+		}
+		nruns++;
+		print_row(total);
+		if (interrupted || step == ntimers)
+			break;
+	}
+	if (verbose) {
+		printf("\nWakeup latency with %d timers:\n", step);
+		hist_print_buckets(stdout, &total->latency, 1e3, "us");
+		printf("\nWakeup jitter with %d timers:\n", step);
+		hist_print_buckets(stdout, &total->jitter, 1e3, "us");
+	}
+	if (json_file)
+		write_json(json_file, runs, nruns, nthreads, seconds);
+	free(runs);
+	return 0;
+}
+
+static int parse_intervals(char *list)
+{
+	char *tok;
+
+	numintervals = 0;
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		if (numintervals >= MAX_INTERVALS) {
+			fprintf(stderr, "At most %d intervals may be given\n", MAX_INTERVALS);
+			return -1;
+		}
+		intervals[numintervals] = atoi(tok);
+		if (intervals[numintervals] <= 0) {
+			fprintf(stderr, "Invalid interval '%s'\n", tok);
+			return -1;
+		}
+		numintervals++;
+	}
+	return numintervals ? 0 : -1;
+}
+
+static void usage(char *argv0)
+{
+	char *c;
+	c = strrchr(argv0, '/');
+	if (!c)
+		c = argv0;
+	else
+		c++;
+	fprintf(stderr,
+		"Usage: %s [-n TIMERS] [-i SAMPLES[,SAMPLES...]] [-T THREADS] [-c SECONDS] [-s] [-j FILE] [-v]\n"
+		"    Without options a single 8000 sample timer is opened and every\n"
+		"    expiry is printed. Any option selects the benchmark mode:\n"
+		"  -n TIMERS   Number of timers to open (default: 1).\n"
+		"  -i SAMPLES  Timer interval(s) in samples, assigned to the timers\n"
+		"              round-robin (default: %d).\n"
+		"  -T THREADS  Number of worker threads (default: 1).\n"
+		"  -c SECONDS  Length of each run (default: 10).\n"
+		"  -s          Scaling curve: run with 1, 2, 4, ... up to TIMERS timers.\n"
+		"  -j FILE     Also write the results as JSON to FILE (- for stdout).\n"
+		"  -v          More verbose output (histogram; -vv: every timer).\n"
+		"  -h          This help text.\n"
+	, c, DEFAULT_SAMPLES);
+}
 
 int main(int argc, char *argv[])
 {
 	int fd;
 	int x = 8000;
 	int res;
+	int c;
+	int bench = 0;
+	int ntimers = 1;
+	int nthreads = 1;
+	int seconds = 10;
+	int scaling = 0;
 	fd_set fds;
 	struct timeval orig, now;
+
+	while ((c = getopt(argc, argv, "n:i:T:c:sj:vh")) != -1) {
+		switch (c) {
+		case 'n':
+			ntimers = atoi(optarg);
+			bench = 1;
+			break;
+		case 'i':
+			if (parse_intervals(optarg)) {
+				usage(argv[0]);
+				exit(1);
+			}
+			bench = 1;
+			break;
+		case 'T':
+			nthreads = atoi(optarg);
+			bench = 1;
+			break;
+		case 'c':
+			seconds = atoi(optarg);
+			bench = 1;
+			break;
+		case 's':
+			scaling = 1;
+			bench = 1;
+			break;
+		case 'j':
+			json_file = optarg;
+			bench = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (bench) {
+		if (!numintervals) {
+			intervals[0] = DEFAULT_SAMPLES;
+			numintervals = 1;
+		}
+		if (ntimers < 1 || nthreads < 1 || seconds < 1) {
+			usage(argv[0]);
+			exit(1);
+		}
+		exit(bench_run(ntimers, nthreads, seconds, scaling) ? 1 : 0);
+	}
+
 	fd = open("/dev/dahdi/timer", O_RDWR);
 	if (fd < 0) {
 		fprintf(stderr, "Unable to open timer: %s\n", strerror(errno));
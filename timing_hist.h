@@ -0,0 +1,167 @@
+/*
+ * timing_hist.h -- log-bucketed latency histogram shared by the timing tools
+ *
+ * Values (normally nanoseconds) below HIST_SUB_COUNT get a bucket each;
+ * every power of two above that is split into HIST_SUB_COUNT linear
+ * sub-buckets (HDR-style), so a recorded value is never off by more
+ * than 1% while the whole 64 bit range fits in a fixed size table.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef TIMING_HIST_H
+#define TIMING_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#define HIST_SUB_BITS	7
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct timing_hist {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+static inline uint64_t timespec_diff_ns(const struct timespec *a,
+					const struct timespec *b)
+{
+	return (uint64_t)(a->tv_sec - b->tv_sec) * 1000000000ULL +
+		a->tv_nsec - b->tv_nsec;
+}
+
+static inline int timespec_before(const struct timespec *a,
+				  const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec) ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static inline int hist_index(uint64_t value)
+{
+	int shift;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT +
+		(int)(value >> shift) - HIST_SUB_COUNT;
+}
+
+/* Highest value that lands in bucket 'index' */
+static inline uint64_t hist_highest(int index)
+{
+	int shift;
+	uint64_t sub;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+	shift = index / HIST_SUB_COUNT - 1;
+	sub = index % HIST_SUB_COUNT + HIST_SUB_COUNT;
+	return ((sub + 1) << shift) - 1;
+}
+
+static inline void hist_add(struct timing_hist *h, uint64_t value)
+{
+	h->counts[hist_index(value)]++;
+	if (!h->count || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->sum += value;
+	h->count++;
+}
+
+static inline void hist_merge(struct timing_hist *dst,
+			      const struct timing_hist *src)
+{
+	int x;
+
+	if (!src->count)
+		return;
+	for (x = 0; x < HIST_BUCKETS; x++)
+		dst->counts[x] += src->counts[x];
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+}
+
+static inline double hist_mean(const struct timing_hist *h)
+{
+	return h->count ? (double)h->sum / h->count : 0.0;
+}
+
+static inline uint64_t hist_percentile(const struct timing_hist *h,
+				       double percentile)
+{
+	uint64_t wanted;
+	uint64_t seen = 0;
+	int x;
+
+	if (!h->count)
+		return 0;
+	wanted = (uint64_t)ceil(h->count * percentile / 100.0);
+	if (wanted < 1)
+		wanted = 1;
+	for (x = 0; x < HIST_BUCKETS; x++) {
+		seen += h->counts[x];
+		if (seen >= wanted)
+			return (hist_highest(x) < h->max) ? hist_highest(x) : h->max;
+	}
+	return h->max;
+}
+
+/* Print the populated buckets, values scaled by 'div' (e.g. 1e6 for ms) */
+static inline void hist_print_buckets(FILE *fp, const struct timing_hist *h,
+				      double div, const char *unit)
+{
+	int x;
+
+	for (x = 0; x < HIST_BUCKETS; x++) {
+		if (h->counts[x])
+			fprintf(fp, "  <= %10.3f %s: %llu\n",
+				hist_highest(x) / div, unit,
+				(unsigned long long)h->counts[x]);
+	}
+}
+
+/* JSON array of the populated buckets, as [highest value, count] */
+static inline void hist_print_json(FILE *fp, const struct timing_hist *h,
+				   const char *indent)
+{
+	int x;
+	int first = 1;
+
+	fprintf(fp, "[");
+	for (x = 0; x < HIST_BUCKETS; x++) {
+		if (!h->counts[x])
+			continue;
+		fprintf(fp, "%s\n%s\t[%llu, %llu]", first ? "" : ",", indent,
+			(unsigned long long)hist_highest(x),
+			(unsigned long long)h->counts[x]);
+		first = 0;
+	}
+	fprintf(fp, "\n%s]", indent);
+}
+
+#endif /* TIMING_HIST_H */
@@ -0,0 +1,181 @@
+/*
+ * tone_dft.c -- DFT of a few tones in one pass over the samples
+ *
+ * fxotune used to correlate its buffers with one frequency at a time,
+ * calling cos() and sin() for every sample. Here the twiddles come from a
+ * table and every frequency is done in the same pass.
+ *
+ * The sums are kept in float and rounded after each sample, in sample
+ * order, with the products done in double: exactly what the old code did
+ * with a float accumulator and a double cos(). The SIMD versions only put
+ * the frequencies side by side, so they round the same way.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tone_dft.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TONE_DFT_X86
+#include <immintrin.h>
+#endif
+
+int tone_dft_init(struct tone_dft *dft, const int *freqs, int nfreqs, int len)
+{
+	int i, k;
+
+	if (nfreqs < 1 || nfreqs > TONE_DFT_MAX_FREQS || len < 1)
+		return -1;
+	dft->nfreqs = nfreqs;
+	dft->len = len;
+	dft->stride = nfreqs * 2;
+	dft->tw = calloc((size_t)len * dft->stride, sizeof(*dft->tw));
+	if (!dft->tw)
+		return -1;
+	for (i = 0; i < len; i++) {
+		for (k = 0; k < nfreqs; k++) {
+			tone_dft_set(dft, i, k,
+				     cos((i * 2.0 * M_PI * freqs[k])/TONE_DFT_RATE),
+				     sin((i * 2.0 * M_PI * freqs[k])/TONE_DFT_RATE));
+		}
+	}
+	return 0;
+}
+
+void tone_dft_free(struct tone_dft *dft)
+{
+	free(dft->tw);
+	dft->tw = NULL;
+}
+
+void tone_dft_set(struct tone_dft *dft, int i, int k, double c, double s)
+{
+	dft->tw[i * dft->stride + k * 2] = c;
+	dft->tw[i * dft->stride + k * 2 + 1] = s;
+}
+
+void tone_dft_direct(const short *buf, int len, int freq, float *re, float *im)
+{
+	float myreal = 0, myimag = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		myreal += (float) buf[i] * cos((i * 2.0 * M_PI * freq)/TONE_DFT_RATE);
+		myimag += (float) buf[i] * sin((i * 2.0 * M_PI * freq)/TONE_DFT_RATE);
+	}
+	*re = myreal;
+	*im = myimag;
+}
+
+static void run_scalar(const struct tone_dft *dft, const short *buf, int len,
+		       float *sums)
+{
+	const double *tw = dft->tw;
+	int n = dft->nfreqs * 2;
+	float x;
+	int i, j;
+
+	for (j = 0; j < n; j++)
+		sums[j] = 0;
+	for (i = 0; i < len; i++, tw += dft->stride) {
+		x = buf[i];
+		for (j = 0; j < n; j++)
+			sums[j] += x * tw[j];
+	}
+}
+
+#ifdef TONE_DFT_X86
+
+/*
+ * Each lane holds a float sum widened to double: after the double
+ * multiply and add it is narrowed to float and widened back, which is
+ * what assigning to a float accumulator does. That rounding makes every
+ * sum one long chain of dependent instructions, so the time goes on
+ * latency; wider AVX vectors only make the conversions slower.
+ */
+__attribute__((target("sse2")))
+static void run_sse2(const struct tone_dft *dft, const short *buf, int len,
+		     float *sums)
+{
+	__m128d acc[TONE_DFT_MAX_FREQS];
+	double out[TONE_DFT_MAX_FREQS * 2];
+	const double *tw = dft->tw;
+	int nv = dft->stride / 2;
+	__m128d x, v;
+	int i, j;
+
+	for (j = 0; j < nv; j++)
+		acc[j] = _mm_setzero_pd();
+	for (i = 0; i < len; i++, tw += dft->stride) {
+		x = _mm_set1_pd(buf[i]);
+		for (j = 0; j < nv; j++) {
+			v = _mm_add_pd(acc[j], _mm_mul_pd(x, _mm_loadu_pd(tw + j * 2)));
+			acc[j] = _mm_cvtps_pd(_mm_cvtpd_ps(v));
+		}
+	}
+	for (j = 0; j < nv; j++)
+		_mm_storeu_pd(out + j * 2, acc[j]);
+	for (j = 0; j < dft->nfreqs * 2; j++)
+		sums[j] = out[j];
+}
+
+#endif /* TONE_DFT_X86 */
+
+void (*tone_dft_run)(const struct tone_dft *dft, const short *buf, int len,
+		     float *sums) = run_scalar;
+
+int tone_dft_select(enum tone_dft_impl impl)
+{
+	switch (impl) {
+	case TONE_DFT_IMPL_SCALAR:
+		tone_dft_run = run_scalar;
+		return 0;
+#ifdef TONE_DFT_X86
+	case TONE_DFT_IMPL_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		tone_dft_run = run_sse2;
+		return 0;
+#endif
+	default:
+		return -1;
+	}
+}
+
+void tone_dft_kernels_init(void)
+{
+	int impl;
+
+	for (impl = TONE_DFT_IMPL_COUNT - 1; impl > TONE_DFT_IMPL_SCALAR; impl--) {
+		if (!tone_dft_select(impl))
+			return;
+	}
+	tone_dft_select(TONE_DFT_IMPL_SCALAR);
+}
+
+const char *tone_dft_impl_name(enum tone_dft_impl impl)
+{
+	switch (impl) {
+	case TONE_DFT_IMPL_SCALAR:
+		return "scalar";
+	case TONE_DFT_IMPL_SSE2:
+		return "sse2";
+	default:
+		return "unknown";
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * tone_dft.h -- DFT of a few tones in one pass over the samples
+ *
+ * The cosine and sine of every frequency at every sample index are worked
+ * out once, so a pass is only multiplies and adds, done for all the
+ * frequencies side by side. As with pcm_kernels, there are plain C and
+ * SSE2 versions picked at run time, and they give the same sums, bit for
+ * bit, as tone_dft_direct().
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef TONE_DFT_H
+#define TONE_DFT_H
+
+#define TONE_DFT_RATE		8000
+#define TONE_DFT_MAX_FREQS	8
+
+enum tone_dft_impl {
+	TONE_DFT_IMPL_SCALAR,
+	TONE_DFT_IMPL_SSE2,
+	TONE_DFT_IMPL_COUNT,
+};
+
+struct tone_dft {
+	int nfreqs;
+	int len;		/*!< longest buffer the twiddles cover */
+	int stride;		/*!< twiddles per sample */
+	double *tw;		/*!< cos, sin of each frequency, for each sample */
+};
+
+/* Twiddles for up to len samples; returns -1 if out of memory */
+int tone_dft_init(struct tone_dft *dft, const int *freqs, int nfreqs, int len);
+
+void tone_dft_free(struct tone_dft *dft);
+
+/* Replace the twiddles of frequency k at sample i (e.g. from a table) */
+void tone_dft_set(struct tone_dft *dft, int i, int k, double c, double s);
+
+/*
+ * Correlate len samples (at most dft->len) with every frequency:
+ * sums[2*k] += buf[i] * cos, sums[2*k+1] += buf[i] * sin, added up in
+ * float in sample order.
+ */
+extern void (*tone_dft_run)(const struct tone_dft *dft, const short *buf,
+			    int len, float *sums);
+
+/* The same for one frequency, with cos() and sin() at every sample */
+void tone_dft_direct(const short *buf, int len, int freq, float *re, float *im);
+
+/* Use the best implementation this CPU supports */
+void tone_dft_kernels_init(void);
+
+/* Force an implementation; returns -1 if this CPU can't run it */
+int tone_dft_select(enum tone_dft_impl impl);
+
+const char *tone_dft_impl_name(enum tone_dft_impl impl);
+
+#endif